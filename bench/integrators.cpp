@@ -0,0 +1,87 @@
+// Integrator benchmark: renders a generated scene of a mirror height field under glass spheres
+// with the depth-first and the wavefront integrator, times both and checks the images match.
+// usage: integrators [grid_size = 200] [depth = 6] [resolution = 400] [repetitions = 3]
+
+#define RTRACER_NO_MAIN
+#include "rtracer.cpp"
+#include "scenes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+
+// grid_size x grid_size mirror height field, a 3x3 block of glass spheres above it, two lights
+void WriteMirrorScene(const std::filesystem::path &directory, int grid_size) {
+  WriteMaterials(directory / "integrators.mtl");
+
+  std::ofstream output(directory / "integrators.obj");
+  output << "mtllib integrators.mtl\n";
+  output << "P 0 8 4 0.8 0.8 0.8\n";
+  output << "P -6 5 -2 0.5 0.5 0.5\n";
+  output << "usemtl mirror\n";
+  int vertex_count = 0;
+  WriteHeightField(output, vertex_count, grid_size,
+                   [](double x, double z) { return -1 + 0.3 * std::sin(x) * std::cos(z); });
+  output << "usemtl glass\n";
+  for (int x = -1; x <= 1; ++x) {
+    for (int z = 0; z < 3; ++z) {
+      output << "S " << 3 * x << " 1 " << -7 - 4 * z << " 1.2\n";
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int grid_size = argc > 1 ? std::atoi(argv[1]) : 200;
+  int depth = argc > 2 ? std::atoi(argv[2]) : 6;
+  int resolution = argc > 3 ? std::atoi(argv[3]) : 400;
+  int repetitions = argc > 4 ? std::atoi(argv[4]) : 3;
+
+  auto directory = std::filesystem::temp_directory_path();
+  WriteMirrorScene(directory, grid_size);
+
+  CameraOptions camera_options{.screen_width = resolution,
+    .screen_height = resolution,
+    .look_from = {0., 3., 4.},
+    .look_to = {0., 0., -10.}};
+
+  // best time of `repetitions` renders and the last image
+  auto render = [&](Integrator integrator, double &best) {
+    RenderOptions render_options{depth, RenderMode::kFull};
+    render_options.integrator = integrator;
+    best = std::numeric_limits<double>::infinity();
+    for (int i = 1;; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      auto image = Render(directory / "integrators.obj", camera_options, render_options);
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      best = std::min(best, elapsed.count());
+      if (i >= repetitions) {
+        return image;
+      }
+    }
+  };
+
+  double depth_first_time, wavefront_time;
+  auto depth_first = render(Integrator::kDepthFirst, depth_first_time);
+  auto wavefront = render(Integrator::kWavefront, wavefront_time);
+  std::filesystem::remove(directory / "integrators.obj");
+  std::filesystem::remove(directory / "integrators.mtl");
+
+  int different = 0;
+  for (int y = 0; y < resolution; ++y) {
+    for (int x = 0; x < resolution; ++x) {
+      auto a = depth_first.GetPixel(y, x), b = wavefront.GetPixel(y, x);
+      different += a.r != b.r || a.g != b.g || a.b != b.b;
+    }
+  }
+
+  std::printf("%d triangles, depth %d, %dx%d\n", 2 * (grid_size - 1) * (grid_size - 1), depth,
+              resolution, resolution);
+  std::printf("depth-first: %.3f s\nwavefront:   %.3f s (%.2fx)\n", depth_first_time,
+              wavefront_time, depth_first_time / wavefront_time);
+  std::printf("pixels that differ: %d\n", different);
+}
@@ -0,0 +1,71 @@
+// Load-time benchmark: writes a generated grid mesh as OBJ and times ReadScene on it.
+// usage: load_scene [grid_size = 1000] [repetitions = 3]
+
+#include "scene.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+
+// grid_size x grid_size vertices of a wavy height field, all three face index forms
+void WriteGridMesh(const std::filesystem::path &path, int grid_size) {
+  std::ofstream output(path);
+  output << "# generated " << grid_size << "x" << grid_size << " grid\n";
+  for (int i = 0; i < grid_size; ++i) {
+    for (int j = 0; j < grid_size; ++j) {
+      double height = 0.1 * std::sin(i * 0.05) * std::cos(j * 0.05);
+      output << "v " << i * 0.01 << ' ' << height << ' ' << j * 0.01 << '\n';
+      output << "vn 0 1 0\n";
+    }
+  }
+  auto index = [&](int i, int j) { return i * grid_size + j + 1; };
+  for (int i = 0; i + 1 < grid_size; ++i) {
+    for (int j = 0; j + 1 < grid_size; ++j) {
+      auto a = index(i, j), b = index(i + 1, j), c = index(i + 1, j + 1), d = index(i, j + 1);
+      switch ((i + j) % 3) {
+        case 0:
+          output << "f " << a << ' ' << b << ' ' << c << ' ' << d << '\n';
+          break;
+        case 1:
+          output << "f " << a << "//" << a << ' ' << b << "//" << b << ' ' << c << "//" << c
+                 << '\n';
+          output << "f " << a << "//" << a << ' ' << c << "//" << c << ' ' << d << "//" << d
+                 << '\n';
+          break;
+        default:
+          output << "f " << a << "/1/" << a << ' ' << b << "/1/" << b << ' ' << c << "/1/" << c
+                 << ' ' << d << "/1/" << d << '\n';
+      }
+    }
+  }
+  output << "S 0 0.5 0 0.25\n";
+  output << "P 0 5 0 1 1 1\n";
+}
+
+int main(int argc, char **argv) {
+  int grid_size = argc > 1 ? std::atoi(argv[1]) : 1000;
+  int repetitions = argc > 2 ? std::atoi(argv[2]) : 3;
+
+  auto path = std::filesystem::temp_directory_path() / "rtracer_load_scene.obj";
+  WriteGridMesh(path, grid_size);
+  auto megabytes = std::filesystem::file_size(path) / 1e6;
+
+  double best = std::numeric_limits<double>::infinity();
+  size_t triangles = 0;
+  for (int i = 0; i < repetitions; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    auto scene = ReadScene(path);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+    triangles = scene.GetTriangles().Size();
+  }
+  std::filesystem::remove(path);
+
+  std::printf("%zu triangles, %.1f MB: %.3f s (%.0f MB/s)\n", triangles, megabytes, best,
+              megabytes / best);
+}
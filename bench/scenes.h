@@ -0,0 +1,36 @@
+#pragma once
+
+// Pieces of the generated benchmark scenes, shared so every benchmark renders the same surfaces
+
+#include <filesystem>
+#include <fstream>
+
+// diffuse, mirror and glass
+inline void WriteMaterials(const std::filesystem::path &path) {
+  std::ofstream output(path);
+  output << "newmtl diffuse\nKd 0.6 0.6 0.6\nKs 0.2 0.2 0.2\nNs 20\nal 1 0 0\n";
+  output << "newmtl mirror\nKd 0.2 0.2 0.3\nKs 0.8 0.8 0.8\nNs 100\nal 0.5 0.5 0\n";
+  output << "newmtl glass\nKd 0 0 0\nKs 0.5 0.5 0.5\nNs 125\nNi 1.5\nal 0 0.3 0.8\n";
+}
+
+// grid_size x grid_size vertexes at height(x, z) over x in [-8, 8], z in [-20, -4], one quad
+// per cell, in the current material
+template <class Height>
+void WriteHeightField(std::ofstream &output, int &vertex_count, int grid_size, Height &&height) {
+  int first = vertex_count + 1;
+  for (int i = 0; i < grid_size; ++i) {
+    for (int j = 0; j < grid_size; ++j) {
+      double x = -8 + 16.0 * i / (grid_size - 1);
+      double z = -20 + 16.0 * j / (grid_size - 1);
+      output << "v " << x << ' ' << height(x, z) << ' ' << z << '\n';
+    }
+  }
+  vertex_count += grid_size * grid_size;
+  auto index = [&](int i, int j) { return first + i * grid_size + j; };
+  for (int i = 0; i + 1 < grid_size; ++i) {
+    for (int j = 0; j + 1 < grid_size; ++j) {
+      output << "f " << index(i, j) << ' ' << index(i, j + 1) << ' ' << index(i + 1, j + 1) << ' '
+             << index(i + 1, j) << '\n';
+    }
+  }
+}
@@ -0,0 +1,151 @@
+// Sequence benchmark: animates a generated scene (a rippling mirror height field, glass spheres
+// circling above it, a moving light and a turntable camera) with RenderSequence, once refitting
+// the BVH between frames and once rebuilding it for every frame. Prints the per frame setup
+// (scene update and BVH) next to the trace time and checks both give the same images.
+// usage: sequence [grid_size = 300] [frames = 24] [resolution = 300]
+
+#define RTRACER_NO_MAIN
+#include "rtracer.cpp"
+#include "scenes.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <numbers>
+#include <sstream>
+#include <string>
+#include <vector>
+
+double Wave(double x, double z, double time) {
+  return -1 + 0.3 * std::sin(x + time) * std::cos(z - time);
+}
+
+// grid_size x grid_size mirror height field around (0, -1, -12), a ring of glass spheres, a light
+void WriteRippleScene(const std::filesystem::path &directory, int grid_size) {
+  WriteMaterials(directory / "sequence.mtl");
+
+  std::ofstream output(directory / "sequence.obj");
+  output << "mtllib sequence.mtl\n";
+  output << "P 0 8 -8 0.8 0.8 0.8\n";
+  output << "usemtl mirror\n";
+  int vertex_count = 0;
+  WriteHeightField(output, vertex_count, grid_size,
+                   [](double x, double z) { return Wave(x, z, 0); });
+  output << "usemtl glass\n";
+  for (int k = 0; k < 8; ++k) {
+    auto angle = 2 * std::numbers::pi * k / 8;
+    output << "S " << 4 * std::cos(angle) << " 1 " << -12 + 4 * std::sin(angle) << " 0.8\n";
+  }
+}
+
+// Per frame: the surface ripples, the spheres circle the centre, the light and the camera orbit
+FrameUpdate<double> MakeAnimation(const Scene &rest, int frames, int resolution,
+                                  const std::filesystem::path &output_prefix) {
+  auto rest_positions = rest.GetTriangles().GetPositions();
+  std::vector<Vector> rest_centres(rest.GetSphereObjects().size());
+  for (size_t i = 0; i < rest_centres.size(); ++i) {
+    rest_centres[rest.GetSphereIds()[i]] = rest.GetSphereObjects()[i].sphere.GetCenter();
+  }
+
+  return [=](Scene &scene, ThreadPool &pool, int frame) {
+    auto turn = 2 * std::numbers::pi * frame / frames;
+    Vector centre = {0, -1, -12};
+    auto orbit = [&](const Vector &point, double angle) {
+      auto offset = point - centre;
+      return centre + Vector{offset[0] * std::cos(angle) - offset[2] * std::sin(angle), offset[1],
+                             offset[0] * std::sin(angle) + offset[2] * std::cos(angle)};
+    };
+
+    scene.UpdateVertices(pool, [&](uint32_t vertex, Vector &position) {
+      position = rest_positions[vertex];
+      position[1] = Wave(position[0], position[2], turn);
+    });
+    scene.UpdateSpheres(pool, [&](uint32_t id, SphereObject &object) {
+      object.sphere = Sphere(orbit(rest_centres[id], turn), object.sphere.GetRadius());
+    });
+    scene.UpdateLights([&](uint32_t, Light &light) {
+      light.position = orbit({0, 8, -8}, -turn);
+    });
+
+    RenderJob job;
+    job.camera = {.screen_width = resolution, .screen_height = resolution,
+      .look_from = orbit({0, 4, 0}, turn / 2), .look_to = centre};
+    job.render = {6, RenderMode::kFull};
+    job.render.stats_report = true;
+    job.output = output_prefix.string() + std::to_string(frame) + ".png";
+    return job;
+  };
+}
+
+// a phase of a stats report, 0 when it didn't run
+double ReadPhase(const std::filesystem::path &report, const std::string &phase) {
+  std::ifstream input(report);
+  std::stringstream text;
+  text << input.rdbuf();
+  auto key = "\"" + phase + "\": ";
+  auto position = text.str().find(key);
+  return position == std::string::npos ? 0 : std::stod(text.str().substr(position + key.size()));
+}
+
+int main(int argc, char **argv) {
+  int grid_size = argc > 1 ? std::atoi(argv[1]) : 300;
+  int frames = std::max(2, argc > 2 ? std::atoi(argv[2]) : 24);
+  int resolution = argc > 3 ? std::atoi(argv[3]) : 300;
+
+  auto directory = std::filesystem::temp_directory_path();
+  WriteRippleScene(directory, grid_size);
+  auto rest = ReadScene(directory / "sequence.obj");
+  std::printf("%zu triangles, %zu spheres, %d frames of %dx%d\n", rest.GetTriangles().Size(),
+              rest.GetSphereObjects().size(), frames, resolution, resolution);
+
+  // refit (rebuilding only past the cost limit), or rebuild every frame with a limit of 0
+  auto run = [&](const char *name, double max_refit_cost) {
+    auto prefix = directory / (std::string("sequence_") + name + "_");
+    auto scene = rest;
+    RenderOptions scene_options{6, RenderMode::kFull};
+    scene_options.max_refit_cost = max_refit_cost;
+    RenderSequence(scene, frames, MakeAnimation(rest, frames, resolution, prefix), scene_options);
+
+    // the first frame also reports the initial build, it is left out
+    double update = 0, refit = 0, bvh = 0, trace = 0;
+    int rebuilds = 0;
+    for (int frame = 1; frame < frames; ++frame) {
+      auto report = prefix.string() + std::to_string(frame) + ".stats.json";
+      update += ReadPhase(report, "update");
+      refit += ReadPhase(report, "refit");
+      bvh += ReadPhase(report, "bvh");
+      rebuilds += ReadPhase(report, "bvh") > 0;
+      trace += ReadPhase(report, "trace");
+    }
+    auto ms = [&](double seconds) { return 1e3 * seconds / (frames - 1); };
+    std::printf("%-8s per frame: update %.2f ms, refit %.2f ms, rebuild %.2f ms (%d of %d "
+                "frames), trace %.2f ms, setup %.1f%% of trace\n",
+                name, ms(update), ms(refit), ms(bvh), rebuilds, frames - 1, ms(trace),
+                100 * (update + refit + bvh) / trace);
+    return prefix;
+  };
+  auto refit_prefix = run("refit", RenderOptions{}.max_refit_cost);
+  auto rebuild_prefix = run("rebuild", 0);
+
+  int different = 0;
+  for (int frame = 0; frame < frames; ++frame) {
+    auto suffix = std::to_string(frame);
+    Image a(refit_prefix.string() + suffix + ".png"), b(rebuild_prefix.string() + suffix + ".png");
+    for (int y = 0; y < resolution; ++y) {
+      for (int x = 0; x < resolution; ++x) {
+        auto pa = a.GetPixel(y, x), pb = b.GetPixel(y, x);
+        different += pa.r != pb.r || pa.g != pb.g || pa.b != pb.b;
+      }
+    }
+    for (const auto &prefix : {refit_prefix, rebuild_prefix}) {
+      std::filesystem::remove(prefix.string() + suffix + ".png");
+      std::filesystem::remove(prefix.string() + suffix + ".stats.json");
+    }
+  }
+  std::filesystem::remove(directory / "sequence.obj");
+  std::filesystem::remove(directory / "sequence.mtl");
+  std::printf("pixels that differ between refit and rebuild: %d\n", different);
+}
@@ -0,0 +1,357 @@
+// Benchmark suite: generates scenes of controlled size and character, times loading, BVH builds,
+// primary ray throughput and whole renders in every RenderMode and with 1 and all hardware
+// threads, and writes the results as JSON to compare across commits.
+// usage: suite [output = bench_results.json] [scale = 1] [repetitions = 3]
+//        suite --compare baseline.json current.json [tolerance = 0.05]
+
+#define RTRACER_NO_MAIN
+#include "rtracer.cpp"
+#include "scenes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <numbers>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// deterministic uniform values in [low, high), the same scenes on every machine
+class SceneRandom {
+public:
+  double Uniform(double low, double high) {
+    return low + (high - low) * ToUnitInterval(MixBits(state_++));
+  }
+
+private:
+  uint64_t state_ = 0;
+};
+
+void WriteFloor(std::ofstream &output, int &vertex_count) {
+  output << "usemtl diffuse\n";
+  output << "v -4 -1 -4\nv 4 -1 -4\nv 4 -1 4\nv -4 -1 4\n";
+  output << "f " << vertex_count + 1 << ' ' << vertex_count + 4 << ' ' << vertex_count + 3 << ' '
+         << vertex_count + 2 << '\n';
+  vertex_count += 4;
+}
+
+// latitude-longitude sphere of 2 * segments * (segments - 1) triangles
+void WriteTessellatedSphere(std::ofstream &output, int &vertex_count, double x, double y,
+                            double z, double radius, int segments) {
+  int first = vertex_count + 1;
+  for (int i = 0; i <= segments; ++i) {
+    double theta = std::numbers::pi * i / segments;
+    for (int j = 0; j < 2 * segments; ++j) {
+      double phi = std::numbers::pi * j / segments;
+      output << "v " << x + radius * std::sin(theta) * std::cos(phi) << ' '
+             << y + radius * std::cos(theta) << ' '
+             << z + radius * std::sin(theta) * std::sin(phi) << '\n';
+    }
+  }
+  vertex_count += (segments + 1) * 2 * segments;
+  auto index = [&](int i, int j) { return first + i * 2 * segments + j % (2 * segments); };
+  for (int i = 0; i < segments; ++i) {
+    for (int j = 0; j < 2 * segments; ++j) {
+      if (i > 0) {
+        output << "f " << index(i, j) << ' ' << index(i, j + 1) << ' ' << index(i + 1, j) << '\n';
+      }
+      if (i + 1 < segments) {
+        output << "f " << index(i, j + 1) << ' ' << index(i + 1, j + 1) << ' ' << index(i + 1, j)
+               << '\n';
+      }
+    }
+  }
+}
+
+struct BenchScene {
+  std::string name;
+  int depth;  // bounces of the kFull renders
+  // writes the OBJ body, scale multiplies the primitive count
+  void (*write)(std::ofstream &output, int scale);
+};
+
+// randomly placed and oriented small triangles, no coherence for the BVH to exploit
+void WriteTriangleSoup(std::ofstream &output, int scale) {
+  SceneRandom random;
+  output << "P 0 4 3 1 1 1\nusemtl diffuse\n";
+  int triangles = 100000 * scale;
+  for (int i = 0; i < triangles; ++i) {
+    double x = random.Uniform(-2, 2), y = random.Uniform(-1, 1.5), z = random.Uniform(-2, 2);
+    for (int k = 0; k < 3; ++k) {
+      output << "v " << x + random.Uniform(-0.1, 0.1) << ' ' << y + random.Uniform(-0.1, 0.1)
+             << ' ' << z + random.Uniform(-0.1, 0.1) << '\n';
+    }
+    output << "f " << 3 * i + 1 << ' ' << 3 * i + 2 << ' ' << 3 * i + 3 << '\n';
+  }
+}
+
+void WriteTessellatedSpheres(std::ofstream &output, int scale) {
+  output << "P 0 4 3 1 1 1\nP -3 2 1 0.4 0.4 0.4\n";
+  int vertex_count = 0;
+  WriteFloor(output, vertex_count);
+  int grid = 4 * scale;
+  for (int i = 0; i < grid; ++i) {
+    for (int j = 0; j < grid; ++j) {
+      output << ((i + j) % 2 ? "usemtl mirror\n" : "usemtl diffuse\n");
+      double x = -2 + 4.0 * (i + 0.5) / grid, z = -2 + 4.0 * (j + 0.5) / grid;
+      WriteTessellatedSphere(output, vertex_count, x, -0.5, z, 1.6 / grid, 48);
+    }
+  }
+}
+
+void WriteManySpheres(std::ofstream &output, int scale) {
+  SceneRandom random;
+  output << "P 0 4 3 1 1 1\n";
+  int vertex_count = 0;
+  WriteFloor(output, vertex_count);
+  output << "usemtl diffuse\n";
+  int spheres = 10000 * scale;
+  for (int i = 0; i < spheres; ++i) {
+    output << "S " << random.Uniform(-2, 2) << ' ' << random.Uniform(-1, 1.5) << ' '
+           << random.Uniform(-2, 2) << ' ' << random.Uniform(0.01, 0.05) << '\n';
+  }
+}
+
+// few primitives lit by many point lights, shading dominates
+void WriteManyLights(std::ofstream &output, int scale) {
+  SceneRandom random;
+  int lights = 128 * scale;
+  for (int i = 0; i < lights; ++i) {
+    output << "P " << random.Uniform(-4, 4) << ' ' << random.Uniform(1, 4) << ' '
+           << random.Uniform(-4, 4) << " 0.02 0.02 0.02\n";
+  }
+  int vertex_count = 0;
+  WriteFloor(output, vertex_count);
+  for (int x = -1; x <= 1; ++x) {
+    for (int z = -1; z <= 1; ++z) {
+      output << "S " << x << " -0.6 " << z << " 0.4\n";
+    }
+  }
+}
+
+// groups of concentric glass shells under a mirror, long refraction paths
+void WriteNestedGlass(std::ofstream &output, int scale) {
+  output << "P 0 4 3 1 1 1\nP -3 2 1 0.4 0.4 0.4\n";
+  int vertex_count = 0;
+  WriteFloor(output, vertex_count);
+  output << "usemtl mirror\n";
+  output << "v -4 -1 -4\nv 4 -1 -4\nv 4 3 -4\nv -4 3 -4\n";
+  output << "f " << vertex_count + 1 << ' ' << vertex_count + 2 << ' ' << vertex_count + 3 << ' '
+         << vertex_count + 4 << '\n';
+  output << "usemtl glass\n";
+  int shells = 4 * scale;
+  for (int x = -1; x <= 1; ++x) {
+    for (int z = -1; z <= 0; ++z) {
+      for (int k = 0; k < shells; ++k) {
+        output << "S " << 1.2 * x << " 0 " << 1.5 * z << ' ' << 0.55 * (shells - k) / shells
+               << '\n';
+      }
+    }
+  }
+}
+
+const std::vector<BenchScene> kBenchScenes = {
+    {"triangle_soup", 4, WriteTriangleSoup},
+    {"tessellated_spheres", 4, WriteTessellatedSpheres},
+    {"many_spheres", 4, WriteManySpheres},
+    {"many_lights", 4, WriteManyLights},
+    {"nested_glass", 12, WriteNestedGlass},
+};
+
+struct BenchResult {
+  std::string scene;
+  std::string metric;  // load, bvh, primary_rays, render
+  std::string mode;    // RenderMode of render results, empty otherwise
+  size_t threads;
+  double value;
+  std::string unit;  // seconds are better lower, rays_per_second higher
+
+  std::string Key() const {
+    return scene + "/" + metric + (mode.empty() ? "" : "/" + mode) + "/" +
+           std::to_string(threads) + "t";
+  }
+};
+
+// best wall time of `repetitions` calls
+template <class Function>
+double BestTime(int repetitions, Function &&function) {
+  double best = std::numeric_limits<double>::infinity();
+  for (int i = 0; i < repetitions; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+// camera rays of the whole frame in packets of 4x4 pixels, traced on this thread
+uint64_t TracePrimaryRays(const Scene &scene, const CameraOptions &camera_options) {
+  Camera camera(camera_options);
+  std::vector<Ray> rays;
+  uint64_t hits = 0;
+  for (int y = 0; y < camera_options.screen_height; y += 4) {
+    for (int x = 0; x < camera_options.screen_width; x += 4) {
+      rays.clear();
+      for (int j = y; j < std::min(y + 4, camera_options.screen_height); ++j) {
+        camera.AppendRowRays(j, x, std::min(x + 4, camera_options.screen_width), 0.5, 0.5, rays);
+      }
+      for (const auto &point: GetClosestIntersectionPoints(std::span<const Ray>(rays), scene)) {
+        hits += point.has_value();
+      }
+    }
+  }
+  return hits;
+}
+
+std::vector<BenchResult> RunSuite(int scale, int repetitions) {
+  auto directory = std::filesystem::temp_directory_path() / "rtracer_bench_suite";
+  std::filesystem::create_directories(directory);
+  WriteMaterials(directory / "suite.mtl");
+
+  CameraOptions camera_options{.screen_width = 400,
+    .screen_height = 400,
+    .look_from = {0., 1.5, 4.5},
+    .look_to = {0., -0.3, 0.}};
+  std::vector<size_t> thread_counts = {1};
+  if (auto hardware = std::thread::hardware_concurrency(); hardware > 1) {
+    thread_counts.push_back(hardware);
+  }
+  const std::vector<std::pair<RenderMode, std::string>> modes = {
+      {RenderMode::kDepth, "depth"}, {RenderMode::kNormal, "normal"}, {RenderMode::kFull, "full"}};
+
+  std::vector<BenchResult> results;
+  auto add = [&](const BenchScene &bench_scene, std::string metric, std::string mode,
+                 size_t threads, double value, std::string unit) {
+    results.push_back({bench_scene.name, std::move(metric), std::move(mode), threads, value,
+                       std::move(unit)});
+    const auto &result = results.back();
+    std::printf("%-48s %12.4g %s\n", result.Key().c_str(), result.value, result.unit.c_str());
+    std::fflush(stdout);
+  };
+
+  for (const auto &bench_scene: kBenchScenes) {
+    auto path = directory / (bench_scene.name + ".obj");
+    {
+      std::ofstream output(path);
+      output << "mtllib suite.mtl\n";
+      bench_scene.write(output, scale);
+    }
+
+    for (auto threads: thread_counts) {
+      add(bench_scene, "load", "", threads,
+          BestTime(repetitions, [&] { ReadScene(path, threads); }), "seconds");
+    }
+
+    auto scene = ReadScene(path);
+    add(bench_scene, "bvh", "", 1, BestTime(repetitions, [&] { scene.BuildBvh(); }), "seconds");
+
+    auto pixels = 1.0 * camera_options.screen_width * camera_options.screen_height;
+    auto primary_time =
+        BestTime(repetitions, [&] { TracePrimaryRays(scene, camera_options); });
+    add(bench_scene, "primary_rays", "", 1, pixels / primary_time, "rays_per_second");
+
+    for (const auto &[mode, mode_name]: modes) {
+      for (auto threads: thread_counts) {
+        RenderOptions render_options{bench_scene.depth, mode};
+        render_options.thread_count = threads;
+        add(bench_scene, "render", mode_name, threads, BestTime(repetitions, [&] {
+              Render(path, camera_options, render_options);
+            }),
+            "seconds");
+      }
+    }
+    std::filesystem::remove(path);
+  }
+  std::filesystem::remove_all(directory);
+  return results;
+}
+
+// one result per line, ReadResults relies on that
+void WriteResults(const std::filesystem::path &path, const std::vector<BenchResult> &results,
+                  int scale, int repetitions) {
+  std::ofstream output(path);
+  if (!output) {
+    throw std::runtime_error{"Can't write " + path.string()};
+  }
+  output << "{\n  \"scale\": " << scale << ",\n  \"repetitions\": " << repetitions
+         << ",\n  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto &result = results[i];
+    output << "    {\"key\": \"" << result.Key() << "\", \"scene\": \"" << result.scene
+           << "\", \"metric\": \"" << result.metric << "\", \"mode\": \"" << result.mode
+           << "\", \"threads\": " << result.threads << ", \"value\": " << result.value
+           << ", \"unit\": \"" << result.unit << "\"}" << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  output << "  ]\n}\n";
+}
+
+// key -> (value, unit) of a file written by WriteResults
+std::map<std::string, std::pair<double, std::string>> ReadResults(
+    const std::filesystem::path &path) {
+  std::ifstream input(path);
+  if (!input) {
+    throw std::runtime_error{"Can't read " + path.string()};
+  }
+  static const std::regex kResult(
+      R"re("key": "([^"]*)".*"value": ([^,]*), "unit": "([^"]*)")re");
+  std::map<std::string, std::pair<double, std::string>> results;
+  std::string line;
+  while (std::getline(input, line)) {
+    std::smatch match;
+    if (std::regex_search(line, match, kResult)) {
+      results[match[1]] = {std::stod(match[2]), match[3]};
+    }
+  }
+  return results;
+}
+
+// Prints the change of every result present in both files, returns the number of regressions
+// beyond tolerance (relative).
+int CompareResults(const std::filesystem::path &baseline_path,
+                   const std::filesystem::path &current_path, double tolerance) {
+  auto baseline = ReadResults(baseline_path);
+  auto current = ReadResults(current_path);
+  int regressions = 0;
+  for (const auto &[key, entry]: current) {
+    auto it = baseline.find(key);
+    if (it == baseline.end()) {
+      std::printf("%-48s %12.4g %s (new)\n", key.c_str(), entry.first, entry.second.c_str());
+      continue;
+    }
+    // speedup > 1 is an improvement for either unit
+    auto speedup = entry.second == "seconds" ? it->second.first / entry.first
+                                             : entry.first / it->second.first;
+    bool regressed = speedup < 1 - tolerance;
+    regressions += regressed;
+    std::printf("%-48s %12.4g -> %-12.4g %s %.2fx%s\n", key.c_str(), it->second.first,
+                entry.first, entry.second.c_str(), speedup, regressed ? "  REGRESSION" : "");
+  }
+  return regressions;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && std::string(argv[1]) == "--compare") {
+    if (argc < 4) {
+      std::fprintf(stderr, "usage: suite --compare baseline.json current.json [tolerance]\n");
+      return 2;
+    }
+    double tolerance = argc > 4 ? std::atof(argv[4]) : 0.05;
+    return CompareResults(argv[2], argv[3], tolerance) > 0;
+  }
+
+  std::filesystem::path output = argc > 1 ? argv[1] : "bench_results.json";
+  int scale = argc > 2 ? std::atoi(argv[2]) : 1;
+  int repetitions = argc > 3 ? std::atoi(argv[3]) : 3;
+
+  auto results = RunSuite(scale, repetitions);
+  WriteResults(output, results, scale, repetitions);
+  std::printf("results written to %s\n", output.c_str());
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "vector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+template <class T>
+class BasicAabb {
+public:
+    BasicAabb() = default;
+    BasicAabb(const BasicVector<T>& min, const BasicVector<T>& max) : min_(min), max_(max) {
+    }
+
+    // precision conversion, rounds outwards so the box still contains everything it did
+    template <class U>
+    explicit BasicAabb(const BasicAabb<U>& other) {
+        if (other.IsEmpty()) {
+            return;
+        }
+        for (int i = 0; i < 3; ++i) {
+            min_[i] = static_cast<T>(other.GetMin()[i]);
+            max_[i] = static_cast<T>(other.GetMax()[i]);
+            if (min_[i] > other.GetMin()[i]) {
+                min_[i] = std::nextafter(min_[i], -kInf);
+            }
+            if (max_[i] < other.GetMax()[i]) {
+                max_[i] = std::nextafter(max_[i], kInf);
+            }
+        }
+    }
+
+    const BasicVector<T>& GetMin() const {
+        return min_;
+    }
+
+    const BasicVector<T>& GetMax() const {
+        return max_;
+    }
+
+    bool IsEmpty() const {
+        return min_[0] > max_[0];
+    }
+
+    bool Contains(const BasicVector<T>& point) const {
+        for (int i = 0; i < 3; ++i) {
+            if (point[i] < min_[i] || point[i] > max_[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Extend(const BasicVector<T>& point) {
+        for (int i = 0; i < 3; ++i) {
+            min_[i] = std::min(min_[i], point[i]);
+            max_[i] = std::max(max_[i], point[i]);
+        }
+    }
+
+    void Extend(const BasicAabb& other) {
+        if (other.IsEmpty()) {
+            return;
+        }
+        Extend(other.min_);
+        Extend(other.max_);
+    }
+
+    // grows the box by `delta` on every side, keeps flat boxes of axis-aligned polygons hittable
+    void Pad(T delta) {
+        min_ += -delta;
+        max_ += delta;
+    }
+
+    BasicVector<T> Center() const {
+        return (min_ + max_) * 0.5;
+    }
+
+    BasicVector<T> Extent() const {
+        return max_ - min_;
+    }
+
+    T SurfaceArea() const {
+        if (IsEmpty()) {
+            return 0.0;
+        }
+        auto extent = Extent();
+        return 2.0 * (extent[0] * extent[1] + extent[1] * extent[2] + extent[2] * extent[0]);
+    }
+
+private:
+    static constexpr T kInf = std::numeric_limits<T>::infinity();
+
+    BasicVector<T> min_{kInf, kInf, kInf};
+    BasicVector<T> max_{-kInf, -kInf, -kInf};
+};
+
+using Aabb = BasicAabb<double>;
@@ -5,68 +5,70 @@
 #include "intersection.h"
 #include "triangle.h"
 #include "ray.h"
+#include "aabb.h"
+#include "indexed_triangles.h"
 
 #include <optional>
 #include <iostream>
+#include <type_traits>
+#include <utility>
 
 static constexpr double kEpsilon = 1e-9;
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
-    auto origin = ray.GetOrigin();
-    auto vector_between = sphere.GetCenter() - origin;
+// distance-only queries skip normals and hit positions, enough for occlusion tests
+template <class T>
+std::optional<T> GetIntersectionDistance(const BasicRay<T>& ray, const BasicSphere<T>& sphere) {
+    auto vector_between = sphere.GetCenter() - ray.GetOrigin();
     auto len_of_projection_on_direction = DotProduct(vector_between, ray.GetDirection());
-    auto direction = ray.GetDirection();
-    auto proj = direction * len_of_projection_on_direction;
-    auto d_length = Length(proj - vector_between);
+    auto perpendicular = ray.GetDirection() * len_of_projection_on_direction - vector_between;
+    auto squared_radius = sphere.GetRadius() * sphere.GetRadius();
+    auto squared_d_length = DotProduct(perpendicular, perpendicular);
 
-    if (d_length > sphere.GetRadius()) {
+    if (squared_d_length > squared_radius) {
         return std::nullopt;
     }
 
-    auto delta_distance = std::sqrt(sphere.GetRadius() * sphere.GetRadius() - d_length * d_length);
-    Vector position_on;
+    auto delta_distance = std::sqrt(squared_radius - squared_d_length);
+    bool inside = DotProduct(vector_between, vector_between) <= squared_radius;
 
-    if (len_of_projection_on_direction > 0) {
-        position_on = sphere.Contains(origin) ? proj + direction * delta_distance
-                                              : proj - direction * delta_distance;
-    } else {
-        if (sphere.Contains(origin)) {
-            position_on = proj + direction * delta_distance;
-        } else {
-            return std::nullopt;
-        }
+    if (inside) {
+        return len_of_projection_on_direction + delta_distance;
     }
-
-    Vector normal;
-    if (Length(vector_between) > sphere.GetRadius()) {
-        normal = (position_on - vector_between);
-    } else {
-        normal = (vector_between - position_on);
+    if (len_of_projection_on_direction > 0) {
+        return len_of_projection_on_direction - delta_distance;
     }
+    return std::nullopt;
+}
 
-    normal.Normalize();
+// ray parameter and barycentric coordinates of the second and third vertex
+template <class T>
+struct BasicTriangleHit {
+    T distance;
+    T u, v;
+};
 
-    return Intersection(position_on + origin, normal, Length(position_on));
-}
+using TriangleHit = BasicTriangleHit<double>;
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
+// Möller–Trumbore for a triangle given by its first vertex and the edges ab, ac
+template <class T>
+std::optional<BasicTriangleHit<T>> GetIntersection(const BasicRay<T>& ray, const BasicVector<T>& a,
+                                                   const BasicVector<T>& ab,
+                                                   const BasicVector<T>& ac) {
     auto direction = ray.GetDirection();
     auto origin = ray.GetOrigin();
 
-    auto ab = triangle[1] - triangle[0];
-    auto ac = triangle[2] - triangle[0];
     auto up = CrossProduct(direction, ac);
 
     auto det = DotProduct(ab, up);
 
     // if perpendicular => direction || Lin(ab, ac), no intersection
-    if (std::abs(det) < kEpsilon) {
+    if (std::abs(det) < static_cast<T>(kEpsilon)) {
         return std::nullopt;
     }
 
-    auto inv_det = 1.0 / det;
+    auto inv_det = T{1} / det;
 
-    auto s = origin - triangle[0];
+    auto s = origin - a;
     auto u = inv_det * DotProduct(s, up);
 
     if (u < 0 || u > 1) {
@@ -82,27 +84,106 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& tria
 
     auto k = inv_det * DotProduct(ac, t);
 
-    if (k > kEpsilon) {
-        auto inter = origin + direction * k;
-        auto normal = CrossProduct(ab, ac);
+    if (k > static_cast<T>(kEpsilon)) {
+        return BasicTriangleHit<T>{k, u, v};
+    }
 
-        // from one part of space
-        if (DotProduct(normal, direction) > 0) {
-            normal = -normal;
-        }
+    return std::nullopt;
+}
+
+template <class T>
+std::optional<BasicTriangleHit<T>> GetIntersection(const BasicRay<T>& ray,
+                                                   const BasicIndexedTriangles<T>& triangles,
+                                                   size_t index) {
+    auto triangle = triangles.GetTriangle(index);
+    return GetIntersection(ray, triangle[0], triangle[1] - triangle[0], triangle[2] - triangle[0]);
+}
 
-        return Intersection(inter, normal, Length(origin - inter));
+template <class T>
+std::optional<T> GetIntersectionDistance(const BasicRay<T>& ray, const BasicTriangle<T>& triangle) {
+    auto hit =
+        GetIntersection(ray, triangle[0], triangle[1] - triangle[0], triangle[2] - triangle[0]);
+    if (!hit) {
+        return std::nullopt;
     }
+    return hit->distance;
+}
 
-    return std::nullopt;
-};
+// Shading data of hits found by the distance queries, built once for the closest one. The sphere
+// normal points away from the centre, towards it for rays starting inside.
+template <class T>
+BasicIntersection<T> GetIntersection(const BasicRay<T>& ray, const BasicSphere<T>& sphere,
+                                     T distance) {
+    auto position = ray.GetOrigin() + ray.GetDirection() * distance;
+    auto vector_between = sphere.GetCenter() - ray.GetOrigin();
+    bool inside =
+        DotProduct(vector_between, vector_between) <= sphere.GetRadius() * sphere.GetRadius();
+    auto normal = position - sphere.GetCenter();
+    return BasicIntersection<T>(position, inside ? -normal : normal, distance);
+}
+
+// the geometric normal, turned to face the ray
+template <class T>
+BasicIntersection<T> GetIntersection(const BasicRay<T>& ray, const BasicTriangle<T>& triangle,
+                                     const BasicTriangleHit<T>& hit) {
+    auto normal = triangle.GetNormal();
+    if (DotProduct(normal, ray.GetDirection()) > 0) {
+        normal = -normal;
+    }
+    return BasicIntersection<T>(ray.GetOrigin() + ray.GetDirection() * hit.distance, normal,
+                                hit.distance);
+}
+
+template <class T>
+BasicAabb<T> GetBounds(const BasicTriangle<T>& triangle) {
+    BasicAabb<T> bounds;
+    for (size_t i = 0; i < 3; ++i) {
+        bounds.Extend(triangle[i]);
+    }
+    return bounds;
+}
+
+template <class T>
+BasicAabb<T> GetBounds(const BasicSphere<T>& sphere) {
+    auto radius = sphere.GetRadius();
+    return BasicAabb<T>(sphere.GetCenter() + (-radius), sphere.GetCenter() + radius);
+}
+
+// slab test, returns the distance at which the ray enters the box if it is not beyond max_distance
+template <class T>
+std::optional<T> GetEntryDistance(const BasicRay<T>& ray, const BasicAabb<T>& box,
+                                  T max_distance) {
+    const auto& origin = ray.GetOrigin();
+    const auto& inv_direction = ray.GetInverseDirection();
+    auto signs = ray.GetDirectionSigns();
+    T t_min = 0.0;
+    T t_max = max_distance;
+
+    for (int i = 0; i < 3; ++i) {
+        // the slab a ray running towards -inf enters first is the max one
+        bool negative = (signs >> i) & 1;
+        auto t_near = ((negative ? box.GetMax() : box.GetMin())[i] - origin[i]) * inv_direction[i];
+        auto t_far = ((negative ? box.GetMin() : box.GetMax())[i] - origin[i]) * inv_direction[i];
+        // NaN (ray parallel to and exactly on a slab) is ignored by max/min
+        t_min = std::max(t_min, t_near);
+        t_max = std::min(t_max, t_far);
+        if (t_max < t_min) {
+            return std::nullopt;
+        }
+    }
+
+    return t_min;
+}
 
-Vector Reflect(const Vector& ray, const Vector& normal) {
+template <class T>
+BasicVector<T> Reflect(const BasicVector<T>& ray, const BasicVector<T>& normal) {
     /// ray and normal are normalized by caller
     return -2.0 * DotProduct(normal, ray) * normal + ray;
 }
 
-std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double eta) {
+template <class T>
+std::optional<BasicVector<T>> Refract(const BasicVector<T>& ray, const BasicVector<T>& normal,
+                                      std::type_identity_t<T> eta) {
     /// ray and normal are normalized by caller
     auto normalized_ray = ray;
     normalized_ray.Normalize();
@@ -113,15 +194,3 @@ std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double et
     }
     return eta * normalized_ray + (eta * c - std::sqrt(1 - eta * eta * (1 - c * c))) * normal;
 }
-
-Vector GetBarycentricCoords(const Triangle& triangle, const Vector& point) {
-    Vector coordinates;
-
-    auto area = triangle.Area();
-
-    coordinates.X() = Triangle(point, triangle[1], triangle[2]).Area() / area;
-    coordinates.Y() = Triangle(point, triangle[0], triangle[2]).Area() / area;
-    coordinates.Z() = Triangle(point, triangle[0], triangle[1]).Area() / area;
-
-    return coordinates;
-};
@@ -0,0 +1,319 @@
+#pragma once
+
+#include "aabb.h"
+#include "triangle.h"
+#include "vector.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Indexed triangle storage: positions and normals live once in shared pools, every triangle names
+// its vertexes (and optionally its normals) by 32 bit indices. A vertex shared by six triangles is
+// stored once instead of six times. The intersection kernels and shading read it directly.
+//
+// Compress() shrinks the pools further: positions become 21 bit fixed point per axis within the
+// bounds of the pool (8 bytes a vertex) and normals 2x16 bit octahedral codes (4 bytes). Hits
+// move by up to 2^-22 of the extent of the pool, normals by about 1e-4 rad.
+template <class T>
+class BasicIndexedTriangles {
+public:
+    using Indices = std::array<uint32_t, 3>;
+
+    static constexpr uint32_t kNoNormal = std::numeric_limits<uint32_t>::max();
+
+    BasicIndexedTriangles() = default;
+
+    // normal_indices is empty (no normals at all) or has kNoNormal in every slot of a triangle
+    // without normals
+    BasicIndexedTriangles(std::vector<BasicVector<T>> positions,
+                          std::vector<Indices> vertex_indices, std::vector<BasicVector<T>> normals,
+                          std::vector<Indices> normal_indices)
+        : positions_(std::move(positions)),
+          normals_(std::move(normals)),
+          vertex_indices_(std::move(vertex_indices)),
+          normal_indices_(std::move(normal_indices)) {
+    }
+
+    // precision conversion, compressed pools stay compressed
+    template <class U>
+    explicit BasicIndexedTriangles(const BasicIndexedTriangles<U>& other)
+        : positions_quantized_(other.ArePositionsQuantized()),
+          normals_encoded_(other.AreNormalsEncoded()),
+          quantized_positions_(other.GetQuantizedPositions()),
+          origin_(other.GetQuantizationOrigin()),
+          step_(other.GetQuantizationStep()),
+          encoded_normals_(other.GetEncodedNormals()),
+          vertex_indices_(other.GetVertexIndices()),
+          normal_indices_(other.GetNormalIndices()) {
+        for (const auto& position : other.GetPositions()) {
+            positions_.emplace_back(position);
+        }
+        for (const auto& normal : other.GetNormals()) {
+            normals_.emplace_back(normal);
+        }
+    }
+
+    size_t Size() const {
+        return vertex_indices_.size();
+    }
+
+    size_t VertexCount() const {
+        return ArePositionsQuantized() ? quantized_positions_.size() : positions_.size();
+    }
+
+    size_t NormalCount() const {
+        return AreNormalsEncoded() ? encoded_normals_.size() : normals_.size();
+    }
+
+    BasicVector<T> GetPosition(uint32_t vertex) const {
+        return ArePositionsQuantized() ? Dequantize(quantized_positions_[vertex])
+                                       : positions_[vertex];
+    }
+
+    // kQuantized must be ArePositionsQuantized(), the kernels pick it once per call
+    template <bool kQuantized>
+    std::array<BasicVector<T>, 3> GetVertexes(size_t index) const {
+        const auto& indices = vertex_indices_[index];
+        if constexpr (kQuantized) {
+            return {Dequantize(quantized_positions_[indices[0]]),
+                    Dequantize(quantized_positions_[indices[1]]),
+                    Dequantize(quantized_positions_[indices[2]])};
+        } else {
+            return {positions_[indices[0]], positions_[indices[1]], positions_[indices[2]]};
+        }
+    }
+
+    BasicTriangle<T> GetTriangle(size_t index) const {
+        const auto& indices = vertex_indices_[index];
+        return {GetPosition(indices[0]), GetPosition(indices[1]), GetPosition(indices[2])};
+    }
+
+    bool HasNormals(size_t index) const {
+        return !normal_indices_.empty() && normal_indices_[index][0] != kNoNormal;
+    }
+
+    BasicVector<T> GetNormal(uint32_t normal) const {
+        return AreNormalsEncoded() ? DecodeNormal(encoded_normals_[normal]) : normals_[normal];
+    }
+
+    // vertex normals of a triangle with HasNormals
+    std::array<BasicVector<T>, 3> GetVertexNormals(size_t index) const {
+        const auto& indices = normal_indices_[index];
+        return {GetNormal(indices[0]), GetNormal(indices[1]), GetNormal(indices[2])};
+    }
+
+    // Reorders the triangles, triangle i becomes the old triangle order[i]. The pools stay, so
+    // vertex and normal indices keep naming the same vertexes and normals.
+    void Permute(const std::vector<uint32_t>& order) {
+        auto permute = [&](std::vector<Indices>& indices) {
+            if (indices.empty()) {
+                return;
+            }
+            std::vector<Indices> result;
+            result.reserve(order.size());
+            for (auto index : order) {
+                result.push_back(indices[index]);
+            }
+            indices = std::move(result);
+        };
+        permute(vertex_indices_);
+        permute(normal_indices_);
+    }
+
+    bool ArePositionsQuantized() const {
+        return positions_quantized_;
+    }
+
+    bool AreNormalsEncoded() const {
+        return normals_encoded_;
+    }
+
+    void Compress() {
+        QuantizePositions();
+        EncodeNormals();
+    }
+
+    void QuantizePositions() {
+        if (positions_quantized_) {
+            return;
+        }
+        BasicAabb<T> bounds;
+        for (const auto& position : positions_) {
+            bounds.Extend(position);
+        }
+        origin_ = bounds.GetMin();
+        for (int axis = 0; axis < 3; ++axis) {
+            // a flat axis gets a step too, it only ever multiplies 0
+            step_[axis] = std::max(bounds.Extent()[axis] / kPositionMax,
+                                   std::numeric_limits<T>::min());
+        }
+        quantized_positions_.clear();
+        quantized_positions_.reserve(positions_.size());
+        for (const auto& position : positions_) {
+            uint64_t code = 0;
+            for (int axis = 0; axis < 3; ++axis) {
+                auto value = std::round((position[axis] - origin_[axis]) / step_[axis]);
+                code |= static_cast<uint64_t>(std::clamp<T>(value, 0, kPositionMax))
+                        << (kPositionBits * axis);
+            }
+            quantized_positions_.push_back(code);
+        }
+        std::vector<BasicVector<T>>().swap(positions_);
+        positions_quantized_ = true;
+    }
+
+    void DequantizePositions() {
+        if (!positions_quantized_) {
+            return;
+        }
+        positions_.reserve(quantized_positions_.size());
+        for (auto code : quantized_positions_) {
+            positions_.push_back(Dequantize(code));
+        }
+        std::vector<uint64_t>().swap(quantized_positions_);
+        positions_quantized_ = false;
+    }
+
+    void EncodeNormals() {
+        if (normals_encoded_) {
+            return;
+        }
+        encoded_normals_.clear();
+        encoded_normals_.reserve(normals_.size());
+        for (const auto& normal : normals_) {
+            encoded_normals_.push_back(EncodeNormal(normal));
+        }
+        std::vector<BasicVector<T>>().swap(normals_);
+        normals_encoded_ = true;
+    }
+
+    void DecodeNormals() {
+        if (!normals_encoded_) {
+            return;
+        }
+        normals_.reserve(encoded_normals_.size());
+        for (auto code : encoded_normals_) {
+            normals_.push_back(DecodeNormal(code));
+        }
+        std::vector<uint32_t>().swap(encoded_normals_);
+        normals_encoded_ = false;
+    }
+
+    // exact pools, empty while compressed
+    std::vector<BasicVector<T>>& GetPositions() {
+        return positions_;
+    }
+    const std::vector<BasicVector<T>>& GetPositions() const {
+        return positions_;
+    }
+    std::vector<BasicVector<T>>& GetNormals() {
+        return normals_;
+    }
+    const std::vector<BasicVector<T>>& GetNormals() const {
+        return normals_;
+    }
+
+    // compressed pools, empty while exact
+    const std::vector<uint64_t>& GetQuantizedPositions() const {
+        return quantized_positions_;
+    }
+    const BasicVector<T>& GetQuantizationOrigin() const {
+        return origin_;
+    }
+    const BasicVector<T>& GetQuantizationStep() const {
+        return step_;
+    }
+    const std::vector<uint32_t>& GetEncodedNormals() const {
+        return encoded_normals_;
+    }
+
+    const std::vector<Indices>& GetVertexIndices() const {
+        return vertex_indices_;
+    }
+    const std::vector<Indices>& GetNormalIndices() const {
+        return normal_indices_;
+    }
+
+    // compressed pools as stored, e.g. by a scene cache
+    void SetQuantizedPositions(std::vector<uint64_t> codes, const BasicVector<T>& origin,
+                               const BasicVector<T>& step) {
+        quantized_positions_ = std::move(codes);
+        origin_ = origin;
+        step_ = step;
+        std::vector<BasicVector<T>>().swap(positions_);
+        positions_quantized_ = true;
+    }
+    void SetEncodedNormals(std::vector<uint32_t> codes) {
+        encoded_normals_ = std::move(codes);
+        std::vector<BasicVector<T>>().swap(normals_);
+        normals_encoded_ = true;
+    }
+
+    // bytes held by the pools and indices
+    size_t GetMemoryUsage() const {
+        return positions_.capacity() * sizeof(BasicVector<T>) +
+               quantized_positions_.capacity() * sizeof(uint64_t) +
+               normals_.capacity() * sizeof(BasicVector<T>) +
+               encoded_normals_.capacity() * sizeof(uint32_t) +
+               (vertex_indices_.capacity() + normal_indices_.capacity()) * sizeof(Indices);
+    }
+
+private:
+    static constexpr int kPositionBits = 21;
+    static constexpr uint64_t kPositionMask = (uint64_t{1} << kPositionBits) - 1;
+    static constexpr T kPositionMax = static_cast<T>(kPositionMask);
+
+    BasicVector<T> Dequantize(uint64_t code) const {
+        return {origin_[0] + static_cast<T>(code & kPositionMask) * step_[0],
+                origin_[1] + static_cast<T>((code >> kPositionBits) & kPositionMask) * step_[1],
+                origin_[2] + static_cast<T>(code >> (2 * kPositionBits)) * step_[2]};
+    }
+
+    // octahedral mapping: the direction projected onto |x| + |y| + |z| = 1, the lower half folded
+    // over the upper, (x, y) in [-1, 1]^2 as 16 bits each
+    static uint32_t EncodeNormal(const BasicVector<T>& normal) {
+        auto norm = std::abs(normal[0]) + std::abs(normal[1]) + std::abs(normal[2]);
+        if (norm == 0) {
+            return EncodeNormal({0, 0, 1});
+        }
+        T x = normal[0] / norm, y = normal[1] / norm;
+        if (normal[2] < 0) {
+            std::tie(x, y) = std::pair{(1 - std::abs(y)) * std::copysign(T{1}, x),
+                                       (1 - std::abs(x)) * std::copysign(T{1}, y)};
+        }
+        auto quantize = [](T value) {
+            return static_cast<uint32_t>(std::round((value * T{0.5} + T{0.5}) * 65535));
+        };
+        return quantize(x) | quantize(y) << 16;
+    }
+
+    static BasicVector<T> DecodeNormal(uint32_t code) {
+        T x = static_cast<T>(code & 0xffff) / 65535 * 2 - 1;
+        T y = static_cast<T>(code >> 16) / 65535 * 2 - 1;
+        T z = 1 - std::abs(x) - std::abs(y);
+        if (z < 0) {
+            std::tie(x, y) = std::pair{(1 - std::abs(y)) * std::copysign(T{1}, x),
+                                       (1 - std::abs(x)) * std::copysign(T{1}, y)};
+        }
+        return Normalize(BasicVector<T>{x, y, z});
+    }
+
+    bool positions_quantized_ = false;
+    bool normals_encoded_ = false;
+    std::vector<BasicVector<T>> positions_;
+    std::vector<uint64_t> quantized_positions_;
+    BasicVector<T> origin_;
+    BasicVector<T> step_;
+    std::vector<BasicVector<T>> normals_;
+    std::vector<uint32_t> encoded_normals_;
+    std::vector<Indices> vertex_indices_;
+    std::vector<Indices> normal_indices_;
+};
+
+using IndexedTriangles = BasicIndexedTriangles<double>;
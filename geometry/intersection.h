@@ -2,29 +2,32 @@
 
 #include "vector.h"
 
-class Intersection {
+template <class T>
+class BasicIntersection {
 public:
-    Intersection(const Vector& position, const Vector& normal, double distance)
+    BasicIntersection(const BasicVector<T>& position, const BasicVector<T>& normal, T distance)
         : position_(position), normal_(Normalize(normal)), distance_(distance) {
     }
 
-    const Vector& GetPosition() const {
+    const BasicVector<T>& GetPosition() const {
         return position_;
     }
 
-    const Vector& GetNormal() const {
+    const BasicVector<T>& GetNormal() const {
         return normal_;
     }
 
-    double GetDistance() const {
+    T GetDistance() const {
         return distance_;
     }
 
-    void SetNormal(Vector normal) {
+    void SetNormal(BasicVector<T> normal) {
         normal_ = normal;
     }
 
 private:
-    Vector position_, normal_;
-    double distance_;
+    BasicVector<T> position_, normal_;
+    T distance_;
 };
+
+using Intersection = BasicIntersection<double>;
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "aligned_allocator.h"
+#include "sphere.h"
+#include "vector.h"
+
+#include <array>
+#include <cstddef>
+#include <ranges>
+
+// Structure-of-arrays copy of sphere centres and radii, one array per coordinate, so the
+// intersection kernels load a batch of spheres from sequential cache lines. Arrays are followed
+// by kPadding zero radius spheres, so SIMD kernels may load whole vectors past the last sphere.
+template <class T>
+class BasicPackedSpheres {
+public:
+    static constexpr size_t kPadding = 16;
+
+    BasicPackedSpheres() {
+        Resize(0);
+    }
+
+    template <class Range>
+    explicit BasicPackedSpheres(const Range& spheres) {
+        Resize(std::ranges::size(spheres));
+        size_t index = 0;
+        for (const BasicSphere<T>& sphere : spheres) {
+            Set(index++, sphere);
+        }
+    }
+
+    // replaces the sphere at index, e.g. after it moved
+    void Set(size_t index, const BasicSphere<T>& sphere) {
+        for (int i = 0; i < 3; ++i) {
+            centers_[i][index] = sphere.GetCenter()[i];
+        }
+        radii_[index] = sphere.GetRadius();
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    BasicSphere<T> GetSphere(size_t index) const {
+        return {{centers_[0][index], centers_[1][index], centers_[2][index]}, radii_[index]};
+    }
+
+    // coordinate arrays, x, y, z
+    const std::array<AlignedVector<T>, 3>& Centers() const {
+        return centers_;
+    }
+
+    const AlignedVector<T>& Radii() const {
+        return radii_;
+    }
+
+private:
+    void Resize(size_t size) {
+        size_ = size;
+        for (auto& array : centers_) {
+            array.resize(size + kPadding);
+        }
+        radii_.resize(size + kPadding);
+    }
+
+    size_t size_ = 0;
+    std::array<AlignedVector<T>, 3> centers_;
+    AlignedVector<T> radii_;
+};
+
+using PackedSpheres = BasicPackedSpheres<double>;
@@ -2,20 +2,52 @@
 
 #include "vector.h"
 
-class Ray {
+// A ray keeps its inverse direction and direction signs next to the direction, box tests in
+// the BVH read them instead of dividing per node.
+template <class T>
+class BasicRay {
 public:
-    Ray(const Vector& origin, const Vector& direction)
-        : origin_(origin), direction_(Normalize(direction)) {
+    BasicRay(const BasicVector<T>& origin, const BasicVector<T>& direction)
+        : BasicRay(origin, Normalize(direction), 0) {
     }
 
-    const Vector& GetOrigin() const {
+    // direction must already be normalized, skips normalizing it again
+    static BasicRay FromUnitDirection(const BasicVector<T>& origin,
+                                      const BasicVector<T>& direction) {
+        return BasicRay(origin, direction, 0);
+    }
+
+    const BasicVector<T>& GetOrigin() const {
         return origin_;
     }
-    const Vector& GetDirection() const {
+    const BasicVector<T>& GetDirection() const {
         return direction_;
     }
 
+    // 1 / direction per axis, +-inf for axis-parallel rays
+    const BasicVector<T>& GetInverseDirection() const {
+        return inv_direction_;
+    }
+
+    // bit k is set when the ray runs towards -inf along axis k (a -0 direction counts too)
+    int GetDirectionSigns() const {
+        return signs_;
+    }
+
 private:
-    Vector origin_;
-    Vector direction_;
+    BasicRay(const BasicVector<T>& origin, const BasicVector<T>& direction, int)
+        : origin_(origin),
+          direction_(direction),
+          inv_direction_(T{1} / direction[0], T{1} / direction[1], T{1} / direction[2]) {
+        for (int k = 0; k < 3; ++k) {
+            signs_ |= (inv_direction_[k] < 0) << k;
+        }
+    }
+
+    BasicVector<T> origin_;
+    BasicVector<T> direction_;
+    BasicVector<T> inv_direction_;
+    int signs_ = 0;
 };
+
+using Ray = BasicRay<double>;
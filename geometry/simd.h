@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+// kWidth lanes of T, lowered to whatever registers the calling function is compiled for
+template <class T, size_t kWidth>
+using SimdVector [[gnu::vector_size(sizeof(T) * kWidth)]] = T;
+
+// out parameter rather than return value, vector returns depend on the target ABI
+template <class V, class T>
+[[gnu::always_inline]] inline void LoadLanes(V& lanes, const T* from) {
+    std::memcpy(&lanes, from, sizeof(V));
+}
+
+template <class V, class T>
+[[gnu::always_inline]] inline void StoreLanes(const V& lanes, T* to) {
+    std::memcpy(to, &lanes, sizeof(V));
+}
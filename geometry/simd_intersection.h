@@ -0,0 +1,426 @@
+#pragma once
+
+#include "geometry.h"
+#include "indexed_triangles.h"
+#include "packed_spheres.h"
+#include "ray.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <type_traits>
+
+template <class T>
+struct BasicIndexedTriangleHit {
+    size_t index;
+    BasicTriangleHit<T> hit;
+};
+
+using IndexedTriangleHit = BasicIndexedTriangleHit<double>;
+
+template <class T>
+using TriangleIntersector = std::optional<BasicIndexedTriangleHit<T>> (*)(
+    const BasicRay<T>&, const BasicIndexedTriangles<T>&, size_t, size_t, T);
+
+// Every kernel does the same operations in the same order as the scalar Möller–Trumbore (no fused
+// multiply-add), so all of them return bit-identical hits.
+template <class T>
+std::optional<BasicIndexedTriangleHit<T>> GetIntersectionScalar(
+    const BasicRay<T>& ray, const BasicIndexedTriangles<T>& triangles, size_t first, size_t count,
+    T max_distance) {
+    std::optional<BasicIndexedTriangleHit<T>> closest;
+    for (size_t index = first; index < first + count; ++index) {
+        auto hit = GetIntersection(ray, triangles, index);
+        if (hit && hit->distance < max_distance) {
+            max_distance = hit->distance;
+            closest = BasicIndexedTriangleHit<T>{index, *hit};
+        }
+    }
+    return closest;
+}
+
+// Tests kWidth triangles per step, their vertexes gathered from the pools into lanes. Always
+// inlined into the per instruction set entry points below, so the vector code is generated for
+// their target.
+template <class T, size_t kWidth, bool kQuantized>
+[[gnu::always_inline]] inline std::optional<BasicIndexedTriangleHit<T>> GetIntersectionSimd(
+    const BasicRay<T>& ray, const BasicIndexedTriangles<T>& triangles, size_t first, size_t count,
+    T max_distance) {
+    using V = SimdVector<T, kWidth>;
+
+    const auto& origin = ray.GetOrigin();
+    const auto& direction = ray.GetDirection();
+
+    V ox = V{} + origin[0], oy = V{} + origin[1], oz = V{} + origin[2];
+    V dx = V{} + direction[0], dy = V{} + direction[1], dz = V{} + direction[2];
+    V epsilon = V{} + static_cast<T>(kEpsilon);
+
+    std::optional<BasicIndexedTriangleHit<T>> closest;
+
+    for (size_t base = first; base < first + count; base += kWidth) {
+        // coordinates of the three vertexes, lanes past the last triangle stay degenerate
+        T coordinates[9][kWidth] = {};
+        auto lanes = std::min(kWidth, first + count - base);
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            auto vertexes = triangles.template GetVertexes<kQuantized>(base + lane);
+            for (int k = 0; k < 9; ++k) {
+                coordinates[k][lane] = vertexes[k / 3][k % 3];
+            }
+        }
+        V ax, ay, az, bx, by, bz, cx, cy, cz;
+        LoadLanes(ax, coordinates[0]);
+        LoadLanes(ay, coordinates[1]);
+        LoadLanes(az, coordinates[2]);
+        LoadLanes(bx, coordinates[3]);
+        LoadLanes(by, coordinates[4]);
+        LoadLanes(bz, coordinates[5]);
+        LoadLanes(cx, coordinates[6]);
+        LoadLanes(cy, coordinates[7]);
+        LoadLanes(cz, coordinates[8]);
+        V abx = bx - ax, aby = by - ay, abz = bz - az;
+        V acx = cx - ax, acy = cy - ay, acz = cz - az;
+
+        // up = direction x ac
+        V upx = dy * acz - dz * acy;
+        V upy = dz * acx - dx * acz;
+        V upz = dx * acy - dy * acx;
+
+        V det = abx * upx + aby * upy + abz * upz;
+        auto mask = (det >= epsilon) | (det <= -epsilon);
+        V inv_det = 1 / det;
+
+        V sx = ox - ax;
+        V sy = oy - ay;
+        V sz = oz - az;
+
+        V u = inv_det * (sx * upx + sy * upy + sz * upz);
+        mask &= (u >= 0) & (u <= 1);
+
+        // t = s x ab
+        V tx = sy * abz - sz * aby;
+        V ty = sz * abx - sx * abz;
+        V tz = sx * aby - sy * abx;
+
+        V v = inv_det * (dx * tx + dy * ty + dz * tz);
+        mask &= (v >= 0) & (u + v <= 1);
+
+        V k = inv_det * (acx * tx + acy * ty + acz * tz);
+        mask &= k > epsilon;
+
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            // nearest lane wins, the lowest index on ties
+            if (mask[lane] && k[lane] < max_distance) {
+                max_distance = k[lane];
+                closest = BasicIndexedTriangleHit<T>{base + lane, {k[lane], u[lane], v[lane]}};
+            }
+        }
+    }
+
+    return closest;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+template <class T, bool kQuantized>
+std::optional<BasicIndexedTriangleHit<T>> GetIntersectionSse(
+    const BasicRay<T>& ray, const BasicIndexedTriangles<T>& triangles, size_t first, size_t count,
+    T max_distance) {
+    return GetIntersectionSimd<T, 16 / sizeof(T), kQuantized>(ray, triangles, first, count,
+                                                              max_distance);
+}
+
+template <class T, bool kQuantized>
+[[gnu::target("avx2")]] std::optional<BasicIndexedTriangleHit<T>> GetIntersectionAvx2(
+    const BasicRay<T>& ray, const BasicIndexedTriangles<T>& triangles, size_t first, size_t count,
+    T max_distance) {
+    return GetIntersectionSimd<T, 32 / sizeof(T), kQuantized>(ray, triangles, first, count,
+                                                              max_distance);
+}
+
+#endif
+
+template <class T, bool kQuantized>
+TriangleIntersector<T> SelectTriangleIntersector() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return GetIntersectionAvx2<T, kQuantized>;
+    }
+    return GetIntersectionSse<T, kQuantized>;
+#else
+    return GetIntersectionScalar<T>;
+#endif
+}
+
+// Nearest hit among triangles [first, first + count) closer than max_distance. With AVX2 tests
+// 4 double or 8 float triangles per instruction, with SSE2 2 or 4, the kernel is picked once for
+// the running CPU and for exact or quantised positions.
+template <class T>
+std::optional<BasicIndexedTriangleHit<T>> GetIntersection(
+    const BasicRay<T>& ray, const BasicIndexedTriangles<T>& triangles, size_t first, size_t count,
+    T max_distance = std::numeric_limits<T>::infinity()) {
+    static const TriangleIntersector<T> kExact = SelectTriangleIntersector<T, false>();
+    static const TriangleIntersector<T> kQuantized = SelectTriangleIntersector<T, true>();
+    return (triangles.ArePositionsQuantized() ? kQuantized : kExact)(ray, triangles, first, count,
+                                                                      max_distance);
+}
+
+template <class T>
+struct BasicIndexedSphereHit {
+    size_t index;
+    T distance;
+};
+
+using IndexedSphereHit = BasicIndexedSphereHit<double>;
+
+template <class T>
+using SphereIntersector = std::optional<BasicIndexedSphereHit<T>> (*)(
+    const BasicRay<T>&, const BasicPackedSpheres<T>&, size_t, size_t, T);
+
+// As for triangles, every kernel returns the hits of GetIntersectionDistance bit for bit.
+template <class T>
+std::optional<BasicIndexedSphereHit<T>> GetIntersectionScalar(const BasicRay<T>& ray,
+                                                              const BasicPackedSpheres<T>& spheres,
+                                                              size_t first, size_t count,
+                                                              T max_distance) {
+    std::optional<BasicIndexedSphereHit<T>> closest;
+    for (size_t index = first; index < first + count; ++index) {
+        auto distance = GetIntersectionDistance(ray, spheres.GetSphere(index));
+        if (distance && *distance < max_distance) {
+            max_distance = *distance;
+            closest = BasicIndexedSphereHit<T>{index, *distance};
+        }
+    }
+    return closest;
+}
+
+// Tests kWidth spheres per step: the quadratic's discriminant and sign tests run on whole
+// vectors, the square root only for the lanes that hit.
+template <class T, size_t kWidth>
+[[gnu::always_inline]] inline std::optional<BasicIndexedSphereHit<T>> GetIntersectionSimd(
+    const BasicRay<T>& ray, const BasicPackedSpheres<T>& spheres, size_t first, size_t count,
+    T max_distance) {
+    using V = SimdVector<T, kWidth>;
+
+    const auto& origin = ray.GetOrigin();
+    const auto& direction = ray.GetDirection();
+
+    V ox = V{} + origin[0], oy = V{} + origin[1], oz = V{} + origin[2];
+    V dx = V{} + direction[0], dy = V{} + direction[1], dz = V{} + direction[2];
+
+    const auto& centers = spheres.Centers();
+    const auto& radii = spheres.Radii();
+
+    std::optional<BasicIndexedSphereHit<T>> closest;
+
+    for (size_t base = first; base < first + count; base += kWidth) {
+        V cx, cy, cz, radius;
+        LoadLanes(cx, centers[0].data() + base);
+        LoadLanes(cy, centers[1].data() + base);
+        LoadLanes(cz, centers[2].data() + base);
+        LoadLanes(radius, radii.data() + base);
+
+        // between = center - origin, its projection on the direction and the rest of it
+        V bx = cx - ox, by = cy - oy, bz = cz - oz;
+        V projection = bx * dx + by * dy + bz * dz;
+        V px = dx * projection - bx;
+        V py = dy * projection - by;
+        V pz = dz * projection - bz;
+
+        V squared_radius = radius * radius;
+        V squared_distance = px * px + py * py + pz * pz;
+        auto inside = (bx * bx + by * by + bz * bz) <= squared_radius;
+        auto mask = (squared_distance <= squared_radius) & (inside | (projection > 0));
+
+        auto lanes = std::min(kWidth, first + count - base);
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            if (!mask[lane]) {
+                continue;
+            }
+            auto delta = std::sqrt(squared_radius[lane] - squared_distance[lane]);
+            auto distance = inside[lane] ? projection[lane] + delta : projection[lane] - delta;
+            // nearest lane wins, the lowest index on ties
+            if (distance < max_distance) {
+                max_distance = distance;
+                closest = BasicIndexedSphereHit<T>{base + lane, distance};
+            }
+        }
+    }
+
+    return closest;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+template <class T>
+std::optional<BasicIndexedSphereHit<T>> GetIntersectionSse(const BasicRay<T>& ray,
+                                                           const BasicPackedSpheres<T>& spheres,
+                                                           size_t first, size_t count,
+                                                           T max_distance) {
+    return GetIntersectionSimd<T, 16 / sizeof(T)>(ray, spheres, first, count, max_distance);
+}
+
+template <class T>
+[[gnu::target("avx2")]] std::optional<BasicIndexedSphereHit<T>> GetIntersectionAvx2(
+    const BasicRay<T>& ray, const BasicPackedSpheres<T>& spheres, size_t first, size_t count,
+    T max_distance) {
+    return GetIntersectionSimd<T, 32 / sizeof(T)>(ray, spheres, first, count, max_distance);
+}
+
+#endif
+
+template <class T>
+SphereIntersector<T> SelectSphereIntersector() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return GetIntersectionAvx2<T>;
+    }
+    return GetIntersectionSse<T>;
+#else
+    return GetIntersectionScalar<T>;
+#endif
+}
+
+// Nearest hit among spheres [first, first + count) closer than max_distance, vectorised like the
+// triangle kernels.
+template <class T>
+std::optional<BasicIndexedSphereHit<T>> GetIntersection(
+    const BasicRay<T>& ray, const BasicPackedSpheres<T>& spheres, size_t first, size_t count,
+    T max_distance = std::numeric_limits<T>::infinity()) {
+    static const SphereIntersector<T> kIntersector = SelectSphereIntersector<T>();
+    return kIntersector(ray, spheres, first, count, max_distance);
+}
+
+// Up to kMaxRays rays of a packet as structure-of-arrays lanes for the packet box test, padded
+// with zero lanes to whole vectors. max_distance is the packet's working copy of the rays' limits.
+template <class T>
+struct BasicRayLanes {
+    static constexpr size_t kMaxRays = 64;
+    static constexpr size_t kPadding = 16;
+
+    BasicRayLanes(std::span<const BasicRay<T>> rays, std::span<const T> max_distances)
+        : size(rays.size()) {
+        for (size_t ray = 0; ray < size; ++ray) {
+            for (int i = 0; i < 3; ++i) {
+                origin[i][ray] = rays[ray].GetOrigin()[i];
+                inv_direction[i][ray] = rays[ray].GetInverseDirection()[i];
+            }
+            max_distance[ray] = max_distances[ray];
+        }
+        for (size_t lane = size; lane < std::min(kMaxRays, size + kPadding); ++lane) {
+            for (int i = 0; i < 3; ++i) {
+                origin[i][lane] = inv_direction[i][lane] = 0;
+            }
+            max_distance[lane] = 0;
+        }
+    }
+
+    alignas(64) T origin[3][kMaxRays];
+    alignas(64) T inv_direction[3][kMaxRays];
+    alignas(64) T max_distance[kMaxRays];
+    size_t size;
+};
+
+template <class T>
+using BoxPacketIntersector = uint64_t (*)(const BasicRayLanes<T>&, const BasicAabb<T>&, uint64_t,
+                                          T&);
+
+// Slab test of kWidth rays per step, the operations of GetEntryDistance lane by lane, so a ray
+// enters exactly the boxes it enters on its own. Vectors without a ray of `mask` are skipped.
+template <class T, size_t kWidth>
+[[gnu::always_inline]] inline uint64_t GetEnteringRaysSimd(const BasicRayLanes<T>& lanes,
+                                                           const BasicAabb<T>& box, uint64_t mask,
+                                                           T& nearest) {
+    using V = SimdVector<T, kWidth>;
+    constexpr uint64_t kVectorBits = (uint64_t{1} << kWidth) - 1;
+
+    using Mask = decltype(V{} < V{});
+    using Lane = std::conditional_t<sizeof(T) == 8, int64_t, int32_t>;
+    Mask lane_bits;
+    for (size_t lane = 0; lane < kWidth; ++lane) {
+        lane_bits[lane] = Lane{1} << lane;
+    }
+
+    V infinity = V{} + std::numeric_limits<T>::infinity();
+    V nearest_lanes = infinity;
+    uint64_t entered = 0;
+    for (size_t base = 0; base < lanes.size; base += kWidth) {
+        auto vector_mask = (mask >> base) & kVectorBits;
+        if (vector_mask == 0) {
+            continue;
+        }
+        V t_min = V{};
+        V t_max;
+        LoadLanes(t_max, lanes.max_distance + base);
+        for (int i = 0; i < 3; ++i) {
+            V origin, inv_direction;
+            LoadLanes(origin, lanes.origin[i] + base);
+            LoadLanes(inv_direction, lanes.inv_direction[i] + base);
+            V low = (V{} + box.GetMin()[i] - origin) * inv_direction;
+            V high = (V{} + box.GetMax()[i] - origin) * inv_direction;
+            auto negative = inv_direction < 0;
+            V t_near = negative ? high : low;
+            V t_far = negative ? low : high;
+            // std::max / std::min of the scalar test, a NaN slab distance keeps the old bound
+            t_min = t_min < t_near ? t_near : t_min;
+            t_max = t_far < t_max ? t_far : t_max;
+        }
+        // neither bound can be NaN, so t_min <= t_max is the scalar !(t_max < t_min)
+        auto active = (t_min <= t_max) & ((Mask{} + static_cast<Lane>(vector_mask)) & lane_bits);
+        for (size_t lane = 0; lane < kWidth; ++lane) {
+            entered |= static_cast<uint64_t>(active[lane] != 0) << (base + lane);
+        }
+        V entry = active != 0 ? t_min : infinity;
+        nearest_lanes = entry < nearest_lanes ? entry : nearest_lanes;
+    }
+    nearest = nearest_lanes[0];
+    for (size_t lane = 1; lane < kWidth; ++lane) {
+        nearest = std::min(nearest, nearest_lanes[lane]);
+    }
+    return entered;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+template <class T>
+uint64_t GetEnteringRaysSse(const BasicRayLanes<T>& lanes, const BasicAabb<T>& box,
+                            uint64_t mask, T& nearest) {
+    return GetEnteringRaysSimd<T, 16 / sizeof(T)>(lanes, box, mask, nearest);
+}
+
+template <class T>
+[[gnu::target("avx2")]] uint64_t GetEnteringRaysAvx2(const BasicRayLanes<T>& lanes,
+                                                     const BasicAabb<T>& box, uint64_t mask,
+                                                     T& nearest) {
+    return GetEnteringRaysSimd<T, 32 / sizeof(T)>(lanes, box, mask, nearest);
+}
+
+#endif
+
+template <class T>
+BoxPacketIntersector<T> SelectBoxPacketIntersector() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return GetEnteringRaysAvx2<T>;
+    }
+    return GetEnteringRaysSse<T>;
+#else
+    return GetEnteringRaysSimd<T, 1>;
+#endif
+}
+
+// Rays of `mask` entering box closer than their max_distance, nearest receives the nearest of
+// their entry distances. With AVX2 tests 4 double or 8 float rays per instruction.
+template <class T>
+uint64_t GetEnteringRays(const BasicRayLanes<T>& lanes, const BasicAabb<T>& box, uint64_t mask,
+                         T& nearest) {
+    static const BoxPacketIntersector<T> kIntersector = SelectBoxPacketIntersector<T>();
+    return kIntersector(lanes, box, mask, nearest);
+}
@@ -2,24 +2,28 @@
 
 #include "vector.h"
 
-class Sphere {
+template <class T>
+class BasicSphere {
 public:
-    Sphere(const Vector& center, double radius) : center_(center), radius_(radius) {
+    BasicSphere(const BasicVector<T>& center, T radius) : center_(center), radius_(radius) {
     }
 
-    const Vector& GetCenter() const {
+    const BasicVector<T>& GetCenter() const {
         return center_;
     }
 
-    double GetRadius() const {
+    T GetRadius() const {
         return radius_;
     }
 
-    bool Contains(const Vector& point) const {
-        return Length(center_ - point) <= radius_;
+    bool Contains(const BasicVector<T>& point) const {
+        auto offset = center_ - point;
+        return DotProduct(offset, offset) <= radius_ * radius_;
     }
 
 private:
-    Vector center_;
-    double radius_;
+    BasicVector<T> center_;
+    T radius_;
 };
+
+using Sphere = BasicSphere<double>;
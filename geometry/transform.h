@@ -0,0 +1,111 @@
+#pragma once
+
+#include "aabb.h"
+#include "vector.h"
+
+#include <array>
+#include <cmath>
+#include <stdexcept>
+
+// Affine transform p -> L p + t, L given by its rows
+template <class T>
+class BasicTransform {
+public:
+    BasicTransform() : rows_{{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}}} {
+    }
+
+    BasicTransform(const std::array<BasicVector<T>, 3>& rows, const BasicVector<T>& translation)
+        : rows_(rows), translation_(translation) {
+    }
+
+    // precision conversion
+    template <class U>
+    explicit BasicTransform(const BasicTransform<U>& other)
+        : rows_{BasicVector<T>(other.GetRows()[0]), BasicVector<T>(other.GetRows()[1]),
+                BasicVector<T>(other.GetRows()[2])},
+          translation_(other.GetTranslation()) {
+    }
+
+    static BasicTransform Translation(const BasicVector<T>& offset) {
+        return {{{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}}}, offset};
+    }
+
+    static BasicTransform Scale(T factor) {
+        return {{{{factor, 0, 0}, {0, factor, 0}, {0, 0, factor}}}, {0, 0, 0}};
+    }
+
+    // counterclockwise around +y seen from above
+    static BasicTransform RotationY(T radians) {
+        auto cos = std::cos(radians), sin = std::sin(radians);
+        return {{{{cos, 0, sin}, {0, 1, 0}, {-sin, 0, cos}}}, {0, 0, 0}};
+    }
+
+    const std::array<BasicVector<T>, 3>& GetRows() const {
+        return rows_;
+    }
+
+    const BasicVector<T>& GetTranslation() const {
+        return translation_;
+    }
+
+    BasicVector<T> ApplyToVector(const BasicVector<T>& vector) const {
+        return {DotProduct(rows_[0], vector), DotProduct(rows_[1], vector),
+                DotProduct(rows_[2], vector)};
+    }
+
+    BasicVector<T> ApplyToPoint(const BasicVector<T>& point) const {
+        return ApplyToVector(point) + translation_;
+    }
+
+    // L^T vector: of an inverse transform, maps normals the other way
+    BasicVector<T> ApplyTransposed(const BasicVector<T>& vector) const {
+        return rows_[0] * vector[0] + rows_[1] * vector[1] + rows_[2] * vector[2];
+    }
+
+    // this after other
+    BasicTransform operator*(const BasicTransform& other) const {
+        std::array<BasicVector<T>, 3> rows;
+        for (int i = 0; i < 3; ++i) {
+            rows[i] = other.ApplyTransposed(rows_[i]);
+        }
+        return {rows, ApplyToPoint(other.translation_)};
+    }
+
+    BasicTransform Inverse() const {
+        // rows of the inverse are the cross products of the columns over the determinant
+        std::array<BasicVector<T>, 3> columns;
+        for (int i = 0; i < 3; ++i) {
+            columns[i] = {rows_[0][i], rows_[1][i], rows_[2][i]};
+        }
+        auto det = DotProduct(columns[0], CrossProduct(columns[1], columns[2]));
+        if (det == 0) {
+            throw std::runtime_error{"Transform can't be inverted"};
+        }
+        std::array<BasicVector<T>, 3> rows = {CrossProduct(columns[1], columns[2]) / det,
+                                              CrossProduct(columns[2], columns[0]) / det,
+                                              CrossProduct(columns[0], columns[1]) / det};
+        BasicTransform inverse(rows, {0, 0, 0});
+        inverse.translation_ = -inverse.ApplyToVector(translation_);
+        return inverse;
+    }
+
+    // box around the transformed corners of box
+    BasicAabb<T> ApplyToBox(const BasicAabb<T>& box) const {
+        BasicAabb<T> result;
+        if (box.IsEmpty()) {
+            return result;
+        }
+        for (int corner = 0; corner < 8; ++corner) {
+            result.Extend(ApplyToPoint({corner & 1 ? box.GetMax()[0] : box.GetMin()[0],
+                                        corner & 2 ? box.GetMax()[1] : box.GetMin()[1],
+                                        corner & 4 ? box.GetMax()[2] : box.GetMin()[2]}));
+        }
+        return result;
+    }
+
+private:
+    std::array<BasicVector<T>, 3> rows_;
+    BasicVector<T> translation_;
+};
+
+using Transform = BasicTransform<double>;
@@ -4,23 +4,27 @@
 #include <array>
 #include <cstddef>
 
-class Triangle {
+template <class T>
+class BasicTriangle {
 public:
-    Triangle(const Vector& a, const Vector& b, const Vector& c) : vertexes_({a, b, c}) {
+    BasicTriangle(const BasicVector<T>& a, const BasicVector<T>& b, const BasicVector<T>& c)
+        : vertexes_({a, b, c}) {
     }
 
-    const Vector& operator[](size_t ind) const {
+    const BasicVector<T>& operator[](size_t ind) const {
         return vertexes_[ind];
     };
 
-    double Area() const {
+    T Area() const {
         return 0.5 * Length(CrossProduct(vertexes_[1] - vertexes_[0], vertexes_[2] - vertexes_[0]));
     };
 
-    Vector GetNormal() const {
+    BasicVector<T> GetNormal() const {
         return CrossProduct(vertexes_[1] - vertexes_[0], vertexes_[2] - vertexes_[0]);
     }
 
 private:
-    std::array<Vector, 3> vertexes_;
+    std::array<BasicVector<T>, 3> vertexes_;
 };
+
+using Triangle = BasicTriangle<double>;
@@ -4,25 +4,34 @@
 #include <cstddef>
 #include <iostream>
 #include <cmath>
+#include <type_traits>
 
-class Vector {
+// 3d vector over a floating point scalar, see the Vector (double) and FVector (float) aliases
+template <class T>
+class BasicVector {
 public:
-    Vector() = default;
-    Vector(double x, double y, double z) : data_({x, y, z}) {
+    using Scalar = T;
+
+    BasicVector() = default;
+    BasicVector(T x, T y, T z) : data_({x, y, z}) {
+    }
+
+    // precision conversion
+    template <class U>
+    explicit BasicVector(const BasicVector<U>& other)
+        : data_({static_cast<T>(other[0]), static_cast<T>(other[1]), static_cast<T>(other[2])}) {
     }
 
-    double& operator[](size_t ind) {
+    T& operator[](size_t ind) {
         return data_[ind];
     };
 
-    double operator[](size_t ind) const {
+    T operator[](size_t ind) const {
         return data_[ind];
     };
 
-    friend double Length(const Vector&);
-
     void Normalize() {
-        if (data_ == std::array{0.0, 0.0, 0.0}) {
+        if (data_ == std::array<T, 3>{}) {
             return;
         }
         *this /= Length(*this);
@@ -36,179 +45,196 @@ public:
         return not NotZero();
     }
 
-    Vector& operator/=(double t) {
+    BasicVector& operator/=(T t) {
         for (int i = 0; i < 3; ++i) {
             data_[i] /= t;
         }
         return *this;
     }
 
-    Vector& operator+=(double t) {
+    BasicVector& operator+=(T t) {
         for (int i = 0; i < 3; ++i) {
             data_[i] += t;
         }
         return *this;
     }
 
-    Vector& operator*=(double t) {
+    BasicVector& operator*=(T t) {
         for (int i = 0; i < 3; ++i) {
             data_[i] *= t;
         }
         return *this;
     }
 
-    Vector& operator*=(const Vector& other) {
+    BasicVector& operator*=(const BasicVector& other) {
         for (int i = 0; i < 3; ++i) {
             data_[i] *= other[i];
         }
         return *this;
     }
 
-    Vector& operator/=(const Vector& other) {
+    BasicVector& operator/=(const BasicVector& other) {
         for (int i = 0; i < 3; ++i) {
             data_[i] /= other[i];
         }
         return *this;
     }
 
-    Vector& operator+=(const Vector& other) {
+    BasicVector& operator+=(const BasicVector& other) {
         for (int i = 0; i < 3; ++i) {
             data_[i] += other[i];
         }
         return *this;
     }
 
-    double X() const {
+    T X() const {
         return data_[0];
     };
 
-    double& X() {
+    T& X() {
         return data_[0];
     };
 
-    double Y() const {
+    T Y() const {
         return data_[1];
     };
 
-    double& Y() {
+    T& Y() {
         return data_[1];
     };
 
-    double Z() const {
+    T Z() const {
         return data_[2];
     };
 
-    double& Z() {
+    T& Z() {
         return data_[2];
     };
 
-    bool operator==(const Vector& other) const {
+    bool operator==(const BasicVector& other) const {
         return data_ == other.data_;
     }
 
-    auto operator<=>(const Vector& other) const {
+    auto operator<=>(const BasicVector& other) const {
         return data_ <=> other.data_;
     }
 
 public:
-    std::array<double, 3> data_ = {0, 0, 0};
+    std::array<T, 3> data_ = {0, 0, 0};
 };
 
-double DotProduct(const Vector& a, const Vector& b) {
-    double dot = 0.0;
+using Vector = BasicVector<double>;
+using FVector = BasicVector<float>;
+
+template <class T>
+T DotProduct(const BasicVector<T>& a, const BasicVector<T>& b) {
+    T dot = 0.0;
     for (int i = 0; i < 3; ++i) {
         dot += a[i] * b[i];
     }
     return dot;
 };
 
-Vector CrossProduct(const Vector& a, const Vector& b) {
-    Vector cross_product;
+template <class T>
+BasicVector<T> CrossProduct(const BasicVector<T>& a, const BasicVector<T>& b) {
+    BasicVector<T> cross_product;
     cross_product.X() = a.Y() * b.Z() - a.Z() * b.Y();
     cross_product.Y() = a.Z() * b.X() - a.X() * b.Z();
     cross_product.Z() = a.X() * b.Y() - a.Y() * b.X();
     return cross_product;
 };
 
-double Length(const Vector& v) {
-    double len = 0.0;
+template <class T>
+T Length(const BasicVector<T>& v) {
+    T len = 0.0;
     for (int i = 0; i < 3; ++i) {
         len += v.data_[i] * v.data_[i];
     }
     return std::sqrt(len);
 };
 
-Vector operator+(const Vector& a, const Vector& b) {
-    Vector sum;
+template <class T>
+BasicVector<T> operator+(const BasicVector<T>& a, const BasicVector<T>& b) {
+    BasicVector<T> sum;
     for (int i = 0; i < 3; ++i) {
         sum[i] = a[i] + b[i];
     }
     return sum;
 }
 
-Vector operator/(const Vector& a, double t) {
-    Vector out;
+template <class T>
+BasicVector<T> operator/(const BasicVector<T>& a, std::type_identity_t<T> t) {
+    BasicVector<T> out;
     for (int i = 0; i < 3; ++i) {
         out[i] = a[i] / t;
     }
     return out;
 }
 
-Vector operator*(const Vector& a, const Vector& b) {
-    Vector out;
+template <class T>
+BasicVector<T> operator*(const BasicVector<T>& a, const BasicVector<T>& b) {
+    BasicVector<T> out;
     for (int i = 0; i < 3; ++i) {
         out[i] = a[i] * b[i];
     }
     return out;
 }
 
-Vector operator/(const Vector& a, const Vector& b) {
-    Vector out;
+template <class T>
+BasicVector<T> operator/(const BasicVector<T>& a, const BasicVector<T>& b) {
+    BasicVector<T> out;
     for (int i = 0; i < 3; ++i) {
         out[i] = a[i] / b[i];
     }
     return out;
 }
 
-Vector operator-(const Vector& self) {
-    Vector neg;
+template <class T>
+BasicVector<T> operator-(const BasicVector<T>& self) {
+    BasicVector<T> neg;
     for (int i = 0; i < 3; ++i) {
         neg[i] = -self[i];
     }
     return neg;
 }
 
-Vector operator-(const Vector& a, const Vector& b) {
+template <class T>
+BasicVector<T> operator-(const BasicVector<T>& a, const BasicVector<T>& b) {
     return a + (-b);
 }
 
-Vector operator*(const Vector& a, double t) {
-    Vector h;
+template <class T>
+BasicVector<T> operator*(const BasicVector<T>& a, std::type_identity_t<T> t) {
+    BasicVector<T> h;
     for (int i = 0; i < 3; ++i) {
         h[i] = a[i] * t;
     }
     return h;
 }
 
-Vector operator+(const Vector& a, double t) {
-    Vector h;
+template <class T>
+BasicVector<T> operator+(const BasicVector<T>& a, std::type_identity_t<T> t) {
+    BasicVector<T> h;
     for (int i = 0; i < 3; ++i) {
         h[i] = a[i] + t;
     }
     return h;
 }
 
-Vector operator*(double t, const Vector& a) {
+template <class T>
+BasicVector<T> operator*(std::type_identity_t<T> t, const BasicVector<T>& a) {
     return a * t;
 }
 
-Vector Normalize(Vector from) {
+template <class T>
+BasicVector<T> Normalize(BasicVector<T> from) {
     from.Normalize();
     return from;
 }
 
 // debug
-std::ostream& operator<<(std::ostream& out, const Vector& self) {
+template <class T>
+std::ostream& operator<<(std::ostream& out, const BasicVector<T>& self) {
     out << self.X() << ' ' << self.Y() << ' ' << self.Z();
     return out;
 }
\ No newline at end of file
@@ -1,12 +1,33 @@
 #pragma once
 
 #include "image.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "post_process.h"
+#include "sampling.h"
 #include "camera_options.h"
+#include "command_line.h"
 #include "render_options.h"
+#include "render_stats.h"
 #include "geometry.h"
 #include "scene.h"
-
+#include "scene_cache.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <filesystem>
+#include <functional>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 static constexpr double kEps = 1e-3;
 
@@ -14,305 +35,1226 @@ static constexpr const double kInfDistance = 1e5;
 
 static constexpr double kTone = 1.0 / 2.2;
 
-RGB RGBCast(Vector color) {
-  return {static_cast<int>((color[0] - kEpsilon) * 255.0),
-          static_cast<int>((color[1] - kEpsilon) * 255.0),
-          static_cast<int>((color[2] - kEpsilon) * 255.0)};
-}
-
 auto Sign(auto value) {
   return value < 0 ? -1 : 1;
 }
 
 // intersection ray with object = Intersection point with its material
+template <class T>
 struct IPoint {
-  Intersection intersection_;
-  Material const *material_{nullptr};
+  BasicIntersection<T> intersection_;
+  BasicMaterial<T> const *material_{nullptr};
 };
 
 // if there is no intersection
-using OIPoint = std::optional<IPoint>;
+template <class T>
+using OIPoint = std::optional<IPoint<T>>;
+
+// closest hit found so far: the primitive, the ray parameter and for triangles the barycentric
+// coordinates. Position, normal and material are only built for the winner.
+template <class T>
+struct ClosestHit {
+  static constexpr uint32_t kNoInstance = std::numeric_limits<uint32_t>::max();
+
+  enum class Kind { kNone, kTriangle, kSphere } kind = Kind::kNone;
+  size_t index = 0;
+  uint32_t instance = kNoInstance;  // index is into this instance's mesh, else into the scene
+  T distance = 0;                   // along the object space ray for instances
+  T u = 0, v = 0;                   // weights of the second and third vertex
+};
 
-// polygon case
-OIPoint GetMaybeIntersectionWithPolygon(const Ray &ray, const Object &object) {
-  auto point = GetIntersection(ray, object.polygon);
-  if (not point.has_value()) {
-    return std::nullopt;
+// tests spheres [first, first + count) of a scene or mesh
+template <class T, class Geometry>
+void IntersectSpheres(const BasicRay<T> &ray, const Geometry &geometry, size_t first,
+                      size_t count, T &max_distance, ClosestHit<T> &closest) {
+  if (auto hit = GetIntersection(ray, geometry.GetSpheres(), first, count, max_distance)) {
+    max_distance = hit->distance;
+    closest = {ClosestHit<T>::Kind::kSphere, hit->index, ClosestHit<T>::kNoInstance,
+               hit->distance};
   }
-  auto point_with_material = point.value();
+}
 
-  // all normals are given
-  if (std::find(object.normals.begin(), object.normals.end(), Vector()) != object.normals.end()) {
-    return std::optional{IPoint{point_with_material, object.material}};
+// tests the primitives of a leaf of the scene's or a mesh's BVH
+template <class T, class Geometry>
+void IntersectLeaf(const BasicRay<T> &ray, const Geometry &geometry, const BasicBvhNode<T> &leaf,
+                   T &max_distance, ClosestHit<T> &closest) {
+  CountIntersectionTests(leaf.triangle_count, leaf.sphere_count);
+  if (auto hit = GetIntersection(ray, geometry.GetTriangles(), leaf.first, leaf.triangle_count,
+                                 max_distance)) {
+    max_distance = hit->hit.distance;
+    closest = {ClosestHit<T>::Kind::kTriangle, hit->index, ClosestHit<T>::kNoInstance,
+               hit->hit.distance, hit->hit.u, hit->hit.v};
   }
+  IntersectSpheres(ray, geometry, leaf.first_sphere, leaf.sphere_count, max_distance, closest);
+}
 
-  auto coordinates = GetBarycentricCoords(object.polygon, point_with_material.GetPosition());
-
-  Vector normal{};
-
-  for (int i = 0; i < 3; ++i) {
-    normal += object.normals[i] * coordinates[i];
+// tests every primitive of a scene or mesh, brute force
+template <class T, class Geometry>
+void IntersectAll(const BasicRay<T> &ray, const Geometry &geometry, T &max_distance,
+                  ClosestHit<T> &closest) {
+  const auto &triangles = geometry.GetTriangles();
+  CountIntersectionTests(triangles.Size(), geometry.GetSphereObjects().size());
+  for (size_t i = 0; i < triangles.Size(); ++i) {
+    auto hit = GetIntersection(ray, triangles, i);
+    if (hit && hit->distance < max_distance) {
+      max_distance = hit->distance;
+      closest = {ClosestHit<T>::Kind::kTriangle, i, ClosestHit<T>::kNoInstance, hit->distance,
+                 hit->u, hit->v};
+    }
   }
-  point_with_material.SetNormal(normal);
-  return std::optional{IPoint{point_with_material, object.material}};
+  IntersectSpheres(ray, geometry, 0, geometry.GetSphereObjects().size(), max_distance, closest);
 }
 
-std::vector<IPoint> GetAllRayIntersections(const Ray &ray, const Scene &scene) {
-  std::vector<IPoint> intersections;
-
-  for (const auto &object: scene.GetObjects()) {
-    auto opt_intersection = GetMaybeIntersectionWithPolygon(ray, object);
-    if (opt_intersection.has_value()) {
-      intersections.push_back(opt_intersection.value());
-    }
+// tests instance i with the ray in object space, its mesh searched by
+// intersect_mesh(local_ray, mesh, local_max_distance, local_closest)
+template <class T, class IntersectMesh>
+void IntersectInstance(const BasicRay<T> &ray, const BasicScene<T> &scene, uint32_t i,
+                       T &max_distance, ClosestHit<T> &closest,
+                       const IntersectMesh &intersect_mesh) {
+  const auto &instance = scene.GetInstances()[i];
+  auto [local_ray, scale] = instance.ToObject(ray);
+  auto local_max_distance = max_distance * scale;
+  ClosestHit<T> local;
+  intersect_mesh(local_ray, scene.GetMeshes()[instance.mesh], local_max_distance, local);
+  if (local.kind != ClosestHit<T>::Kind::kNone) {
+    max_distance = local_max_distance / scale;
+    closest = local;
+    closest.instance = i;
   }
+}
 
-  for (const auto &object: scene.GetSphereObjects()) {
-    auto opt_intersection = GetIntersection(ray, object.sphere);
-    if (opt_intersection.has_value()) {
-      intersections.push_back(IPoint{opt_intersection.value(), object.material});
-    }
+// tests the instances of a leaf of the scene's instance BVH, each through its mesh's BVH
+template <class T>
+void IntersectInstanceLeaf(const BasicRay<T> &ray, const BasicScene<T> &scene,
+                           const BasicBvhNode<T> &leaf, T &max_distance,
+                           ClosestHit<T> &closest) {
+  auto intersect_mesh = [](const BasicRay<T> &local_ray, const BasicMesh<T> &mesh,
+                           T &local_max_distance, ClosestHit<T> &local) {
+    mesh.GetBvh()->Traverse(local_ray, local_max_distance,
+                            [&](const BasicBvhNode<T> &mesh_leaf, T &distance) {
+                              IntersectLeaf(local_ray, mesh, mesh_leaf, distance, local);
+                              local_max_distance = distance;
+                              return false;
+                            });
+  };
+  for (auto i = leaf.first; i < leaf.first + leaf.triangle_count; ++i) {
+    IntersectInstance(ray, scene, i, max_distance, closest, intersect_mesh);
   }
+}
 
-  return intersections;
+// Position, normal and material of the closest hit, found along ray. Triangles with vertex
+// normals interpolate them with the barycentric coordinates of the intersection test.
+template <class T, class Geometry>
+IPoint<T> GetPrimitivePoint(const BasicRay<T> &ray, const Geometry &geometry,
+                            const ClosestHit<T> &closest) {
+  if (closest.kind == ClosestHit<T>::Kind::kSphere) {
+    const auto &object = geometry.GetSphereObjects()[closest.index];
+    return {GetIntersection(ray, object.sphere, closest.distance), object.material};
+  }
+  const auto &triangles = geometry.GetTriangles();
+  auto intersection = GetIntersection(ray, triangles.GetTriangle(closest.index),
+                                      {closest.distance, closest.u, closest.v});
+  if (triangles.HasNormals(closest.index)) {
+    auto normals = triangles.GetVertexNormals(closest.index);
+    intersection.SetNormal(normals[0] * (1 - closest.u - closest.v) + normals[1] * closest.u +
+                           normals[2] * closest.v);
+  }
+  return {intersection, geometry.GetTriangleMaterials()[closest.index]};
 }
 
-OIPoint GetClosestIntersectionPoint(const Ray &ray, const Scene &scene) {
-  auto all_intersections = GetAllRayIntersections(ray, scene);
+// a hit on an instance's mesh, found along the object space ray of instance.ToObject, in world
+// space
+template <class T>
+IPoint<T> ToWorld(const IPoint<T> &point, const BasicInstance<T> &instance, T scale) {
+  const auto &intersection = point.intersection_;
+  return {BasicIntersection<T>(instance.to_world.ApplyToPoint(intersection.GetPosition()),
+                               instance.to_object.ApplyTransposed(intersection.GetNormal()),
+                               intersection.GetDistance() / scale),
+          instance.material ? instance.material : point.material_};
+}
 
-  if (all_intersections.empty()) {
+template <class T>
+OIPoint<T> GetIntersectionPoint(const BasicRay<T> &ray, const BasicScene<T> &scene,
+                                const ClosestHit<T> &closest) {
+  if (closest.kind == ClosestHit<T>::Kind::kNone) {
     return std::nullopt;
   }
-
-  return *std::min_element(all_intersections.begin(), all_intersections.end(),
-                           [](const auto &first, const auto &second) {
-                             return first.intersection_.GetDistance() <
-                                    second.intersection_.GetDistance();
-                           });
+  if (closest.instance == ClosestHit<T>::kNoInstance) {
+    return GetPrimitivePoint(ray, scene, closest);
+  }
+  const auto &instance = scene.GetInstances()[closest.instance];
+  auto [local_ray, scale] = instance.ToObject(ray);
+  return ToWorld(GetPrimitivePoint(local_ray, scene.GetMeshes()[instance.mesh], closest),
+                 instance, scale);
 }
 
-void BuildTone(auto &image_pixels, int screen_width, int screen_height) {
-  double total = 0;
-
-  for (int i = 0; i < screen_width; i++) {
-    for (int j = 0; j < screen_height; j++) {
-      for (int k = 0; k < 3; k++) {
-        total = std::max(total, std::fabs(image_pixels[i][j][k]));
-      }
+template <class T>
+OIPoint<T> GetClosestIntersectionPoint(const BasicRay<T> &ray, const BasicScene<T> &scene) {
+  ClosestHit<T> closest;
+  auto max_distance = std::numeric_limits<T>::infinity();
+  if (const auto &bvh = scene.GetBvh()) {
+    bvh->Traverse(ray, max_distance, [&](const BasicBvhNode<T> &leaf, T &distance) {
+      IntersectLeaf(ray, scene, leaf, distance, closest);
+      max_distance = distance;
+      return false;
+    });
+    if (const auto &instance_bvh = scene.GetInstanceBvh()) {
+      instance_bvh->Traverse(ray, max_distance, [&](const BasicBvhNode<T> &leaf, T &distance) {
+        IntersectInstanceLeaf(ray, scene, leaf, distance, closest);
+        return false;
+      });
     }
+    return GetIntersectionPoint(ray, scene, closest);
   }
 
-  for (int i = 0; i < screen_width; i++) {
-    for (int j = 0; j < screen_height; j++) {
-      for (int k = 0; k < 3; k++) {
-        auto pixel = image_pixels[i][j][k];
-        pixel = pixel * (pixel / (total * total) + 1.0) / (pixel + 1.0);
-        image_pixels[i][j][k] = std::pow(pixel, kTone);
-        if (std::isnan(image_pixels[i][j][k])) {
-          image_pixels[i][j][k] = 0;
-        }
-      }
-    }
+  IntersectAll(ray, scene, max_distance, closest);
+  for (uint32_t i = 0; i < scene.GetInstances().size(); ++i) {
+    IntersectInstance(ray, scene, i, max_distance, closest,
+                      [](const BasicRay<T> &local_ray, const BasicMesh<T> &mesh,
+                         T &local_max_distance, ClosestHit<T> &local) {
+                        IntersectAll(local_ray, mesh, local_max_distance, local);
+                      });
   }
+  return GetIntersectionPoint(ray, scene, closest);
 }
 
-Vector TraceRay(const Ray &ray, Scene &scene, int depth) {
-  Vector total_intensity{0, 0, 0};
-
-  auto closest_point = GetClosestIntersectionPoint(ray, scene);
-
-  if (!closest_point.has_value() || depth == 0) {
-    return {};
+// closest hits of a packet of coherent rays (neighbouring camera rays), traversal is shared
+template <class T>
+std::vector<OIPoint<T>> GetClosestIntersectionPoints(std::span<const BasicRay<T>> rays,
+                                                     const BasicScene<T> &scene) {
+  std::vector<OIPoint<T>> points;
+  points.reserve(rays.size());
+
+  const auto &bvh = scene.GetBvh();
+  if (!bvh || rays.size() < 2 || rays.size() > BasicBvh<T>::kMaxPacketSize) {
+    for (const auto &ray: rays) {
+      points.push_back(GetClosestIntersectionPoint(ray, scene));
+    }
+    return points;
   }
 
-  auto [cl_point, m] = closest_point.value();
-  auto norm = cl_point.GetNormal();
-  auto material = *m;
+  std::vector<T> max_distances(rays.size(), std::numeric_limits<T>::infinity());
+  std::vector<ClosestHit<T>> closest(rays.size());
+  bvh->TraversePacket(rays, max_distances,
+                      [&](const BasicBvhNode<T> &leaf, size_t ray, T &max_distance) {
+                        IntersectLeaf(rays[ray], scene, leaf, max_distance, closest[ray]);
+                      });
+  if (const auto &instance_bvh = scene.GetInstanceBvh()) {
+    instance_bvh->TraversePacket(
+      rays, max_distances, [&](const BasicBvhNode<T> &leaf, size_t ray, T &max_distance) {
+        IntersectInstanceLeaf(rays[ray], scene, leaf, max_distance, closest[ray]);
+      });
+  }
 
-  for (const auto &light: scene.GetLights()) {
-    bool has_shadow{false};
+  for (size_t i = 0; i < rays.size(); ++i) {
+    points.push_back(GetIntersectionPoint(rays[i], scene, closest[i]));
+  }
+  return points;
+}
 
-    Ray light_ray = {light.position, Normalize(cl_point.GetPosition() - light.position)};
-    auto length = Length(cl_point.GetPosition() - light.position);
+// any-hit test against the primitives of a scene or mesh, counts the tests it made
+template <class T, class Geometry>
+bool IsBlocked(const BasicRay<T> &ray, T max_distance, const Geometry &geometry,
+               uint64_t &triangle_tests, uint64_t &sphere_tests) {
+  auto blocks = [&](const auto &shape) {
+    auto distance = GetIntersectionDistance(ray, shape);
+    return distance && *distance < max_distance;
+  };
+
+  bool occluded = false;
+  if (const auto &bvh = geometry.GetBvh()) {
+    bvh->Traverse(ray, max_distance, [&](const BasicBvhNode<T> &leaf, T &) {
+      triangle_tests += leaf.triangle_count;
+      occluded = GetIntersection(ray, geometry.GetTriangles(), leaf.first, leaf.triangle_count,
+                                 max_distance)
+                   .has_value();
+      if (!occluded) {
+        sphere_tests += leaf.sphere_count;
+        occluded = GetIntersection(ray, geometry.GetSpheres(), leaf.first_sphere,
+                                   leaf.sphere_count, max_distance)
+                     .has_value();
+      }
+      return occluded;
+    });
+  } else {
+    const auto &triangles = geometry.GetTriangles();
+    occluded = std::ranges::any_of(std::views::iota(size_t{0}, triangles.Size()),
+                                   [&](size_t i) {
+                                     ++triangle_tests;
+                                     return blocks(triangles.GetTriangle(i));
+                                   }) ||
+               std::ranges::any_of(geometry.GetSphereObjects(), [&](const auto &object) {
+                 ++sphere_tests;
+                 return blocks(object.sphere);
+               });
+  }
+  return occluded;
+}
 
-    for (auto obj: scene.GetObjects()) {
-      auto intersection = GetIntersection(light_ray, obj.polygon);
-      has_shadow |= intersection && intersection->GetDistance() + kEps < length;
+// any-hit query for shadow rays: stops at the first blocker closer than max_distance
+template <class T>
+bool IsOccluded(const BasicRay<T> &ray, T max_distance, const BasicScene<T> &scene) {
+  uint64_t triangle_tests = 0, sphere_tests = 0;
+  auto blocked_by_instance = [&](const BasicInstance<T> &instance) {
+    auto [local_ray, scale] = instance.ToObject(ray);
+    return IsBlocked(local_ray, max_distance * scale, scene.GetMeshes()[instance.mesh],
+                     triangle_tests, sphere_tests);
+  };
+
+  bool occluded = IsBlocked(ray, max_distance, scene, triangle_tests, sphere_tests);
+  if (!occluded) {
+    if (const auto &instance_bvh = scene.GetInstanceBvh()) {
+      instance_bvh->Traverse(ray, max_distance, [&](const BasicBvhNode<T> &leaf, T &) {
+        for (auto i = leaf.first; !occluded && i < leaf.first + leaf.triangle_count; ++i) {
+          occluded = blocked_by_instance(scene.GetInstances()[i]);
+        }
+        return occluded;
+      });
+    } else {
+      occluded = std::ranges::any_of(scene.GetInstances(), blocked_by_instance);
     }
+  }
 
-    for (auto obj: scene.GetSphereObjects()) {
-      auto intersection = GetIntersection(light_ray, obj.sphere);
-      has_shadow |= intersection && intersection->GetDistance() + kEps < length;
-    }
+  CountIntersectionTests(triangle_tests, sphere_tests);
+  CountRays(RayType::kShadow, 1, occluded);
+  return occluded;
+}
+
+template <class T>
+std::pair<BasicRay<T>, T> GetShadowRay(const BasicLight<T> &light,
+                                       const BasicVector<T> &position) {
+  auto light_ray =
+    BasicRay<T>::FromUnitDirection(light.position, Normalize(position - light.position));
+  return {light_ray, Length(position - light.position) - static_cast<T>(kEps)};
+}
 
-    if (has_shadow) {
+// Direct light (diffuse and specular) plus the material's ambient and emission at the closest
+// point of `ray`. is_lit(light_index) tells whether the shadow ray of a light is unblocked.
+template <class T, class IsLit>
+BasicVector<T> ShadeDirect(const BasicRay<T> &ray, const BasicIntersection<T> &intersection,
+                           const BasicMaterial<T> &material, const BasicScene<T> &scene,
+                           IsLit &&is_lit) {
+  BasicVector<T> total_intensity{0, 0, 0};
+  auto position = intersection.GetPosition();
+  auto norm = intersection.GetNormal();
+
+  const auto &lights = scene.GetLights();
+  for (size_t index = 0; index < lights.size(); ++index) {
+    const auto &light = lights[index];
+    if (!is_lit(index)) {
       continue;
     }
 
-    auto k_d =
-      std::max(0.0, DotProduct(norm, Normalize(light.position - cl_point.GetPosition())));
+    auto k_d = std::max(T{0}, DotProduct(norm, Normalize(light.position - position)));
 
     total_intensity += material.diffuse_color * light.intensity * k_d;
 
-    auto calc = DotProduct(Reflect(Normalize(cl_point.GetPosition() - light.position), norm),
-                           Normalize(ray.GetOrigin() - cl_point.GetPosition()));
+    auto calc = DotProduct(Reflect(Normalize(position - light.position), norm),
+                           Normalize(ray.GetOrigin() - position));
 
-    auto additional = std::pow(std::max(0.0, calc), material.specular_exponent);
+    auto additional = std::pow(std::max(T{0}, calc), material.specular_exponent);
 
     total_intensity += material.specular_color * light.intensity * additional;
   }
 
   total_intensity *= material.albedo[0];
   total_intensity += material.ambient_color + material.intensity;  // ambient
+  return total_intensity;
+}
+
+// Refractive materials a ray travels through, innermost last. Passing a surface of the innermost
+// material leaves it, any other refracting surface is entered. Media nested deeper than
+// kCapacity are not tracked, rays inside them refract as if in the outermost kCapacity ones.
+template <class T>
+class MediumStack {
+public:
+  static constexpr int kCapacity = 4;
 
-  auto point = cl_point.GetPosition();
+  bool IsInnermost(const BasicMaterial<T> *material) const {
+    return size_ > 0 && media_[size_ - 1] == material;
+  }
 
-  double al_1 = material.albedo[1], al_2 = material.albedo[2];
+  // refraction index around the ray, 1 (vacuum) outside of every medium
+  T GetRefractionIndex() const {
+    return size_ > 0 ? media_[size_ - 1]->refraction_index : T{1};
+  }
 
-  auto coefficient = 1.0 / material.refraction_index;
+  // refraction index the ray gets into when it leaves the innermost medium
+  T GetOuterRefractionIndex() const {
+    return size_ > 1 ? media_[size_ - 2]->refraction_index : T{1};
+  }
 
-  for (auto object: scene.GetSphereObjects()) {
-    if (Length(object.sphere.GetCenter() - ray.GetOrigin()) < object.sphere.GetRadius()) {
-      al_1 = 0.0, al_2 = 1.0;
-      coefficient = material.refraction_index;
+  void Push(const BasicMaterial<T> *material) {
+    if (size_ < kCapacity) {
+      media_[size_++] = material;
     }
   }
 
+  void Pop() {
+    --size_;
+  }
+
+private:
+  std::array<const BasicMaterial<T> *, kCapacity> media_{};
+  int size_ = 0;
+};
+
+// Media around point, outermost first: the refracting spheres containing it, largest first, as a
+// ray starting at point (a camera inside a glass ball) would have entered them.
+template <class T>
+MediumStack<T> GetMediaAt(const BasicScene<T> &scene, const BasicVector<T> &point) {
+  auto spheres = scene.GetSpheresContaining(point);
+  std::ranges::sort(spheres, std::greater{}, [](const BasicSphereObject<T> &object) {
+    return object.sphere.GetRadius();
+  });
+  MediumStack<T> media;
+  for (const auto &object : spheres) {
+    if (object.material->albedo[2] != 0) {
+      media.Push(object.material);
+    }
+  }
+  return media;
+}
+
+// capacity of the integrator's ray stack: a depth first walk keeps at most one pending ray per
+// level, deeper renders are clamped to it
+static constexpr int kMaxTraceDepth = 64;
+
+// secondary ray waiting to be traced: its share of the pixel and the media it starts in
+template <class T>
+struct PendingRay {
+  BasicRay<T> ray;
+  T throughput = 1;
+  int depth = 0;  // bounces left, the ray itself included
+  MediumStack<T> media;
+};
+
+// Russian roulette for a ray carrying less than min_throughput: it survives with probability
+// throughput / min_throughput and then carries min_throughput, so the pixel stays right on
+// average. The coin is a hash of the ray, renders don't depend on thread scheduling.
+template <class T>
+bool SurvivesRoulette(const BasicRay<T> &ray, T &throughput, T min_throughput) {
+  if (throughput >= min_throughput) {
+    return true;
+  }
+  using Bits = std::conditional_t<sizeof(T) == sizeof(uint32_t), uint32_t, uint64_t>;
+  uint64_t hash = 0;
+  for (int k = 0; k < 3; ++k) {
+    hash = MixBits(hash ^ std::bit_cast<Bits>(ray.GetOrigin()[k]));
+    hash = MixBits(hash ^ std::bit_cast<Bits>(ray.GetDirection()[k]));
+  }
+  if (ToUnitInterval(hash) * min_throughput >= throughput) {
+    return false;
+  }
+  throughput = min_throughput;
+  return true;
+}
+
+// Reflected and refracted continuations of `current` at its closest hit, handed to
+// emit(const PendingRay<T> &) in that order unless they end: no bounces left, zero albedo or lost
+// in Russian roulette.
+template <class T, class Emit>
+void SpawnSecondaryRays(const PendingRay<T> &current, const IPoint<T> &point, T min_throughput,
+                        Emit &&emit) {
+  const auto &[intersection, m] = point;
+  const auto &material = *m;
+
+  auto position = intersection.GetPosition();
+  auto norm = intersection.GetNormal();
+  auto direction = current.ray.GetDirection();
+
+  auto push = [&](const BasicVector<T> &origin, const BasicVector<T> &next_direction,
+                  T throughput, const MediumStack<T> &media) {
+    auto next = BasicRay<T>::FromUnitDirection(origin, next_direction);
+    if (throughput != 0 && current.depth > 1 &&
+        SurvivesRoulette(next, throughput, min_throughput)) {
+      emit(PendingRay<T>{next, throughput, current.depth - 1, media});
+    }
+  };
+
+  T al_1 = material.albedo[1], al_2 = material.albedo[2];
+
+  // inside a medium only the way out is traced, like a transparent surface seen from inside
+  auto leaving = current.media.IsInnermost(m);
+  auto coefficient =
+    current.media.GetRefractionIndex() /
+    (leaving ? current.media.GetOuterRefractionIndex() : material.refraction_index);
+  if (leaving) {
+    al_1 = 0.0, al_2 = 1.0;
+  }
+
   if (al_1 != 0) {
-    auto reflect_dir = Normalize(Reflect(ray.GetDirection(), norm));
-    auto reflect = point + Sign(DotProduct(reflect_dir, norm)) * norm * kEps;
-    total_intensity += TraceRay(Ray{reflect, reflect_dir}, scene, depth - 1) * al_1;
+    auto reflect_dir = Normalize(Reflect(direction, norm));
+    auto reflect = position + Sign(DotProduct(reflect_dir, norm)) * norm * static_cast<T>(kEps);
+    push(reflect, reflect_dir, current.throughput * al_1, current.media);
   }
 
-  auto refraction = Refract(ray.GetDirection(), norm, coefficient);
+  auto refraction = Refract(direction, norm, coefficient);
 
-  if (not refraction) {
-    return total_intensity;
+  if (not refraction || al_2 == 0) {
+    return;
   }
 
-  Vector ref = Normalize(*refraction);
+  BasicVector<T> ref = Normalize(*refraction);
+
+  auto refract = position + Sign(DotProduct(ref, norm)) * norm * static_cast<T>(kEps);
+
+  auto media = current.media;
+  if (leaving) {
+    media.Pop();
+  } else {
+    media.Push(m);
+  }
+  push(refract, ref, current.throughput * al_2, media);
+}
 
-  auto refract = point + Sign(DotProduct(ref, norm)) * norm * kEps;
+// Whitted style shading of `ray`, closest_point is its closest hit (packet traced camera rays
+// pass it in). Reflected and refracted rays go onto an explicit stack instead of recursing, each
+// with the product of the albedos along its path; rays lighter than min_throughput go through
+// Russian roulette. media are those around the ray's origin.
+template <class T>
+BasicVector<T> ShadeIntersection(const BasicRay<T> &ray, const OIPoint<T> &closest_point,
+                                 const BasicScene<T> &scene, int depth, T min_throughput,
+                                 const MediumStack<T> &media = {}) {
+  BasicVector<T> total_intensity{0, 0, 0};
+  // one per thread and reserved once, pixels don't pay for allocating or clearing it
+  thread_local std::vector<PendingRay<T>> stack;
+  stack.reserve(kMaxTraceDepth + 1);
+  stack.clear();
+
+  stack.push_back({ray, T{1}, std::min(depth, kMaxTraceDepth), media});
+  auto point = closest_point;
+
+  for (bool first = true; !stack.empty(); first = false) {
+    auto current = stack.back();
+    stack.pop_back();
+    if (!first) {
+      point = GetClosestIntersectionPoint(current.ray, scene);
+      CountRays(RayType::kSecondary, 1, point.has_value());
+    }
+    if (!point.has_value() || current.depth == 0) {
+      continue;
+    }
 
-  if (al_2 != 0.0) {
-    total_intensity += TraceRay(Ray{refract, ref}, scene, depth - 1) * al_2;
+    const auto &intersection = point->intersection_;
+    auto is_lit = [&](size_t light) {
+      auto [shadow_ray, max_distance] =
+        GetShadowRay(scene.GetLights()[light], intersection.GetPosition());
+      return !IsOccluded(shadow_ray, max_distance, scene);
+    };
+    total_intensity +=
+      ShadeDirect(current.ray, intersection, *point->material_, scene, is_lit) *
+      current.throughput;
+    SpawnSecondaryRays(current, *point, min_throughput,
+                       [&](const PendingRay<T> &next) { stack.push_back(next); });
   }
 
   return total_intensity;
 }
 
-Image Render(const std::filesystem::path &path, const CameraOptions &camera_options,
-             const RenderOptions &render_options) {
+template <class T>
+BasicVector<T> TraceRay(const BasicRay<T> &ray, const BasicScene<T> &scene, int depth,
+                        T min_throughput, const MediumStack<T> &media = {}) {
+  return ShadeIntersection(ray, GetClosestIntersectionPoint(ray, scene), scene, depth,
+                           min_throughput, media);
+}
 
-  Scene scene = ReadScene(path);
+// 10 bits of value spread to every third bit, for 30 bit Morton codes
+inline uint64_t SpreadBits(uint64_t value) {
+  value &= 0x3ff;
+  value = (value | (value << 16)) & 0x30000ff;
+  value = (value | (value << 8)) & 0x300f00f;
+  value = (value | (value << 4)) & 0x30c30c3;
+  value = (value | (value << 2)) & 0x9249249;
+  return value;
+}
 
-  double format = (camera_options.screen_width * 1.0) / camera_options.screen_height;
-  double scale = std::tan(camera_options.fov / 2);
+// Reorders a queue so rays likely to visit the same BVH nodes are adjacent: by direction octant,
+// then by the Morton code of the origin within the queue's bounds, then by direction.
+template <class T, class Item, class GetRay>
+void SortForCoherence(std::vector<Item> &items, GetRay &&get_ray) {
+  BasicAabb<T> bounds;
+  for (const auto &item: items) {
+    bounds.Extend(get_ray(item).GetOrigin());
+  }
 
-  std::vector<Vector> tmp(camera_options.screen_height, Vector{0, 0, 0});
-  std::vector<std::vector<Vector>> image_pixels(camera_options.screen_width, tmp);
+  auto quantize = [](T value, T min, T extent, int bits) -> uint64_t {
+    auto scaled = extent > 0 ? (value - min) / extent : T{0};
+    return static_cast<uint64_t>(std::clamp(scaled, T{0}, T{1}) * ((1 << bits) - 1));
+  };
+  std::vector<std::pair<uint64_t, size_t>> keys(items.size());
+  for (size_t i = 0; i < items.size(); ++i) {
+    const auto &ray = get_ray(items[i]);
+    uint64_t octant = 0, origin = 0, direction = 0;
+    for (int k = 0; k < 3; ++k) {
+      octant |= static_cast<uint64_t>(ray.GetDirection()[k] < 0) << k;
+      origin |= SpreadBits(quantize(ray.GetOrigin()[k], bounds.GetMin()[k],
+                                    bounds.Extent()[k], 10))
+                << k;
+      direction |= SpreadBits(quantize(ray.GetDirection()[k], T{-1}, T{2}, 9)) << k;
+    }
+    keys[i] = {octant << 57 | origin << 27 | direction, i};
+  }
+  std::ranges::sort(keys);
 
-  double max_among_all_rays = 0.0;
+  std::vector<Item> sorted;
+  sorted.reserve(items.size());
+  for (const auto &[key, index]: keys) {
+    sorted.push_back(items[index]);
+  }
+  items = std::move(sorted);
+}
 
-  Vector dx = {1, 0, 0};
-  Vector dy = {0, 1, 0};
+// ray of a wavefront queue and the camera ray (index into the batch) it contributes to
+template <class T>
+struct WavefrontRay {
+  PendingRay<T> pending;
+  size_t pixel;
+};
 
-  for (int i = 0; i < camera_options.screen_width; i++) {
-    for (int j = 0; j < camera_options.screen_height; j++) {
-      double x = (2 * (i + 0.5) / camera_options.screen_width - 1) * format * scale;
-      double y = (1 - 2 * (j + 0.5) / camera_options.screen_height) * scale;
+// Breadth first alternative to ShadeIntersection for a batch of camera rays with their closest
+// hits. Each bounce of the whole batch is one queue: sorted for coherence and intersected in
+// packets of packet_size rays, then all its shadow rays are tested, then every hit is shaded and
+// emits its reflected and refracted rays into the next queue. The rays traced are those of
+// ShadeIntersection, colors only differ in the order contributions are summed.
+template <class T>
+std::vector<BasicVector<T>> ShadeWavefront(std::span<const BasicRay<T>> rays,
+                                           std::span<const OIPoint<T>> points,
+                                           const BasicScene<T> &scene, int depth,
+                                           T min_throughput, size_t packet_size,
+                                           const MediumStack<T> &media = {}) {
+  std::vector<BasicVector<T>> colors(rays.size());
+  std::vector<WavefrontRay<T>> queue, next;
+  for (size_t i = 0; i < rays.size(); ++i) {
+    queue.push_back({{rays[i], T{1}, std::min(depth, kMaxTraceDepth), media}, i});
+  }
+  std::vector<OIPoint<T>> hits(points.begin(), points.end());
+
+  const auto &lights = scene.GetLights();
+  std::vector<uint8_t> lit;  // queue position * light count + light
+  std::vector<BasicRay<T>> packet;
+  packet_size = std::clamp<size_t>(packet_size, 1, BasicBvh<T>::kMaxPacketSize);
+
+  for (bool first = true; !queue.empty(); first = false) {
+    if (!first) {
+      SortForCoherence<T>(queue, [](const auto &ray) -> auto & { return ray.pending.ray; });
+      hits.clear();
+      for (size_t begin = 0; begin < queue.size(); begin += packet_size) {
+        packet.clear();
+        for (size_t k = begin; k < std::min(queue.size(), begin + packet_size); ++k) {
+          packet.push_back(queue[k].pending.ray);
+        }
+        auto packet_hits =
+          GetClosestIntersectionPoints(std::span<const BasicRay<T>>(packet), scene);
+        hits.insert(hits.end(), packet_hits.begin(), packet_hits.end());
+      }
+      CountRays(RayType::kSecondary, hits.size(), std::ranges::count_if(hits, [](const auto &hit) {
+                  return hit.has_value();
+                }));
+    }
 
-      auto forward = Normalize(camera_options.look_from - camera_options.look_to);
-      auto beg = camera_options.look_from;
+    // light by light in queue order: they share the origin and the sorted hits keep their
+    // directions close
+    lit.assign(queue.size() * lights.size(), 0);
+    for (size_t light = 0; light < lights.size(); ++light) {
+      for (size_t k = 0; k < queue.size(); ++k) {
+        if (hits[k] && queue[k].pending.depth > 0) {
+          auto [ray, max_distance] =
+            GetShadowRay(lights[light], hits[k]->intersection_.GetPosition());
+          lit[k * lights.size() + light] = !IsOccluded(ray, max_distance, scene);
+        }
+      }
+    }
 
-      auto right = CrossProduct(dy, forward);
-      if (right.IsZero()) {
-        right = dx;
+    next.clear();
+    for (size_t k = 0; k < queue.size(); ++k) {
+      const auto &[current, pixel] = queue[k];
+      if (!hits[k] || current.depth == 0) {
+        continue;
       }
-      right.Normalize();
+      auto is_lit = [&](size_t light) { return lit[k * lights.size() + light] != 0; };
+      colors[pixel] +=
+        ShadeDirect(current.ray, hits[k]->intersection_, *hits[k]->material_, scene, is_lit) *
+        current.throughput;
+      SpawnSecondaryRays(current, *hits[k], min_throughput,
+                         [&](const PendingRay<T> &ray) { next.push_back({ray, pixel}); });
+    }
+    std::swap(queue, next);
+  }
 
-      auto up = CrossProduct(forward, right);
-      if (up.IsZero()) {
-        up = dx;
+  return colors;
+}
+
+// rectangular block of the frame, tiles are disjoint so they write to the framebuffer unlocked
+struct Tile {
+  int x, y, width, height;
+  int samples = 0;  // per pixel, progressive passes that reached this tile
+  bool converged = false;
+};
+
+std::vector<Tile> SplitIntoTiles(int screen_width, int screen_height, int tile_size) {
+  std::vector<Tile> tiles;
+  tile_size = std::max(1, tile_size);
+  for (int y = 0; y < screen_height; y += tile_size) {
+    for (int x = 0; x < screen_width; x += tile_size) {
+      int width = std::min(tile_size, screen_width - x);
+      int height = std::min(tile_size, screen_height - y);
+      tiles.push_back({x, y, width, height});
+    }
+  }
+  return tiles;
+}
+
+double Luminance(const Vector &color) {
+  return 0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2];
+}
+
+// A tile has converged when the standard error of its pixel means, averaged over the tile, is
+// below tolerance times its mean brightness, or the frame's for tiles darker than that (tone
+// mapping is global, noise in dark tiles is judged against the whole image). sums holds per pixel
+// sums of the samples, squared_luminance the sums of their squared luminance.
+bool IsConverged(const Tile &tile, const Framebuffer &sums,
+                 const std::vector<double> &squared_luminance, double tolerance,
+                 double frame_brightness) {
+  double n = tile.samples;
+  double variance_of_mean = 0;
+  double brightness = 0;
+  for (int j = tile.y; j < tile.y + tile.height; j++) {
+    for (int i = tile.x; i < tile.x + tile.width; i++) {
+      auto mean = Luminance(sums.At(i, j)) / n;
+      auto mean_square = squared_luminance[static_cast<size_t>(j) * sums.Width() + i] / n;
+      variance_of_mean += std::max(0.0, mean_square - mean * mean) / (n - 1);
+      brightness += mean;
+    }
+  }
+  auto pixels = static_cast<double>(tile.width) * tile.height;
+  return std::sqrt(variance_of_mean / pixels) <=
+         tolerance * std::max(std::fabs(brightness / pixels), frame_brightness);
+}
+
+// sums of samples to per pixel means, tile by tile
+void ResolveMeans(const std::vector<Tile> &tiles, Framebuffer &framebuffer) {
+  for (const auto &tile: tiles) {
+    if (tile.samples <= 1) {
+      continue;
+    }
+    for (int j = tile.y; j < tile.y + tile.height; j++) {
+      for (int i = tile.x; i < tile.x + tile.width; i++) {
+        framebuffer.At(i, j) /= tile.samples;
       }
-      up.Normalize();
+    }
+  }
+}
 
-      Vector end = right * x + up * y - forward + beg;
+// what adaptive sampling compares between two samples
+struct PixelSample {
+  Vector color;
+  double distance = kInfDistance;  // kInfDistance on a miss
+  Vector normal;                   // unit length on a hit
+};
+
+// true when a and b likely straddle an edge: one of them misses, the distance jumps, the normals
+// form a crease or a channel's contrast (max - min) / (max + min) exceeds the threshold
+bool IsDiscontinuous(const PixelSample &a, const PixelSample &b, const AdaptiveOptions &options) {
+  auto a_hit = a.distance != kInfDistance;
+  if (a_hit != (b.distance != kInfDistance)) {
+    return true;
+  }
+  if (a_hit && (std::fabs(a.distance - b.distance) >
+                  options.depth_threshold * std::min(a.distance, b.distance) ||
+                DotProduct(a.normal, b.normal) < options.normal_threshold)) {
+    return true;
+  }
+  for (int k = 0; k < 3; ++k) {
+    auto [low, high] = std::minmax({std::fabs(a.color[k]), std::fabs(b.color[k])});
+    if (high - low > options.contrast_threshold * (high + low)) {
+      return true;
+    }
+  }
+  return false;
+}
 
-      auto ray = Ray(beg, Normalize(end - beg));
+// progress of a progressive render: the mean image after each pass
+using PassCallback = std::function<void(const Framebuffer &, int pass)>;
+
+// Compresses the scene's triangles with scene_options.compact_mesh, builds its BVH or drops it
+// for kBruteForce. A prepared scene can be rendered any number of times.
+template <class T>
+void PrepareScene(BasicScene<T> &scene, const RenderOptions &scene_options, ThreadPool &pool,
+                  RenderStats &stats) {
+  if (scene_options.compact_mesh) {
+    auto timer = stats.TimePhase("compress");
+    scene.CompressTriangles(pool);
+  }
+  if (scene_options.acceleration == AccelerationMode::kBruteForce) {
+    scene.ResetBvh();
+  } else if (!scene.GetBvh()) {
+    auto timer = stats.TimePhase("bvh");
+    scene.BuildBvh();
+  }
+}
 
-      if (render_options.mode == RenderMode::kDepth) {
-        double distance = kInfDistance;
-        auto point = GetClosestIntersectionPoint(ray, scene);
-        if (point) {
-          distance = point->intersection_.GetDistance();
-          max_among_all_rays = std::max(max_among_all_rays, distance);
-        }
-        image_pixels[i][j] = {distance, distance, distance};
+// Renders a scene set up by PrepareScene, tracing in its precision T. Camera rays are set up and
+// the framebuffer is kept in double either way.
+template <class T>
+Framebuffer RenderScene(const BasicScene<T> &scene, const CameraOptions &camera_options,
+                        const RenderOptions &render_options, ThreadPool &pool,
+                        RenderStats &stats, const PassCallback &on_pass = {}) {
+  Camera camera(camera_options);
+  // camera rays start inside whatever glass the camera is in
+  auto camera_media = GetMediaAt(scene, BasicVector<T>(camera.GetOrigin()));
+
+  // sums of the samples of each pixel, means once the render is done
+  Framebuffer framebuffer(camera_options.screen_width, camera_options.screen_height);
+
+  std::optional<ProgressiveOptions> progressive;
+  if (render_options.mode != RenderMode::kDepth) {
+    progressive = render_options.progressive;
+  }
+  std::vector<double> squared_luminance;
+  if (progressive) {
+    squared_luminance.resize(framebuffer.Pixels().size());
+  }
+
+  std::optional<AdaptiveOptions> adaptive;
+  if (render_options.mode != RenderMode::kDepth) {
+    adaptive = render_options.adaptive;
+  }
+  if (progressive && adaptive) {
+    throw std::runtime_error{"Progressive and adaptive sampling can't be combined"};
+  }
+  // the centre samples, edges are detected on them once the first pass is done
+  std::vector<PixelSample> centre_samples;
+  if (adaptive) {
+    centre_samples.resize(framebuffer.Pixels().size());
+  }
+
+  auto shade_sample = [&](const BasicRay<T> &ray, const OIPoint<T> &point) -> Vector {
+    if (render_options.mode == RenderMode::kDepth) {
+      double distance = kInfDistance;
+      if (point) {
+        distance = point->intersection_.GetDistance();
       }
+      return {distance, distance, distance};
+    }
+
+    if (render_options.mode == RenderMode::kNormal) {
+      if (point) {
+        return Vector(point->intersection_.GetNormal());
+      }
+      return {};
+    }
 
-      if (render_options.mode == RenderMode::kNormal) {
-        auto point = GetClosestIntersectionPoint(ray, scene);
+    return Vector(ShadeIntersection(ray, point, scene, render_options.depth,
+                                    static_cast<T>(render_options.min_throughput),
+                                    camera_media));
+  };
 
-        if (point) {
-          image_pixels[i][j] = point->intersection_.GetNormal();
+  auto make_sample = [](const OIPoint<T> &point, const Vector &color) {
+    PixelSample sample{color, kInfDistance, {}};
+    if (point) {
+      sample.distance = point->intersection_.GetDistance();
+      sample.normal = Normalize(Vector(point->intersection_.GetNormal()));
+    }
+    return sample;
+  };
+
+  auto add_sample = [&](const Tile &tile, int i, int j, const Vector &color) {
+    auto &pixel = framebuffer.At(i, j);
+    pixel = tile.samples == 0 ? color : pixel + color;
+    if (progressive) {
+      auto luminance = Luminance(color);
+      squared_luminance[static_cast<size_t>(j) * framebuffer.Width() + i] += luminance * luminance;
+    }
+  };
+
+  auto wavefront = render_options.mode == RenderMode::kFull &&
+                   render_options.integrator == Integrator::kWavefront;
+
+  // one sample per pixel of the tile, camera rays of packet_size x packet_size pixel blocks
+  // share one BVH traversal, kWavefront then shades the whole tile as one batch
+  auto render_tile = [&](Tile &tile) {
+    int packet_size = std::max(1, render_options.packet_size);
+    auto seed = progressive ? progressive->seed : 0;
+    std::vector<BasicRay<T>> rays;
+    std::vector<OIPoint<T>> points;
+    std::vector<std::pair<int, int>> pixels;
+
+    for (int packet_x = tile.x; packet_x < tile.x + tile.width; packet_x += packet_size) {
+      for (int packet_y = tile.y; packet_y < tile.y + tile.height; packet_y += packet_size) {
+        auto packet_begin = rays.size();
+        auto packet_end_x = std::min(packet_x + packet_size, tile.x + tile.width);
+        for (int j = packet_y; j < std::min(packet_y + packet_size, tile.y + tile.height); j++) {
+          if (tile.samples == 0) {
+            // pixel centres, stepped along the row
+            camera.AppendRowRays(j, packet_x, packet_end_x, 0.5, 0.5, rays);
+          }
+          for (int i = packet_x; i < packet_end_x; i++) {
+            if (tile.samples > 0) {
+              auto [offset_x, offset_y] = GetSampleOffset(i, j, tile.samples, seed);
+              rays.push_back(camera.GetRay<T>(i, j, offset_x, offset_y));
+            }
+            pixels.emplace_back(i, j);
+          }
         }
-      }
 
-      if (render_options.mode == RenderMode::kFull) {
-        image_pixels[i][j] = TraceRay(ray, scene, render_options.depth);
+        auto packet = std::span<const BasicRay<T>>(rays).subspan(packet_begin);
+        auto packet_points = GetClosestIntersectionPoints(packet, scene);
+        points.insert(points.end(), packet_points.begin(), packet_points.end());
+      }
+    }
+    CountRays(RayType::kCamera, rays.size(),
+              std::ranges::count_if(points, [](const auto &point) { return point.has_value(); }));
+
+    std::vector<Vector> colors;
+    colors.reserve(rays.size());
+    if (wavefront) {
+      auto shaded = ShadeWavefront(std::span<const BasicRay<T>>(rays),
+                                   std::span<const OIPoint<T>>(points), scene,
+                                   render_options.depth,
+                                   static_cast<T>(render_options.min_throughput),
+                                   static_cast<size_t>(packet_size * packet_size),
+                                   camera_media);
+      for (const auto &color: shaded) {
+        colors.emplace_back(color);
+      }
+    } else {
+      for (size_t k = 0; k < rays.size(); ++k) {
+        colors.push_back(shade_sample(rays[k], points[k]));
       }
     }
-  }
 
-  Image image = Image(camera_options.screen_width, camera_options.screen_height);
+    for (size_t k = 0; k < rays.size(); ++k) {
+      auto [i, j] = pixels[k];
+      if (adaptive) {
+        centre_samples[static_cast<size_t>(j) * framebuffer.Width() + i] =
+          make_sample(points[k], colors[k]);
+      }
+      add_sample(tile, i, j, colors[k]);
+    }
+    ++tile.samples;
+  };
+
+  auto tiles = SplitIntoTiles(camera_options.screen_width, camera_options.screen_height,
+                              render_options.tile_size);
+
+  auto start = std::chrono::steady_clock::now();
+  auto out_of_time = [&] {
+    return progressive && progressive->time_budget.count() > 0 &&
+           std::chrono::steady_clock::now() - start >= progressive->time_budget;
+  };
+  int max_passes = progressive ? std::max(1, progressive->max_passes) : 1;
+
+  for (int pass = 0; pass < max_passes; ++pass) {
+    std::vector<ThreadPool::Task> tasks;
+    for (auto &tile: tiles) {
+      if (!tile.converged) {
+        // the first pass always completes, so there is an image to show
+        tasks.emplace_back([&, pass, &tile = tile] {
+          if (pass == 0 || !out_of_time()) {
+            render_tile(tile);
+          }
+        });
+      }
+    }
+    if (tasks.empty()) {
+      break;
+    }
+    pool.Run(std::move(tasks));
+
+    if (progressive) {
+      double frame_brightness = 0;
+      for (const auto &tile: tiles) {
+        for (int j = tile.y; j < tile.y + tile.height; j++) {
+          for (int i = tile.x; i < tile.x + tile.width; i++) {
+            frame_brightness += Luminance(framebuffer.At(i, j)) / tile.samples;
+          }
+        }
+      }
+      frame_brightness = std::fabs(frame_brightness) / framebuffer.Pixels().size();
 
-  /// kFull
-  if (render_options.mode == RenderMode::kFull) {
-    BuildTone(image_pixels, camera_options.screen_width, camera_options.screen_height);
-    for (int i = 0; i < camera_options.screen_width; i++) {
-      for (int j = 0; j < camera_options.screen_height; j++) {
-        image.SetPixel(RGBCast(image_pixels[i][j]), j, i);
+      for (auto &tile: tiles) {
+        tile.converged = tile.converged || (tile.samples >= std::max(2, progressive->min_passes) &&
+                                            IsConverged(tile, framebuffer, squared_luminance,
+                                                        progressive->tolerance, frame_brightness));
       }
     }
+    if (on_pass && pass + 1 < max_passes) {
+      auto means = framebuffer;
+      ResolveMeans(tiles, means);
+      on_pass(means, pass);
+    }
+    if (out_of_time()) {
+      break;
+    }
   }
+  std::chrono::duration<double> trace_time = std::chrono::steady_clock::now() - start;
+  stats.AddPhaseTime("trace", trace_time.count());
+
+  ResolveMeans(tiles, framebuffer);
+
+  if (adaptive) {
+    auto timer = stats.TimePhase("adaptive");
+    // Mean color of the cell [x, x + size)^2 in pixel (i, j), size in pixels: samples the centres
+    // of its quadrants as one packet and subdivides the quadrants that differ from a neighbouring
+    // quadrant, while the pixel's sample budget lasts.
+    auto refine = [&](auto &self, int i, int j, double x, double y, double size,
+                      int &budget) -> Vector {
+      auto quadrant_ray = [&](int q) {
+        return camera.GetRay<T>(i, j, x + (q % 2 + 0.5) * size / 2,
+                                y + (q / 2 + 0.5) * size / 2);
+      };
+      std::array rays{quadrant_ray(0), quadrant_ray(1), quadrant_ray(2), quadrant_ray(3)};
+      budget -= 4;
+      auto points = GetClosestIntersectionPoints(std::span<const BasicRay<T>>(rays), scene);
+      CountRays(RayType::kCamera, 4, std::ranges::count_if(points, [](const auto &point) {
+                  return point.has_value();
+                }));
+      std::array<PixelSample, 4> samples;
+      for (int q = 0; q < 4; ++q) {
+        samples[q] = make_sample(points[q], shade_sample(rays[q], points[q]));
+      }
 
-  /// kDepth
-  if (render_options.mode == RenderMode::kDepth) {
-    for (int i = 0; i < camera_options.screen_width; i++) {
-      for (int j = 0; j < camera_options.screen_height; j++) {
-        if (image_pixels[i][j][0] == kInfDistance) {
-          image_pixels[i][j] = {1.0, 1.0, 1.0};
+      Vector color;
+      for (int q = 0; q < 4; ++q) {
+        // q ^ 1 and q ^ 2 are the horizontal and vertical neighbours of quadrant q
+        if (budget >= 4 && (IsDiscontinuous(samples[q], samples[q ^ 1], *adaptive) ||
+                            IsDiscontinuous(samples[q], samples[q ^ 2], *adaptive))) {
+          color += self(self, i, j, x + q % 2 * size / 2, y + q / 2 * size / 2, size / 2, budget);
         } else {
-          image_pixels[i][j] = image_pixels[i][j] / max_among_all_rays;
+          color += samples[q].color;
         }
       }
-    }
-    for (int i = 0; i < camera_options.screen_width; i++) {
-      for (int j = 0; j < camera_options.screen_height; j++) {
-        image.SetPixel(RGBCast(image_pixels[i][j]), j, i);
+      return color / 4;
+    };
+
+    // found on the centre samples before any pixel is refined
+    std::vector<uint8_t> edges(centre_samples.size());
+    auto width = framebuffer.Width(), height = framebuffer.Height();
+    auto for_each_tile = [&](auto &&pixel_function) {
+      std::vector<ThreadPool::Task> tasks;
+      for (const auto &tile: tiles) {
+        tasks.emplace_back([&] {
+          for (int j = tile.y; j < tile.y + tile.height; j++) {
+            for (int i = tile.x; i < tile.x + tile.width; i++) {
+              pixel_function(i, j, static_cast<size_t>(j) * width + i);
+            }
+          }
+        });
       }
-    }
+      pool.Run(std::move(tasks));
+    };
+
+    for_each_tile([&](int i, int j, size_t index) {
+      const auto &sample = centre_samples[index];
+      edges[index] = (i > 0 && IsDiscontinuous(sample, centre_samples[index - 1], *adaptive)) ||
+                     (i + 1 < width && IsDiscontinuous(sample, centre_samples[index + 1],
+                                                       *adaptive)) ||
+                     (j > 0 && IsDiscontinuous(sample, centre_samples[index - width],
+                                               *adaptive)) ||
+                     (j + 1 < height && IsDiscontinuous(sample, centre_samples[index + width],
+                                                        *adaptive));
+    });
+    for_each_tile([&](int i, int j, size_t index) {
+      int budget = adaptive->max_samples - 1;
+      if (edges[index] && budget >= 4) {
+        framebuffer.At(i, j) = refine(refine, i, j, 0, 0, 1, budget);
+      }
+    });
+  }
+
+  return framebuffer;
+}
+
+Framebuffer RenderFramebuffer(const std::filesystem::path &path,
+                              const CameraOptions &camera_options,
+                              const RenderOptions &render_options, ThreadPool &pool,
+                              RenderStats &stats, const PassCallback &on_pass = {}) {
+  stats.SetFrame(camera_options.screen_width, camera_options.screen_height, pool.Size());
+  auto scene = [&] {
+    auto timer = stats.TimePhase("load");
+    return render_options.scene_cache ? ReadSceneCached(path, render_options.thread_count)
+                                      : ReadScene(path, render_options.thread_count);
+  }();
+  if (render_options.precision == Precision::kFloat) {
+    BasicScene<float> float_scene(scene);
+    PrepareScene(float_scene, render_options, pool, stats);
+    return RenderScene(float_scene, camera_options, render_options, pool, stats, on_pass);
+  }
+  PrepareScene(scene, render_options, pool, stats);
+  return RenderScene(scene, camera_options, render_options, pool, stats, on_pass);
+}
+
+// Maps the HDR framebuffer to 8bit RGBA for `mode` in parallel and hands the finished rows, top
+// to bottom, to row_sink(int y, std::span<const png_byte> row).
+template <class RowSink>
+void PostProcess(const Framebuffer &framebuffer, RenderMode mode, ThreadPool &pool,
+                 RowSink &&row_sink) {
+  /// kFull
+  if (mode == RenderMode::kFull) {
+    auto total = ReduceMax(framebuffer, pool, MaxChannel);
+    PostProcessPipeline pipeline(ReinhardTonemap{total}, Gamma{kTone});
+    RunPostProcess(framebuffer, pipeline, pool, row_sink);
+  }
+
+  /// kDepth
+  if (mode == RenderMode::kDepth) {
+    auto max_distance = ReduceMax(framebuffer, pool, [](std::span<const Vector> row) {
+      return MaxDepth(row, kInfDistance);
+    });
+    PostProcessPipeline pipeline(DepthNormalize{kInfDistance, max_distance});
+    RunPostProcess(framebuffer, pipeline, pool, row_sink);
   }
 
   /// kNormal
-  if (render_options.mode == RenderMode::kNormal) {
-    for (int i = 0; i < camera_options.screen_width; i++) {
-      for (int j = 0; j < camera_options.screen_height; j++) {
-        if (image_pixels[i][j].NotZero()) {
-          image_pixels[i][j] *= 0.5;
-          image_pixels[i][j] += 0.5;
-        }
+  if (mode == RenderMode::kNormal) {
+    RunPostProcess(framebuffer, PostProcessPipeline(NormalRemap{}), pool, row_sink);
+  }
+}
+
+Image ToImage(const Framebuffer &framebuffer, RenderMode mode, ThreadPool &pool) {
+  Image image(framebuffer.Width(), framebuffer.Height());
+  PostProcess(framebuffer, mode, pool, [&](int y, std::span<const png_byte> row) {
+    std::ranges::copy(row, image.Row(y).begin());
+  });
+  return image;
+}
+
+// on_image(image, pass) receives the intermediate images of a progressive render
+Image Render(const std::filesystem::path &path, const CameraOptions &camera_options,
+             const RenderOptions &render_options,
+             const std::function<void(const Image &, int pass)> &on_image = {}) {
+  ThreadPool pool(render_options.thread_count);
+  RenderStats stats;
+  PassCallback on_pass;
+  if (on_image) {
+    on_pass = [&](const Framebuffer &framebuffer, int pass) {
+      on_image(ToImage(framebuffer, render_options.mode, pool), pass);
+    };
+  }
+  auto framebuffer = RenderFramebuffer(path, camera_options, render_options, pool, stats, on_pass);
+  return ToImage(framebuffer, render_options.mode, pool);
+}
+
+// Post-processes the framebuffer straight into a PNG file, rows are compressed as they are
+// finished and no 8bit image is kept. With stats_report the statistics go to
+// <output>.stats.json.
+void WriteFramebuffer(const Framebuffer &framebuffer, const std::filesystem::path &output_path,
+                      const RenderOptions &render_options, ThreadPool &pool, RenderStats &stats,
+                      const PngOptions &png_options = {}) {
+  // rows are written while post-processing runs, the time spent writing is split off
+  auto post_process_start = std::chrono::steady_clock::now();
+  std::chrono::duration<double> write_time{0};
+  PngWriter writer(output_path, framebuffer.Width(), framebuffer.Height(), png_options);
+  PostProcess(framebuffer, render_options.mode, pool, [&](int, std::span<const png_byte> row) {
+    auto write_start = std::chrono::steady_clock::now();
+    writer.WriteRow(row);
+    write_time += std::chrono::steady_clock::now() - write_start;
+  });
+  std::chrono::duration<double> post_process_time =
+      std::chrono::steady_clock::now() - post_process_start;
+  stats.AddPhaseTime("post_process", post_process_time.count() - write_time.count());
+  {
+    auto timer = stats.TimePhase("write");
+    writer.Finish();
+  }
+  stats.AddPhaseTime("write", write_time.count());
+
+  if (render_options.stats_report) {
+    auto report_path = output_path;
+    report_path.replace_extension(".stats.json");
+    stats.WriteJson(report_path);
+  }
+}
+
+// Render straight to a PNG file, see WriteFramebuffer.
+void RenderToPng(const std::filesystem::path &path, const std::filesystem::path &output_path,
+                 const CameraOptions &camera_options, const RenderOptions &render_options,
+                 const PngOptions &png_options = {}) {
+  ThreadPool pool(render_options.thread_count);
+  RenderStats stats;
+  auto framebuffer = RenderFramebuffer(path, camera_options, render_options, pool, stats);
+  WriteFramebuffer(framebuffer, output_path, render_options, pool, stats, png_options);
+}
+
+// Renders every job over one load of the scene: the threads, the scene in the tracing precision
+// and its BVH are shared by all jobs. Scene options (threads, precision, acceleration, cache,
+// compact mesh) are taken from scene_options.
+void RenderBatch(const std::filesystem::path &path, const RenderOptions &scene_options,
+                 std::span<const RenderJob> jobs) {
+  ThreadPool pool(scene_options.thread_count);
+  RenderStats load_stats;
+  auto scene = [&] {
+    auto timer = load_stats.TimePhase("load");
+    return scene_options.scene_cache ? ReadSceneCached(path, scene_options.thread_count)
+                                     : ReadScene(path, scene_options.thread_count);
+  }();
+
+  auto render_jobs = [&](auto &prepared_scene) {
+    PrepareScene(prepared_scene, scene_options, pool, load_stats);
+    for (const auto &job: jobs) {
+      // the shared load and BVH build show up in the report of every job
+      RenderStats stats;
+      for (const auto &[phase, seconds]: load_stats.GetPhases()) {
+        stats.AddPhaseTime(phase, seconds);
       }
+      auto render_options = job.render;
+      render_options.thread_count = scene_options.thread_count;
+      render_options.precision = scene_options.precision;
+      render_options.acceleration = scene_options.acceleration;
+      stats.SetFrame(job.camera.screen_width, job.camera.screen_height, pool.Size());
+      auto framebuffer = RenderScene(prepared_scene, job.camera, render_options, pool, stats);
+      WriteFramebuffer(framebuffer, job.output, render_options, pool, stats);
     }
-    for (int i = 0; i < camera_options.screen_width; i++) {
-      for (int j = 0; j < camera_options.screen_height; j++) {
-        image.SetPixel(RGBCast(image_pixels[i][j]), j, i);
+  };
+  if (scene_options.precision == Precision::kFloat) {
+    BasicScene<float> float_scene(scene);
+    render_jobs(float_scene);
+  } else {
+    render_jobs(scene);
+  }
+}
+
+// Changes the scene in place to frame `frame`, through the BasicScene::Update* methods (on pool
+// where they take one), and returns the job rendering it
+template <class T>
+using FrameUpdate = std::function<RenderJob(BasicScene<T> &scene, ThreadPool &pool, int frame)>;
+
+// Renders frames [0, frame_count) of an animation over one load of the scene, tracing in its
+// precision T. After each update the BVHs are refit, or rebuilt once refitting has made them
+// scene_options.max_refit_cost times as costly as when built. Threads, acceleration and compact
+// mesh are taken from scene_options, as in RenderBatch.
+template <class T>
+void RenderSequence(BasicScene<T> &scene, int frame_count, const FrameUpdate<T> &update,
+                    const RenderOptions &scene_options) {
+  ThreadPool pool(scene_options.thread_count);
+  RenderStats setup_stats;
+  PrepareScene(scene, scene_options, pool, setup_stats);
+
+  for (int frame = 0; frame < frame_count; ++frame) {
+    // the first frame reports the initial BVH build
+    RenderStats stats;
+    if (frame == 0) {
+      for (const auto &[phase, seconds]: setup_stats.GetPhases()) {
+        stats.AddPhaseTime(phase, seconds);
       }
     }
+    auto job = [&] {
+      auto timer = stats.TimePhase("update");
+      return update(scene, pool, frame);
+    }();
+    auto refit_start = std::chrono::steady_clock::now();
+    auto rebuilt = scene.UpdateBvh(pool, scene_options.max_refit_cost);
+    std::chrono::duration<double> refit_time = std::chrono::steady_clock::now() - refit_start;
+    stats.AddPhaseTime(rebuilt ? "bvh" : "refit", refit_time.count());
+
+    auto render_options = job.render;
+    render_options.thread_count = scene_options.thread_count;
+    render_options.acceleration = scene_options.acceleration;
+    stats.SetFrame(job.camera.screen_width, job.camera.screen_height, pool.Size());
+    auto framebuffer = RenderScene(scene, job.camera, render_options, pool, stats);
+    WriteFramebuffer(framebuffer, job.output, render_options, pool, stats);
   }
-
-  return image;
 }
 
 inline std::filesystem::path GetRelativeDir(std::string_view file_path,
@@ -325,13 +1267,36 @@ inline std::filesystem::path GetRelativeDir(std::string_view file_path,
   }
 }
 
-int main() {
-  CameraOptions camera_opts{.screen_width = 1000,
-    .screen_height = 1000,
-    .look_from = {100., 200., 150.},
-    .look_to = {0., 100., 0.}};
-  RenderOptions render_opts{1, RenderMode::kNormal};
-  static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
-  auto image = Render(kTestsDir / "CERF_Free.obj", camera_opts, render_opts);
-  image.Write(kTestsDir / "result.png");
-}
\ No newline at end of file
+#ifndef RTRACER_NO_MAIN
+// without arguments renders the bundled test scene to tests/result.png
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    CameraOptions camera_opts{.screen_width = 1000,
+      .screen_height = 1000,
+      .look_from = {100., 200., 150.},
+      .look_to = {0., 100., 0.}};
+    RenderOptions render_opts{1, RenderMode::kNormal};
+    static const auto kTestsDir = GetRelativeDir(__FILE__, "tests");
+    auto image = Render(kTestsDir / "CERF_Free.obj", camera_opts, render_opts);
+    image.Write(kTestsDir / "result.png");
+    return 0;
+  }
+
+  try {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    auto command_line = ParseCommandLine(args);
+    if (command_line.help) {
+      std::fputs(kUsage.data(), stdout);
+      return 0;
+    }
+    std::vector<RenderJob> jobs = {command_line.job};
+    if (command_line.batch) {
+      jobs = ReadBatch(*command_line.batch, command_line.job);
+    }
+    RenderBatch(command_line.scene, command_line.job.render, jobs);
+  } catch (const std::exception &error) {
+    std::fprintf(stderr, "rtracer: %s\n", error.what());
+    return 1;
+  }
+}
+#endif
@@ -0,0 +1,84 @@
+// FastPow check: random and swept inputs against std::pow must stay within kMaxRelativeError,
+// NaN, negative and subnormal input must give 0 and +inf stay +inf, and the SIMD Gamma stage
+// must return FastPow's values bit for bit, tails included.
+// usage: fast_pow [random_samples = 20000000]
+
+#include "post_process.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <random>
+#include <vector>
+
+constexpr double kMaxRelativeError = 1e-12;
+constexpr double kGammaExponent = 1.0 / 2.2;
+
+double RelativeError(double x, double y) {
+  auto exact = std::pow(x, y);
+  return std::abs(FastPow(x, y) - exact) / exact;
+}
+
+int main(int argc, char **argv) {
+  long random_samples = argc > 1 ? std::atol(argv[1]) : 20'000'000;
+  bool failed = false;
+  auto check = [&](bool passed, const char *what) {
+    if (!passed) {
+      std::printf("FAILED: %s\n", what);
+      failed = true;
+    }
+  };
+
+  // x = m * 2^e over most of the normal range, every exponent in [-1, 1]
+  std::mt19937_64 random(0);
+  std::uniform_real_distribution<double> mantissa(1.0, 2.0), power(-1020.0, 1000.0),
+    exponent(-1.0, 1.0);
+  double random_error = 0;
+  for (long i = 0; i < random_samples; ++i) {
+    auto x = std::ldexp(mantissa(random), static_cast<int>(power(random)));
+    random_error = std::max(random_error, RelativeError(x, exponent(random)));
+  }
+
+  // dense sweep of the gamma stage's input
+  double sweep_error = 0;
+  constexpr int kSweepSteps = 1'000'000;
+  for (int i = 0; i <= kSweepSteps; ++i) {
+    auto x = 1e-6 + (1.0 - 1e-6) * i / kSweepSteps;
+    sweep_error = std::max(sweep_error, RelativeError(x, kGammaExponent));
+  }
+
+  std::printf("max relative error: random %.3g, sweep %.3g (bound %.3g)\n", random_error,
+              sweep_error, kMaxRelativeError);
+  check(random_error <= kMaxRelativeError, "relative error of random inputs");
+  check(sweep_error <= kMaxRelativeError, "relative error of the sweep");
+
+  constexpr auto kInf = std::numeric_limits<double>::infinity();
+  check(FastPow(std::numeric_limits<double>::quiet_NaN(), kGammaExponent) == 0, "NaN gives 0");
+  check(FastPow(-0.5, kGammaExponent) == 0, "negative gives 0");
+  check(FastPow(-kInf, kGammaExponent) == 0, "-inf gives 0");
+  check(FastPow(0.0, kGammaExponent) == 0, "zero gives 0");
+  check(FastPow(std::numeric_limits<double>::denorm_min(), kGammaExponent) == 0,
+        "smallest subnormal gives 0");
+  check(FastPow(std::numeric_limits<double>::min() / 2, kGammaExponent) == 0,
+        "subnormal gives 0");
+  check(FastPow(kInf, kGammaExponent) == kInf, "+inf stays +inf");
+  check(FastPow(1.0, kGammaExponent) == 1.0, "1 gives 1");
+
+  // whole vectors and every tail length through the kernel picked for this CPU
+  std::vector<double> inputs = {0.0, 1e-300, 1e-6, 0.01, 0.25, 0.5, 0.75, 1.0, 2.0, 1e10, -1.0,
+                                kInf, std::numeric_limits<double>::quiet_NaN()};
+  for (size_t count = 0; count <= inputs.size(); ++count) {
+    std::vector<double> channels(inputs.begin(), inputs.begin() + count);
+    Gamma{kGammaExponent}(channels);
+    for (size_t i = 0; i < count; ++i) {
+      auto expected = FastPow(inputs[i], kGammaExponent);
+      check(std::bit_cast<uint64_t>(channels[i]) == std::bit_cast<uint64_t>(expected),
+            "Gamma matches FastPow");
+    }
+  }
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+// Precision check: renders tests/CERF_Free.obj in double and in float in every RenderMode. Every
+// channel of every pixel must agree within kTolerance 8bit levels, except for at most
+// kOutlierShare of the pixels: on silhouettes and shadow edges float and double rays can hit
+// different triangles, and those pixels may differ by anything.
+// usage: precision [resolution = 300]
+
+#define RTRACER_NO_MAIN
+#include "rtracer.cpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+
+constexpr int kTolerance = 1;
+constexpr double kOutlierShare = 1e-4;
+
+constexpr std::pair<const char *, RenderMode> kModes[] = {
+  {"depth", RenderMode::kDepth},
+  {"normal", RenderMode::kNormal},
+  {"full", RenderMode::kFull},
+};
+
+int main(int argc, char **argv) {
+  int resolution = argc > 1 ? std::atoi(argv[1]) : 300;
+  static const auto kTestsDir = GetRelativeDir(__FILE__, ".");
+
+  CameraOptions camera_options{.screen_width = resolution,
+    .screen_height = resolution,
+    .look_from = {100., 200., 150.},
+    .look_to = {0., 100., 0.}};
+
+  bool failed = false;
+  for (const auto &[name, mode]: kModes) {
+    RenderOptions render_options{4, mode};
+    auto double_image = Render(kTestsDir / "CERF_Free.obj", camera_options, render_options);
+    render_options.precision = Precision::kFloat;
+    auto float_image = Render(kTestsDir / "CERF_Free.obj", camera_options, render_options);
+
+    int max_difference = 0, outliers = 0;
+    for (int y = 0; y < resolution; ++y) {
+      for (int x = 0; x < resolution; ++x) {
+        auto a = double_image.GetPixel(y, x), b = float_image.GetPixel(y, x);
+        auto difference =
+          std::max({std::abs(a.r - b.r), std::abs(a.g - b.g), std::abs(a.b - b.b)});
+        max_difference = std::max(max_difference, difference);
+        outliers += difference > kTolerance;
+      }
+    }
+
+    auto max_outliers = static_cast<int>(kOutlierShare * resolution * resolution);
+    auto passed = outliers <= max_outliers;
+    std::printf("%-6s max difference %d, %d pixels over %d (at most %d): %s\n", name,
+                max_difference, outliers, kTolerance, max_outliers, passed ? "ok" : "FAILED");
+    failed |= !passed;
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
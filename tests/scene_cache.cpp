@@ -0,0 +1,110 @@
+// Scene cache check: compiles tests/CERF_Free.obj into a cache in a temporary directory, damages
+// the cache (truncated, huge source and material counts, a BVH child before its parent) and
+// expects ReadSceneCache to throw and ReadSceneCached to rebuild the same scene and a good cache.
+// usage: scene_cache
+
+#include "scene_cache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+std::string ReadBytes(const std::filesystem::path &path) {
+  std::ifstream input(path, std::ios::binary);
+  return {std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+}
+
+void WriteBytes(const std::filesystem::path &path, const std::string &bytes) {
+  std::ofstream output(path, std::ios::binary | std::ios::trunc);
+  output.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+template <class Pod>
+void Patch(std::string &bytes, size_t offset, const Pod &value) {
+  std::memcpy(bytes.data() + offset, &value, sizeof(Pod));
+}
+
+struct Damage {
+  const char *name;
+  std::function<void(std::string &bytes, const Scene &scene)> apply;
+};
+
+int main() {
+  auto tests_dir = std::filesystem::path(__FILE__).parent_path();
+  auto directory = std::filesystem::temp_directory_path() / "rtracer_scene_cache_test";
+  std::filesystem::create_directories(directory);
+  for (const auto *name: {"CERF_Free.obj", "CERF_Free.mtl"}) {
+    std::filesystem::copy_file(tests_dir / name, directory / name,
+                               std::filesystem::copy_options::overwrite_existing);
+  }
+  auto path = directory / "CERF_Free.obj";
+  auto cache_path = GetSceneCachePath(path);
+
+  // the source list follows the header, the material list follows the sources
+  auto materials_offset = [](const Scene &scene) {
+    auto offset = sizeof(SceneCacheHeader) + sizeof(uint64_t);
+    for (const auto &source: scene.GetSourceFiles()) {
+      offset += sizeof(uint64_t) + std::filesystem::absolute(source).string().size() +
+                sizeof(CachedSource);
+    }
+    return offset;
+  };
+
+  const std::vector<Damage> damages = {
+    {"truncated", [](std::string &bytes, const Scene &) { bytes.resize(bytes.size() / 2); }},
+    {"huge source count",
+     [](std::string &bytes, const Scene &) {
+       Patch(bytes, sizeof(SceneCacheHeader), ~uint64_t{0} / 2);
+     }},
+    {"huge material count",
+     [&](std::string &bytes, const Scene &scene) {
+       Patch(bytes, materials_offset(scene), ~uint64_t{0} / 2);
+     }},
+    {"child before its parent",
+     [](std::string &bytes, const Scene &scene) {
+       const auto &root = scene.GetBvh()->GetNodes()[0];
+       auto offset = bytes.find(std::string(reinterpret_cast<const char *>(&root), sizeof(root)));
+       auto patched = root;
+       patched.first = 0;
+       Patch(bytes, offset, patched);
+     }},
+  };
+
+  bool failed = false;
+  for (const auto &[name, apply]: damages) {
+    auto compiled = CompileScene(path);
+    auto bytes = ReadBytes(cache_path);
+    apply(bytes, compiled);
+    WriteBytes(cache_path, bytes);
+
+    bool threw = false;
+    try {
+      ReadSceneCache(cache_path);
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+
+    bool rebuilt = false;
+    try {
+      auto scene = ReadSceneCached(path);
+      auto cached = ReadSceneCache(cache_path);
+      rebuilt = scene.GetTriangles().Size() == compiled.GetTriangles().Size() && cached &&
+                cached->GetTriangles().Size() == compiled.GetTriangles().Size();
+    } catch (const std::exception &) {
+    }
+
+    std::printf("%-24s %s\n", name, threw && rebuilt ? "ok" : "FAILED");
+    failed |= !threw || !rebuilt;
+  }
+
+  std::filesystem::remove_all(directory);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
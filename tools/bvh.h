@@ -0,0 +1,571 @@
+#pragma once
+
+#include "aabb.h"
+#include "geometry.h"
+#include "indexed_triangles.h"
+#include "object.h"
+#include "ray.h"
+#include "render_stats.h"
+#include "simd_intersection.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <ranges>
+#include <span>
+#include <utility>
+#include <vector>
+
+template <class T>
+struct BasicBvhNode {
+    BasicAabb<T> bounds;
+    uint32_t first = 0;  // first triangle for leaves, left child for inner nodes (right = left + 1)
+    uint32_t triangle_count = 0;
+    uint32_t first_sphere = 0;
+    uint32_t sphere_count = 0;
+
+    bool IsLeaf() const {
+        return triangle_count + sphere_count != 0;
+    }
+};
+
+// Bounding volume hierarchy over triangles and spheres, built with the binned surface area
+// heuristic
+template <class T>
+class BasicBvh {
+public:
+    static constexpr size_t kMaxDepth = 64;
+    static constexpr uint32_t kMaxLeafSize = 8;
+    static constexpr size_t kMaxPacketSize = BasicRayLanes<T>::kMaxRays;
+
+    // Hierarchy over triangles and spheres. triangle_order and sphere_order receive the index of
+    // every triangle and sphere in leaf order, the caller puts them in that order so every leaf
+    // owns a contiguous range of each and the intersection kernels stream through memory.
+    BasicBvh(const BasicIndexedTriangles<T>& triangles,
+             const std::vector<BasicSphereObject<T>>& sphere_objects,
+             std::vector<uint32_t>& triangle_order, std::vector<uint32_t>& sphere_order) {
+        std::vector<BuildPrimitive> build;
+        build.reserve(triangles.Size() + sphere_objects.size());
+
+        for (uint32_t i = 0; i < triangles.Size(); ++i) {
+            auto bounds = GetBounds(triangles.GetTriangle(i));
+            Pad(bounds);
+            build.push_back({Kind::kTriangle, i, bounds, bounds.Center()});
+        }
+        for (uint32_t i = 0; i < sphere_objects.size(); ++i) {
+            auto bounds = GetBounds(sphere_objects[i].sphere);
+            Pad(bounds);
+            build.push_back({Kind::kSphere, i, bounds, bounds.Center()});
+        }
+
+        auto ranges = BuildNodes(build);
+
+        triangle_order.clear();
+        sphere_order.clear();
+        triangle_order.reserve(triangles.Size());
+        sphere_order.reserve(sphere_objects.size());
+
+        for (size_t index = 0; index < nodes_.size(); ++index) {
+            auto& node = nodes_[index];
+            if (ranges[index].count == 0) {
+                continue;
+            }
+            node.first = static_cast<uint32_t>(triangle_order.size());
+            node.first_sphere = static_cast<uint32_t>(sphere_order.size());
+            for (uint32_t i = ranges[index].first; i < ranges[index].first + ranges[index].count;
+                 ++i) {
+                (build[i].kind == Kind::kTriangle ? triangle_order : sphere_order)
+                    .push_back(build[i].index);
+            }
+            node.triangle_count = static_cast<uint32_t>(triangle_order.size()) - node.first;
+            node.sphere_count = static_cast<uint32_t>(sphere_order.size()) - node.first_sphere;
+        }
+    }
+
+    // Hierarchy over boxes, e.g. the world bounds of instances. Leaves count their boxes in
+    // triangle_count, the range [first, first + triangle_count) indexes `order`, which receives
+    // the index of every box in leaf order.
+    BasicBvh(std::span<const BasicAabb<T>> boxes, std::vector<uint32_t>& order) {
+        std::vector<BuildPrimitive> build;
+        build.reserve(boxes.size());
+        for (uint32_t i = 0; i < boxes.size(); ++i) {
+            auto bounds = boxes[i];
+            Pad(bounds);
+            build.push_back({Kind::kTriangle, i, bounds, bounds.Center()});
+        }
+
+        auto ranges = BuildNodes(build);
+
+        order.clear();
+        order.reserve(boxes.size());
+        for (size_t index = 0; index < nodes_.size(); ++index) {
+            auto& node = nodes_[index];
+            if (ranges[index].count == 0) {
+                continue;
+            }
+            node.first = static_cast<uint32_t>(order.size());
+            for (uint32_t i = ranges[index].first; i < ranges[index].first + ranges[index].count;
+                 ++i) {
+                order.push_back(build[i].index);
+            }
+            node.triangle_count = ranges[index].count;
+        }
+    }
+
+    // nodes of a hierarchy whose primitives are already in leaf order, e.g. from a scene cache
+    explicit BasicBvh(std::vector<BasicBvhNode<T>> nodes) : nodes_(std::move(nodes)) {
+    }
+
+    const std::vector<BasicBvhNode<T>>& GetNodes() const {
+        return nodes_;
+    }
+
+    // Refit: recomputes the node bounds bottom up after the primitives moved, keeping the tree
+    // and the primitive order. Much cheaper than a rebuild, but the tree gets worse as primitives
+    // drift from where it was built, see GetCost.
+    void Refit(const BasicIndexedTriangles<T>& triangles,
+               const std::vector<BasicSphereObject<T>>& sphere_objects, ThreadPool& pool) {
+        RefitNodes(pool, [&](const BasicBvhNode<T>& leaf) {
+            BasicAabb<T> bounds;
+            for (uint32_t i = leaf.first; i < leaf.first + leaf.triangle_count; ++i) {
+                auto box = GetBounds(triangles.GetTriangle(i));
+                Pad(box);
+                bounds.Extend(box);
+            }
+            for (uint32_t i = leaf.first_sphere; i < leaf.first_sphere + leaf.sphere_count; ++i) {
+                auto box = GetBounds(sphere_objects[i].sphere);
+                Pad(box);
+                bounds.Extend(box);
+            }
+            return bounds;
+        });
+    }
+
+    // refit of a hierarchy over boxes, given in leaf order (the order `order` had at the build)
+    void Refit(std::span<const BasicAabb<T>> boxes, ThreadPool& pool) {
+        RefitNodes(pool, [&](const BasicBvhNode<T>& leaf) {
+            BasicAabb<T> bounds;
+            for (uint32_t i = leaf.first; i < leaf.first + leaf.triangle_count; ++i) {
+                auto box = boxes[i];
+                Pad(box);
+                bounds.Extend(box);
+            }
+            return bounds;
+        });
+    }
+
+    // Expected cost of a ray query under the surface area heuristic the build minimizes, relative
+    // to the root box so it compares trees of a scene as it moves. Refitting keeps the tree of the
+    // build, its cost grows as the boxes stretch and overlap.
+    T GetCost() const {
+        if (nodes_.empty() || nodes_[0].bounds.SurfaceArea() <= 0) {
+            return 0;
+        }
+        T cost = 0;
+        for (const auto& node : nodes_) {
+            auto primitives = node.triangle_count + node.sphere_count;
+            cost += node.bounds.SurfaceArea() *
+                    (node.IsLeaf() ? kIntersectionCost * primitives : kTraversalCost);
+        }
+        return cost / nodes_[0].bounds.SurfaceArea();
+    }
+
+    // Visits the leaves the ray enters closer than max_distance, nearest boxes first.
+    // visitor(const BasicBvhNode<T>& leaf, T& max_distance) may shrink max_distance on a hit to
+    // cull farther nodes, returning true stops the traversal.
+    template <class Visitor>
+    void Traverse(const BasicRay<T>& ray, T max_distance, Visitor&& visitor) const {
+        if (nodes_.empty()) {
+            return;
+        }
+
+        auto root_distance = GetEntryDistance(ray, nodes_[0].bounds, max_distance);
+        CountBoxTests(1);
+        if (!root_distance) {
+            return;
+        }
+        TraverseFrom(0, *root_distance, ray, max_distance, visitor);
+    }
+
+    // Visits the leaves whose box contains point, visitor(const BasicBvhNode<T>& leaf).
+    template <class Visitor>
+    void VisitContaining(const BasicVector<T>& point, Visitor&& visitor) const {
+        if (nodes_.empty() || !nodes_[0].bounds.Contains(point)) {
+            return;
+        }
+        std::array<uint32_t, kMaxDepth + 1> stack;
+        size_t stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0) {
+            const auto& node = nodes_[stack[--stack_size]];
+            if (node.IsLeaf()) {
+                visitor(node);
+                continue;
+            }
+            for (auto child : {node.first, node.first + 1}) {
+                if (nodes_[child].bounds.Contains(point)) {
+                    stack[stack_size++] = child;
+                }
+            }
+        }
+    }
+
+    // Packet version of Traverse for up to kMaxPacketSize coherent rays, each node is tested once
+    // for all the rays still entering it, the rays as SIMD lanes. Subtrees entered by less than a
+    // quarter of the packet are finished ray by ray. visitor(const BasicBvhNode<T>& leaf,
+    // size_t ray, T& max_distance) handles one ray of the packet, max_distances are updated in
+    // place.
+    template <class Visitor>
+    void TraversePacket(std::span<const BasicRay<T>> rays, std::span<T> max_distances,
+                        Visitor&& visitor) const {
+        assert(rays.size() <= kMaxPacketSize && rays.size() == max_distances.size());
+        if (nodes_.empty() || rays.empty()) {
+            return;
+        }
+
+        // the visitor shrinks the lanes' max distances, the box tests read them from there
+        BasicRayLanes<T> lanes(rays, max_distances);
+        uint64_t box_tests = 0;
+
+        // rays of `mask` entering the node and the nearest entry among them
+        auto enter = [&](uint32_t index, uint64_t mask, T& nearest) {
+            box_tests += std::popcount(mask);
+            return GetEnteringRays(lanes, nodes_[index].bounds, mask, nearest);
+        };
+
+        struct Entry {
+            uint32_t node;
+            uint64_t mask;
+        };
+        std::array<Entry, kMaxDepth + 1> stack;
+        size_t stack_size = 0;
+
+        T nearest;
+        auto all = rays.size() == 64 ? ~uint64_t{0} : (uint64_t{1} << rays.size()) - 1;
+        if (auto mask = enter(0, all, nearest)) {
+            stack[stack_size++] = {0, mask};
+        }
+        auto min_coherent = std::max<int>(2, rays.size() / 4);
+
+        while (stack_size > 0) {
+            auto [index, mask] = stack[--stack_size];
+            const auto& node = nodes_[index];
+
+            if (std::popcount(mask) < min_coherent) {
+                box_tests += std::popcount(mask);
+                for (; mask; mask &= mask - 1) {
+                    auto ray = std::countr_zero(mask);
+                    auto distance =
+                        GetEntryDistance(rays[ray], node.bounds, lanes.max_distance[ray]);
+                    if (!distance) {
+                        continue;
+                    }
+                    auto visit_leaf = [&](const BasicBvhNode<T>& leaf, T& max_distance) {
+                        visitor(leaf, ray, max_distance);
+                        return false;
+                    };
+                    TraverseFrom(index, *distance, rays[ray], lanes.max_distance[ray],
+                                 visit_leaf);
+                }
+                continue;
+            }
+
+            if (node.IsLeaf()) {
+                for (; mask; mask &= mask - 1) {
+                    auto ray = std::countr_zero(mask);
+                    visitor(node, ray, lanes.max_distance[ray]);
+                }
+                continue;
+            }
+
+            T left_nearest, right_nearest;
+            auto left = enter(node.first, mask, left_nearest);
+            auto right = enter(node.first + 1, mask, right_nearest);
+
+            // far child goes first so that the near one is popped next
+            if (left && right && left_nearest < right_nearest) {
+                stack[stack_size++] = {node.first + 1, right};
+                stack[stack_size++] = {node.first, left};
+            } else {
+                if (left) {
+                    stack[stack_size++] = {node.first, left};
+                }
+                if (right) {
+                    stack[stack_size++] = {node.first + 1, right};
+                }
+            }
+        }
+        std::copy_n(lanes.max_distance, rays.size(), max_distances.begin());
+        CountBoxTests(box_tests);
+    }
+
+private:
+    static constexpr size_t kBins = 16;
+    static constexpr T kTraversalCost = 1.0;
+    static constexpr T kIntersectionCost = 1.0;
+    static constexpr T kBoxPadding = 1e-7;
+
+    // keeps flat boxes of axis-aligned polygons hittable, relative part covers float rounding
+    static void Pad(BasicAabb<T>& bounds) {
+        T magnitude = 0;
+        for (int i = 0; i < 3; ++i) {
+            magnitude = std::max(
+                {magnitude, std::abs(bounds.GetMin()[i]), std::abs(bounds.GetMax()[i])});
+        }
+        bounds.Pad(std::max(kBoxPadding, 4 * std::numeric_limits<T>::epsilon() * magnitude));
+    }
+
+    static constexpr size_t kRefitTasksPerThread = 4;
+
+    // Splits the tree breadth first into a few subtrees per thread, refits those in parallel and
+    // then the nodes above them. leaf_bounds(leaf) gives the padded bounds of a leaf's primitives.
+    template <class LeafBounds>
+    void RefitNodes(ThreadPool& pool, const LeafBounds& leaf_bounds) {
+        if (nodes_.empty()) {
+            return;
+        }
+        std::vector<uint32_t> top, subtrees = {0};
+        while (subtrees.size() < kRefitTasksPerThread * pool.Size()) {
+            std::vector<uint32_t> next;
+            for (auto index : subtrees) {
+                if (nodes_[index].IsLeaf()) {
+                    next.push_back(index);
+                } else {
+                    top.push_back(index);
+                    next.push_back(nodes_[index].first);
+                    next.push_back(nodes_[index].first + 1);
+                }
+            }
+            if (next.size() == subtrees.size()) {
+                break;
+            }
+            subtrees = std::move(next);
+        }
+
+        std::vector<ThreadPool::Task> tasks;
+        for (auto index : subtrees) {
+            tasks.emplace_back([&, index] { RefitSubtree(index, leaf_bounds); });
+        }
+        pool.Run(std::move(tasks));
+        // parents were expanded before their children
+        for (auto index : top | std::views::reverse) {
+            UniteChildren(nodes_[index]);
+        }
+    }
+
+    template <class LeafBounds>
+    void RefitSubtree(uint32_t index, const LeafBounds& leaf_bounds) {
+        auto& node = nodes_[index];
+        if (node.IsLeaf()) {
+            node.bounds = leaf_bounds(node);
+            return;
+        }
+        RefitSubtree(node.first, leaf_bounds);
+        RefitSubtree(node.first + 1, leaf_bounds);
+        UniteChildren(node);
+    }
+
+    void UniteChildren(BasicBvhNode<T>& node) {
+        node.bounds = nodes_[node.first].bounds;
+        node.bounds.Extend(nodes_[node.first + 1].bounds);
+    }
+
+    template <class Visitor>
+    void TraverseFrom(uint32_t start, T start_distance, const BasicRay<T>& ray, T& max_distance,
+                      Visitor&& visitor) const {
+        struct Entry {
+            uint32_t node;
+            T distance;
+        };
+        std::array<Entry, kMaxDepth + 1> stack;
+        size_t stack_size = 0;
+        stack[stack_size++] = {start, start_distance};
+        uint64_t box_tests = 0;
+
+        while (stack_size > 0) {
+            auto [index, distance] = stack[--stack_size];
+            if (distance > max_distance) {
+                continue;
+            }
+
+            const auto& node = nodes_[index];
+            if (node.IsLeaf()) {
+                if (visitor(node, max_distance)) {
+                    break;
+                }
+                continue;
+            }
+
+            box_tests += 2;
+
+            auto left = GetEntryDistance(ray, nodes_[node.first].bounds, max_distance);
+            auto right = GetEntryDistance(ray, nodes_[node.first + 1].bounds, max_distance);
+
+            // far child goes first so that the near one is popped next
+            if (left && right) {
+                if (*left < *right) {
+                    stack[stack_size++] = {node.first + 1, *right};
+                    stack[stack_size++] = {node.first, *left};
+                } else {
+                    stack[stack_size++] = {node.first, *left};
+                    stack[stack_size++] = {node.first + 1, *right};
+                }
+            } else if (left) {
+                stack[stack_size++] = {node.first, *left};
+            } else if (right) {
+                stack[stack_size++] = {node.first + 1, *right};
+            }
+        }
+        CountBoxTests(box_tests);
+    }
+
+    enum class Kind { kTriangle, kSphere };
+
+    struct BuildPrimitive {
+        Kind kind;
+        uint32_t index;
+        BasicAabb<T> bounds;
+        BasicVector<T> centroid;
+    };
+
+    // primitives of a node in the build array, count is 0 for inner nodes
+    struct Range {
+        uint32_t first;
+        uint32_t count;
+    };
+
+    // nodes over build, reordered so every leaf owns a contiguous range, the range of each node
+    std::vector<Range> BuildNodes(std::vector<BuildPrimitive>& build) {
+        std::vector<Range> ranges;
+        if (build.empty()) {
+            return ranges;
+        }
+        ranges.reserve(2 * build.size());
+        nodes_.reserve(2 * build.size());
+        nodes_.emplace_back();
+        ranges.push_back({0, static_cast<uint32_t>(build.size())});
+        Subdivide(0, build, ranges, 0);
+        return ranges;
+    }
+
+    void Subdivide(uint32_t index, std::vector<BuildPrimitive>& build, std::vector<Range>& ranges,
+                   size_t depth) {
+        auto [first, count] = ranges[index];
+
+        BasicAabb<T> bounds, centroid_bounds;
+        for (uint32_t i = first; i < first + count; ++i) {
+            bounds.Extend(build[i].bounds);
+            centroid_bounds.Extend(build[i].centroid);
+        }
+        nodes_[index].bounds = bounds;
+
+        if (count <= 2 || depth + 1 >= kMaxDepth) {
+            return;
+        }
+
+        auto [axis, split, cost] = FindSplit(build, first, count, bounds, centroid_bounds);
+        T leaf_cost = kIntersectionCost * count;
+
+        if (axis < 0 || (cost >= leaf_cost && count <= kMaxLeafSize)) {
+            return;
+        }
+
+        auto mid = std::partition(build.begin() + first, build.begin() + first + count,
+                                  [&](const BuildPrimitive& primitive) {
+                                      return GetBin(primitive.centroid, centroid_bounds, axis) <
+                                             split;
+                                  });
+        auto left_count = static_cast<uint32_t>(mid - build.begin()) - first;
+        if (left_count == 0 || left_count == count) {
+            return;
+        }
+
+        auto left = static_cast<uint32_t>(nodes_.size());
+        nodes_.emplace_back();
+        nodes_.emplace_back();
+        ranges.push_back({first, left_count});
+        ranges.push_back({first + left_count, count - left_count});
+        nodes_[index].first = left;
+        ranges[index].count = 0;
+
+        Subdivide(left, build, ranges, depth + 1);
+        Subdivide(left + 1, build, ranges, depth + 1);
+    }
+
+    struct Split {
+        int axis;
+        size_t bin;  // primitives with bin < this one go left
+        T cost;
+    };
+
+    Split FindSplit(const std::vector<BuildPrimitive>& build, uint32_t first, uint32_t count,
+                    const BasicAabb<T>& bounds, const BasicAabb<T>& centroid_bounds) const {
+        Split best{-1, 0, std::numeric_limits<T>::infinity()};
+        auto parent_area = bounds.SurfaceArea();
+        if (parent_area <= 0.0) {
+            return best;
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (centroid_bounds.GetMax()[axis] <= centroid_bounds.GetMin()[axis]) {
+                continue;
+            }
+
+            std::array<BasicAabb<T>, kBins> bin_bounds;
+            std::array<uint32_t, kBins> bin_counts{};
+            for (uint32_t i = first; i < first + count; ++i) {
+                auto bin = GetBin(build[i].centroid, centroid_bounds, axis);
+                bin_bounds[bin].Extend(build[i].bounds);
+                ++bin_counts[bin];
+            }
+
+            // suffix sweep for the right sides, prefix sweep evaluates every plane
+            std::array<T, kBins> right_areas{};
+            std::array<uint32_t, kBins> right_counts{};
+            BasicAabb<T> right;
+            uint32_t right_count = 0;
+            for (size_t bin = kBins - 1; bin > 0; --bin) {
+                right.Extend(bin_bounds[bin]);
+                right_count += bin_counts[bin];
+                right_areas[bin] = right.SurfaceArea();
+                right_counts[bin] = right_count;
+            }
+
+            BasicAabb<T> left;
+            uint32_t left_count = 0;
+            for (size_t bin = 1; bin < kBins; ++bin) {
+                left.Extend(bin_bounds[bin - 1]);
+                left_count += bin_counts[bin - 1];
+                if (left_count == 0 || right_counts[bin] == 0) {
+                    continue;
+                }
+                T cost = kTraversalCost + kIntersectionCost *
+                                                   (left.SurfaceArea() * left_count +
+                                                    right_areas[bin] * right_counts[bin]) /
+                                                   parent_area;
+                if (cost < best.cost) {
+                    best = {axis, bin, cost};
+                }
+            }
+        }
+
+        return best;
+    }
+
+    static size_t GetBin(const BasicVector<T>& centroid, const BasicAabb<T>& centroid_bounds,
+                         int axis) {
+        auto min = centroid_bounds.GetMin()[axis];
+        auto extent = centroid_bounds.GetMax()[axis] - min;
+        auto bin = static_cast<size_t>(kBins * (centroid[axis] - min) / extent);
+        return std::min(bin, kBins - 1);
+    }
+
+    std::vector<BasicBvhNode<T>> nodes_;
+};
+
+using BvhNode = BasicBvhNode<double>;
+using Bvh = BasicBvh<double>;
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "camera_options.h"
+#include "ray.h"
+#include "vector.h"
+
+#include <cmath>
+#include <vector>
+
+// Pinhole camera set up once from CameraOptions: the view basis and the image plane steps are
+// computed here instead of per pixel. Pixel (i, j) covers [i, i + 1) x [j, j + 1) of the image
+// plane, (offset_x, offset_y) in [0, 1)^2 is the sample position inside it. Directions are built
+// and normalized in double and converted to the ray precision T afterwards.
+class Camera {
+public:
+    explicit Camera(const CameraOptions& options) : origin_(options.look_from) {
+        double format = (options.screen_width * 1.0) / options.screen_height;
+        double scale = std::tan(options.fov / 2);
+
+        Vector dx = {1, 0, 0};
+        Vector dy = {0, 1, 0};
+
+        auto forward = Normalize(options.look_from - options.look_to);
+
+        auto right = CrossProduct(dy, forward);
+        if (right.IsZero()) {
+            right = dx;
+        }
+        right.Normalize();
+
+        auto up = CrossProduct(forward, right);
+        if (up.IsZero()) {
+            up = dx;
+        }
+        up.Normalize();
+
+        // direction = top_left_ + x * step_x_ + y * step_y_ for image plane position (x, y)
+        step_x_ = right * (2.0 * format * scale / options.screen_width);
+        step_y_ = up * (-2.0 * scale / options.screen_height);
+        top_left_ = right * (-format * scale) + up * scale - forward;
+    }
+
+    const Vector& GetOrigin() const {
+        return origin_;
+    }
+
+    template <class T = double>
+    BasicRay<T> GetRay(int i, int j, double offset_x = 0.5, double offset_y = 0.5) const {
+        return MakeRay<T>(top_left_ + step_x_ * (i + offset_x) + step_y_ * (j + offset_y));
+    }
+
+    // Appends the rays of pixels [begin, end) of row j, all at the same offset. The direction
+    // advances by one step per pixel instead of being set up again.
+    template <class T = double>
+    void AppendRowRays(int j, int begin, int end, double offset_x, double offset_y,
+                       std::vector<BasicRay<T>>& rays) const {
+        auto direction = top_left_ + step_x_ * (begin + offset_x) + step_y_ * (j + offset_y);
+        for (int i = begin; i < end; ++i, direction += step_x_) {
+            rays.push_back(MakeRay<T>(direction));
+        }
+    }
+
+private:
+    template <class T>
+    BasicRay<T> MakeRay(const Vector& direction) const {
+        return BasicRay<T>::FromUnitDirection(BasicVector<T>(origin_),
+                                              BasicVector<T>(Normalize(direction)));
+    }
+
+    Vector origin_;
+    Vector top_left_;
+    Vector step_x_;
+    Vector step_y_;
+};
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "camera_options.h"
+#include "render_options.h"
+#include "vector.h"
+
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <numbers>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Command line of the rtracer driver. A job is one image: camera, render options and output
+// path. The command line gives the scene, the options it is loaded with and the default job. A
+// batch file lists one job per line in the same option syntax, each line overriding the
+// defaults, so the scene is read and its BVH built once for all of them.
+
+inline constexpr std::string_view kUsage =
+    R"(usage: rtracer [options] <scene.obj>
+       rtracer [options] --batch <jobs.txt> <scene.obj>
+
+scene options (command line only):
+  --batch <file>        render every line of <file> as a job, '#' starts a comment
+  --threads <n>         worker threads, 0 = one per hardware thread (default 0)
+  --float               trace in single precision
+  --brute-force         test every primitive instead of building a BVH
+  --scene-cache         load and refresh a compiled <scene>.rtscene next to the OBJ
+  --compact-mesh        store vertexes quantized and normals encoded, several times less
+                        memory for slightly moved hits
+
+job options:
+  -o, --output <file>   PNG to write (default result.png)
+  --size <w>x<h>        resolution (default 1000x1000)
+  --from <x,y,z>        camera position (default 0,0,0)
+  --to <x,y,z>          point looked at (default 0,0,-1)
+  --fov <degrees>       vertical field of view (default 90)
+  --mode <m>            full, normal or depth (default full)
+  --depth <n>           bounces per camera ray (default 4)
+  --integrator <i>      depth-first or wavefront (default depth-first)
+  --progressive <n>     average up to n jittered passes per pixel
+  --adaptive <n>        refine edge pixels up to n samples
+  --stats               write timings and ray counts to <output>.stats.json
+)";
+
+struct RenderJob {
+    CameraOptions camera{.screen_width = 1000, .screen_height = 1000};
+    RenderOptions render{4, RenderMode::kFull};
+    std::filesystem::path output = "result.png";
+};
+
+struct CommandLine {
+    std::filesystem::path scene;
+    std::optional<std::filesystem::path> batch;
+    RenderJob job;  // the only job, or the defaults of the batch jobs
+    bool help = false;
+};
+
+template <class Number>
+Number ParseNumber(std::string_view text, std::string_view option) {
+    Number value{};
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error != std::errc{} || end != text.data() + text.size()) {
+        throw std::runtime_error{"Bad value '" + std::string(text) + "' for " +
+                                 std::string(option)};
+    }
+    return value;
+}
+
+// "x,y,z"
+inline Vector ParseVector(std::string_view text, std::string_view option) {
+    Vector result;
+    for (int k = 0; k < 3; ++k) {
+        auto comma = k < 2 ? text.find(',') : text.size();
+        if (comma == std::string_view::npos) {
+            throw std::runtime_error{"Expected x,y,z for " + std::string(option)};
+        }
+        result[k] = ParseNumber<double>(text.substr(0, comma), option);
+        text.remove_prefix(std::min(text.size(), comma + 1));
+    }
+    return result;
+}
+
+// the value of option args[i], i is advanced past it
+inline const std::string& GetOptionValue(std::span<const std::string> args, size_t& i) {
+    if (i + 1 >= args.size()) {
+        throw std::runtime_error{"Missing value for " + args[i]};
+    }
+    return args[++i];
+}
+
+// Applies args[i] (and its value) to job, returns false for options that aren't job options
+inline bool ParseJobOption(std::span<const std::string> args, size_t& i, RenderJob& job) {
+    const auto& option = args[i];
+    auto value = [&]() -> std::string_view { return GetOptionValue(args, i); };
+
+    if (option == "-o" || option == "--output") {
+        job.output = value();
+    } else if (option == "--size") {
+        auto size = value();
+        auto x = size.find('x');
+        if (x == std::string_view::npos) {
+            throw std::runtime_error{"Expected <w>x<h> for --size"};
+        }
+        job.camera.screen_width = ParseNumber<int>(size.substr(0, x), option);
+        job.camera.screen_height = ParseNumber<int>(size.substr(x + 1), option);
+        if (job.camera.screen_width <= 0 || job.camera.screen_height <= 0) {
+            throw std::runtime_error{"--size must be positive"};
+        }
+    } else if (option == "--from") {
+        job.camera.look_from = ParseVector(value(), option);
+    } else if (option == "--to") {
+        job.camera.look_to = ParseVector(value(), option);
+    } else if (option == "--fov") {
+        auto degrees = ParseNumber<double>(value(), option);
+        if (!(degrees > 0 && degrees < 180)) {
+            throw std::runtime_error{"--fov must be between 0 and 180 degrees"};
+        }
+        job.camera.fov = degrees * std::numbers::pi / 180;
+    } else if (option == "--mode") {
+        auto mode = value();
+        if (mode == "full") {
+            job.render.mode = RenderMode::kFull;
+        } else if (mode == "normal") {
+            job.render.mode = RenderMode::kNormal;
+        } else if (mode == "depth") {
+            job.render.mode = RenderMode::kDepth;
+        } else {
+            throw std::runtime_error{"Unknown mode '" + std::string(mode) + "'"};
+        }
+    } else if (option == "--depth") {
+        job.render.depth = ParseNumber<int>(value(), option);
+        if (job.render.depth < 0) {
+            throw std::runtime_error{"--depth must not be negative"};
+        }
+    } else if (option == "--integrator") {
+        auto integrator = value();
+        if (integrator == "depth-first") {
+            job.render.integrator = Integrator::kDepthFirst;
+        } else if (integrator == "wavefront") {
+            job.render.integrator = Integrator::kWavefront;
+        } else {
+            throw std::runtime_error{"Unknown integrator '" + std::string(integrator) + "'"};
+        }
+    } else if (option == "--progressive") {
+        job.render.progressive.emplace().max_passes = ParseNumber<int>(value(), option);
+    } else if (option == "--adaptive") {
+        job.render.adaptive.emplace().max_samples = ParseNumber<int>(value(), option);
+    } else if (option == "--stats") {
+        job.render.stats_report = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline CommandLine ParseCommandLine(std::span<const std::string> args) {
+    CommandLine command_line;
+    auto& render = command_line.job.render;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const auto& option = args[i];
+        if (ParseJobOption(args, i, command_line.job)) {
+            continue;
+        }
+        if (option == "-h" || option == "--help") {
+            command_line.help = true;
+        } else if (option == "--batch") {
+            command_line.batch = GetOptionValue(args, i);
+        } else if (option == "--threads") {
+            render.thread_count = ParseNumber<size_t>(GetOptionValue(args, i), option);
+        } else if (option == "--float") {
+            render.precision = Precision::kFloat;
+        } else if (option == "--brute-force") {
+            render.acceleration = AccelerationMode::kBruteForce;
+        } else if (option == "--scene-cache") {
+            render.scene_cache = true;
+        } else if (option == "--compact-mesh") {
+            render.compact_mesh = true;
+        } else if (option.starts_with("-")) {
+            throw std::runtime_error{"Unknown option " + option};
+        } else if (command_line.scene.empty()) {
+            command_line.scene = option;
+        } else {
+            throw std::runtime_error{"More than one scene given"};
+        }
+    }
+    if (!command_line.help && command_line.scene.empty()) {
+        throw std::runtime_error{"No scene given"};
+    }
+    return command_line;
+}
+
+// Jobs of a batch file, each line's options applied to a copy of defaults
+inline std::vector<RenderJob> ReadBatch(const std::filesystem::path& path,
+                                        const RenderJob& defaults) {
+    std::ifstream input(path);
+    if (!input) {
+        throw std::runtime_error{"Can't open " + path.string()};
+    }
+    std::vector<RenderJob> jobs;
+    std::string line;
+    for (int line_number = 1; std::getline(input, line); ++line_number) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream tokens(line);
+        std::vector<std::string> args;
+        for (std::string token; tokens >> token;) {
+            args.push_back(std::move(token));
+        }
+        if (args.empty()) {
+            continue;
+        }
+        auto& job = jobs.emplace_back(defaults);
+        auto where = path.string() + ":" + std::to_string(line_number) + ": ";
+        for (size_t i = 0; i < args.size(); ++i) {
+            bool parsed;
+            try {
+                parsed = ParseJobOption(args, i, job);
+            } catch (const std::runtime_error& error) {
+                throw std::runtime_error{where + error.what()};
+            }
+            if (!parsed) {
+                throw std::runtime_error{where + args[i] + " is not a job option"};
+            }
+        }
+    }
+    return jobs;
+}
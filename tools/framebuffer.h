@@ -0,0 +1,47 @@
+#pragma once
+
+#include "aligned_allocator.h"
+#include "vector.h"
+
+#include <cassert>
+#include <span>
+
+// HDR render target: one contiguous, cache line aligned, row-major block of pixels. Tiles write
+// their disjoint rectangles into it directly, post-processing then streams it row by row.
+class Framebuffer {
+public:
+    Framebuffer(int width, int height)
+        : width_(width), height_(height), pixels_(static_cast<size_t>(width) * height) {
+        assert(width > 0);
+        assert(height > 0);
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    Vector& At(int x, int y) {
+        return pixels_[static_cast<size_t>(y) * width_ + x];
+    }
+
+    const Vector& At(int x, int y) const {
+        return pixels_[static_cast<size_t>(y) * width_ + x];
+    }
+
+    std::span<const Vector> Row(int y) const {
+        return {&At(0, y), static_cast<size_t>(width_)};
+    }
+
+    std::span<const Vector> Pixels() const {
+        return pixels_;
+    }
+
+private:
+    int width_;
+    int height_;
+    AlignedVector<Vector> pixels_;
+};
@@ -5,6 +5,9 @@
 #include <filesystem>
 #include <cstdio>
 #include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include <png.h>
 
@@ -12,6 +15,93 @@ struct RGB {
   int r, g, b;
 };
 
+// zlib settings of written PNGs, the defaults match libpng's own
+struct PngOptions {
+  int compression_level = 6;      // 0 (store) .. 9 (smallest), 1 is the fast preview choice
+  int filters = PNG_ALL_FILTERS;  // PNG_FILTER_* mask tried per row, PNG_FILTER_NONE is fastest
+};
+
+// Streams an 8bit RGBA PNG to disk: rows are compressed as they are handed in, so the caller
+// never needs the whole 8bit image in memory.
+class PngWriter {
+public:
+  PngWriter(const std::filesystem::path& path, int width, int height,
+            const PngOptions& options = {})
+      : width_{width}, height_{height} {
+    fp_ = std::fopen(path.c_str(), "wb");
+    if (!fp_) {
+      throw std::runtime_error{"Can't open file " + path.string()};
+    }
+
+    png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (!png_) {
+      std::fclose(fp_);
+      throw std::runtime_error{"Can't create png write struct"};
+    }
+
+    info_ = png_create_info_struct(png_);
+    if (!info_) {
+      png_destroy_write_struct(&png_, nullptr);
+      std::fclose(fp_);
+      throw std::runtime_error{"Can't create png info struct"};
+    }
+
+    if (setjmp(png_jmpbuf(png_))) {
+      abort();
+    }
+
+    png_init_io(png_, fp_);
+    png_set_compression_level(png_, options.compression_level);
+    png_set_filter(png_, PNG_FILTER_TYPE_BASE, options.filters);
+
+    // Output is 8bit depth, RGBA format.
+    png_set_IHDR(png_, info_, width_, height_, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_, info_);
+  }
+
+  ~PngWriter() {
+    png_destroy_write_struct(&png_, &info_);
+    std::fclose(fp_);
+  }
+
+  PngWriter(const PngWriter&) = delete;
+  PngWriter& operator=(const PngWriter&) = delete;
+
+  // next row from the top, 4 * width bytes
+  void WriteRow(std::span<const png_byte> row) {
+    assert(row.size() == 4 * static_cast<size_t>(width_));
+    assert(rows_written_ < height_);
+    if (setjmp(png_jmpbuf(png_))) {
+      abort();
+    }
+    png_write_row(png_, row.data());
+    ++rows_written_;
+  }
+
+  // flushes the stream, every row must have been written
+  void Finish() {
+    if (rows_written_ != height_) {
+      throw std::runtime_error{"Png is missing rows"};
+    }
+    if (setjmp(png_jmpbuf(png_))) {
+      abort();
+    }
+    png_write_end(png_, nullptr);
+    if (std::fflush(fp_) != 0) {
+      throw std::runtime_error{"Can't write png"};
+    }
+  }
+
+private:
+  int width_, height_;
+  int rows_written_ = 0;
+  std::FILE* fp_ = nullptr;
+  png_structp png_ = nullptr;
+  png_infop info_ = nullptr;
+};
+
+// 8bit RGBA image in one contiguous row-major buffer
 class Image {
 public:
   Image(int width, int height) {
@@ -24,77 +114,49 @@ public:
     ReadPng(path);
   }
 
-  Image(Image&& other) : width_{other.width_}, height_{other.height_}, bytes_{other.bytes_} {
-    other.width_ = 0;
-    other.height_ = 0;
-    other.bytes_ = nullptr;
-  }
-
-  ~Image() {
-    for (auto row : std::span{bytes_, bytes_ + height_}) {
-      delete[] row;
-    }
-    delete[] bytes_;
+  Image(Image&& other) noexcept
+      : width_{std::exchange(other.width_, 0)},
+        height_{std::exchange(other.height_, 0)},
+        bytes_{std::move(other.bytes_)} {
   }
 
   Image(const Image&) = delete;
   Image& operator=(const Image&) = delete;
   Image& operator=(Image&&) = delete;
 
-  void Write(const std::filesystem::path& path) {
+  void Write(const std::filesystem::path& path, const PngOptions& options = {}) const {
     if (!width_) {
       throw std::runtime_error{"Image is empty"};
     }
 
-    auto* fp = std::fopen(path.c_str(), "wb");
-    if (!fp) {
-      throw std::runtime_error{"Can't open file " + path.string()};
-    }
-
-    auto png = png_create_write_struct("1.6.44", nullptr, nullptr, nullptr);
-    if (!png) {
-      throw std::runtime_error{"Can't create png write struct"};
+    PngWriter writer(path, width_, height_, options);
+    for (int y = 0; y < height_; ++y) {
+      writer.WriteRow(Row(y));
     }
-
-    auto info = png_create_info_struct(png);
-    if (!info) {
-      throw std::runtime_error{"Can't create png info struct"};
-    }
-
-    if (setjmp(png_jmpbuf(png))) {
-      abort();
-    }
-
-    png_init_io(png, fp);
-
-    // Output is 8bit depth, RGBA format.
-    png_set_IHDR(png, info, width_, height_, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png, info);
-
-    // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
-    // Use png_set_filler().
-    // png_set_filler(png, 0, PNG_FILLER_AFTER);
-
-    png_write_image(png, bytes_);
-    png_write_end(png, nullptr);
-
-    std::fclose(fp);
-    png_destroy_write_struct(&png, &info);
+    writer.Finish();
   }
 
   RGB GetPixel(int y, int x) const {
-    auto px = &bytes_[y][4 * x];
+    auto px = &Row(y)[4 * x];
     return {px[0], px[1], px[2]};
   }
 
   void SetPixel(const RGB& pixel, int y, int x) {
-    auto px = &bytes_[y][4 * x];
+    auto px = &Row(y)[4 * x];
     px[0] = pixel.r;
     px[1] = pixel.g;
     px[2] = pixel.b;
   }
 
+  // 4 * Width() bytes of RGBA
+  std::span<png_byte> Row(int y) {
+    return std::span{bytes_}.subspan(RowBytes() * y, RowBytes());
+  }
+
+  std::span<const png_byte> Row(int y) const {
+    return std::span{bytes_}.subspan(RowBytes() * y, RowBytes());
+  }
+
   int Height() const {
     return height_;
   }
@@ -104,15 +166,16 @@ public:
   }
 
 private:
+  size_t RowBytes() const {
+    return 4 * static_cast<size_t>(width_);
+  }
+
   void PrepareImage(int width, int height) {
     height_ = height;
     width_ = width;
-    bytes_ = new png_bytep[height_];
-    for (auto*& row : std::span{bytes_, bytes_ + height_}) {
-      row = new png_byte[4 * width_]{};
-      for (auto x : std::views::iota(0, width_)) {
-        row[4 * x + 3] = 255;
-      }
+    bytes_.assign(RowBytes() * height_, 0);
+    for (size_t alpha = 3; alpha < bytes_.size(); alpha += 4) {
+      bytes_[alpha] = 255;
     }
   }
 
@@ -176,16 +239,17 @@ private:
 
     png_read_update_info(png, info);
 
-    bytes_ = new png_bytep[height_];
+    bytes_.resize(RowBytes() * height_);
+    std::vector<png_bytep> rows(height_);
     for (auto y = 0; y < height_; y++) {
-      bytes_[y] = new png_byte[png_get_rowbytes(png, info)];
+      rows[y] = Row(y).data();
     }
 
-    png_read_image(png, bytes_);
+    png_read_image(png, rows.data());
     png_destroy_read_struct(&png, &info, nullptr);
     std::fclose(fp);
   }
 
   int width_, height_;
-  png_bytepp bytes_;
+  std::vector<png_byte> bytes_;
 };
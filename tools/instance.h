@@ -0,0 +1,138 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "geometry.h"
+#include "indexed_triangles.h"
+#include "material.h"
+#include "object.h"
+#include "packed_spheres.h"
+#include "ray.h"
+#include "thread_pool.h"
+#include "transform.h"
+
+#include <cstdint>
+#include <optional>
+#include <ranges>
+#include <utility>
+#include <vector>
+
+// Instanced geometry: a mesh is stored once in its object space, with its own (bottom level)
+// BVH, and any number of instances place it in the scene with a transform and optionally their
+// own material. Rays are transformed into object space instead of the mesh into world space, so
+// memory and build time grow with the unique geometry, not with the instance count.
+
+template <class T>
+class BasicMesh {
+public:
+    BasicMesh(BasicIndexedTriangles<T> triangles,
+              std::vector<const BasicMaterial<T>*> triangle_materials,
+              std::vector<BasicSphereObject<T>> sphere_objects)
+        : triangles_(std::move(triangles)),
+          triangle_materials_(std::move(triangle_materials)),
+          sphere_objects_(std::move(sphere_objects)) {
+        ComputeBounds();
+        PackSpheres();
+    }
+
+    // same accessors as BasicScene, so the primitive queries take either
+    const BasicIndexedTriangles<T>& GetTriangles() const {
+        return triangles_;
+    }
+    const std::vector<const BasicMaterial<T>*>& GetTriangleMaterials() const {
+        return triangle_materials_;
+    }
+    const std::vector<BasicSphereObject<T>>& GetSphereObjects() const {
+        return sphere_objects_;
+    }
+    const BasicPackedSpheres<T>& GetSpheres() const {
+        return spheres_;
+    }
+    const std::optional<BasicBvh<T>>& GetBvh() const {
+        return bvh_;
+    }
+
+    // object space bounds
+    const BasicAabb<T>& GetBounds() const {
+        return bounds_;
+    }
+
+    void BuildBvh() {
+        std::vector<uint32_t> triangle_order, sphere_order;
+        bvh_.emplace(triangles_, sphere_objects_, triangle_order, sphere_order);
+        triangles_.Permute(triangle_order);
+        triangle_materials_ = Permute(triangle_materials_, triangle_order);
+        sphere_objects_ = Permute(sphere_objects_, sphere_order);
+        PackSpheres();
+    }
+
+    void ResetBvh() {
+        bvh_.reset();
+    }
+
+    // see BasicIndexedTriangles::Compress, a built BVH is refit to the moved vertexes
+    void CompressTriangles(ThreadPool& pool) {
+        triangles_.Compress();
+        ComputeBounds();
+        if (bvh_) {
+            bvh_->Refit(triangles_, sphere_objects_, pool);
+        }
+    }
+
+private:
+    void PackSpheres() {
+        spheres_ = BasicPackedSpheres<T>(sphere_objects_ |
+                                         std::views::transform(&BasicSphereObject<T>::sphere));
+    }
+
+    void ComputeBounds() {
+        bounds_ = {};
+        for (size_t i = 0; i < triangles_.Size(); ++i) {
+            bounds_.Extend(::GetBounds(triangles_.GetTriangle(i)));
+        }
+        for (const auto& object : sphere_objects_) {
+            bounds_.Extend(::GetBounds(object.sphere));
+        }
+    }
+
+    template <class Item>
+    static std::vector<Item> Permute(const std::vector<Item>& items,
+                                     const std::vector<uint32_t>& order) {
+        std::vector<Item> result;
+        result.reserve(order.size());
+        for (auto index : order) {
+            result.push_back(items[index]);
+        }
+        return result;
+    }
+
+    BasicIndexedTriangles<T> triangles_;
+    std::vector<const BasicMaterial<T>*> triangle_materials_;
+    std::vector<BasicSphereObject<T>> sphere_objects_;
+    BasicPackedSpheres<T> spheres_;
+    BasicAabb<T> bounds_;
+    std::optional<BasicBvh<T>> bvh_;
+};
+
+// Transforms are similarities (rotation, uniform scale, translation), which keep spheres round.
+template <class T>
+struct BasicInstance {
+    uint32_t mesh;  // index into the scene's meshes
+    BasicTransform<T> to_world;
+    BasicTransform<T> to_object;
+    const BasicMaterial<T>* material = nullptr;  // replaces the mesh's materials when set
+    BasicAabb<T> bounds;                         // world space
+
+    // The ray in object space, with a unit direction, and the object space length of a world
+    // space unit along it: object distances are world distances times the scale.
+    std::pair<BasicRay<T>, T> ToObject(const BasicRay<T>& ray) const {
+        auto direction = to_object.ApplyToVector(ray.GetDirection());
+        auto scale = Length(direction);
+        return {BasicRay<T>::FromUnitDirection(to_object.ApplyToPoint(ray.GetOrigin()),
+                                               direction / scale),
+                scale};
+    }
+};
+
+using Mesh = BasicMesh<double>;
+using Instance = BasicInstance<double>;
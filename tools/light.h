@@ -2,7 +2,10 @@
 
 #include "vector.h"
 
-struct Light {
-    Vector position;
-    Vector intensity;
+template <class T>
+struct BasicLight {
+    BasicVector<T> position;
+    BasicVector<T> intensity;
 };
+
+using Light = BasicLight<double>;
@@ -3,13 +3,31 @@
 #include <vector.h>
 #include <string>
 
-struct Material {
+template <class T>
+struct BasicMaterial {
     std::string name;
-    Vector ambient_color{0, 0, 0};
-    Vector diffuse_color{0, 0, 0};
-    Vector specular_color{0, 0, 0};
-    Vector intensity{0, 0, 0};
-    double specular_exponent{1.0};
-    double refraction_index{1.0};
-    Vector albedo = Vector(1.0, 0.0, 0.0);
+    BasicVector<T> ambient_color{0, 0, 0};
+    BasicVector<T> diffuse_color{0, 0, 0};
+    BasicVector<T> specular_color{0, 0, 0};
+    BasicVector<T> intensity{0, 0, 0};
+    T specular_exponent{1.0};
+    T refraction_index{1.0};
+    BasicVector<T> albedo = BasicVector<T>(1.0, 0.0, 0.0);
+
+    BasicMaterial() = default;
+
+    // precision conversion
+    template <class U>
+    explicit BasicMaterial(const BasicMaterial<U>& other)
+        : name(other.name),
+          ambient_color(other.ambient_color),
+          diffuse_color(other.diffuse_color),
+          specular_color(other.specular_color),
+          intensity(other.intensity),
+          specular_exponent(other.specular_exponent),
+          refraction_index(other.refraction_index),
+          albedo(other.albedo) {
+    }
 };
+
+using Material = BasicMaterial<double>;
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+// Allocation free tokenizing of OBJ/MTL text: every function works on string_views into the
+// (memory-mapped) file and consumes what it read from the front of its argument.
+
+inline bool IsBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// next line without its '\n', text must not be empty
+inline std::string_view NextLine(std::string_view& text) {
+    auto end = text.find('\n');
+    auto line = text.substr(0, end);
+    text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+    return line;
+}
+
+// next whitespace separated token, empty once the line is exhausted
+inline std::string_view NextToken(std::string_view& line) {
+    size_t begin = 0;
+    while (begin < line.size() && IsBlank(line[begin])) {
+        ++begin;
+    }
+    size_t end = begin;
+    while (end < line.size() && !IsBlank(line[end])) {
+        ++end;
+    }
+    auto token = line.substr(begin, end - begin);
+    line.remove_prefix(end);
+    return token;
+}
+
+template <class Number>
+Number ParseNumber(std::string_view token) {
+    // from_chars rejects the leading '+' that stod accepted
+    if (token.starts_with('+')) {
+        token.remove_prefix(1);
+    }
+    Number value{};
+    auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), value);
+    if (error != std::errc{} || end != token.data() + token.size()) {
+        throw std::runtime_error{"Bad number in scene: '" + std::string(token) + "'"};
+    }
+    return value;
+}
+
+inline double NextDouble(std::string_view& line) {
+    return ParseNumber<double>(NextToken(line));
+}
+
+// one vertex of an `f` line: v, v/vt, v//vn or v/vt/vn, indices are 1-based or negative
+struct FaceVertex {
+    ssize_t vertex;
+    std::optional<ssize_t> normal;
+};
+
+inline FaceVertex ParseFaceVertex(std::string_view token) {
+    auto first_slash = token.find('/');
+    FaceVertex result{ParseNumber<ssize_t>(token.substr(0, first_slash)), std::nullopt};
+    if (first_slash == std::string_view::npos) {
+        return result;
+    }
+    auto second_slash = token.find('/', first_slash + 1);
+    if (second_slash != std::string_view::npos) {
+        result.normal = ParseNumber<ssize_t>(token.substr(second_slash + 1));
+    }
+    return result;
+}
@@ -0,0 +1,294 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "geometry.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include "vector.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <numbers>
+#include <span>
+#include <tuple>
+#include <vector>
+
+#include <png.h>
+
+// Post-processing of a finished Framebuffer into 8bit RGBA rows. A PostProcessPipeline runs all
+// of its stages over a row while it is in cache (one fused pass instead of one pass per stage),
+// bands of rows go to the thread pool. Stages loop over plain arrays of channels, the gamma stage
+// (the expensive one) with explicit SIMD kernels.
+
+static_assert(sizeof(Vector) == 3 * sizeof(double));
+
+// log2 of kWidth normal positive doubles, relative error below 1e-12
+template <size_t kWidth>
+[[gnu::always_inline]] inline void FastLog2Lanes(SimdVector<double, kWidth>& x) {
+    using V = SimdVector<double, kWidth>;
+    using U = SimdVector<uint64_t, kWidth>;
+
+    auto bits = reinterpret_cast<U>(x);
+    U mantissa_bits = bits & 0x000fffffffffffffull;
+    // mantissa in [sqrt(1/2), sqrt(2)), so the series below converges fast
+    U high = reinterpret_cast<U>(mantissa_bits > 0x6a09e667f3bcdull) & 1;
+    auto mantissa = reinterpret_cast<V>(mantissa_bits | (0x3ff0000000000000ull - (high << 52)));
+    // exponent as double without an int to double conversion, which SSE2/AVX2 lack for 64 bit
+    auto exponent = reinterpret_cast<V>(((bits >> 52) + high) | 0x4330000000000000ull) -
+                    (4503599627370496.0 + 1023.0);
+
+    // ln(m) = 2 atanh(s) = 2 (s + s^3/3 + s^5/5 + ...), s = (m - 1) / (m + 1), |s| < 0.172
+    V s = (mantissa - 1.0) / (mantissa + 1.0);
+    V s2 = s * s;
+    V series =
+        1.0 + s2 * (1 / 3.0 +
+                    s2 * (1 / 5.0 + s2 * (1 / 7.0 + s2 * (1 / 9.0 + s2 * (1 / 11.0 + s2 / 13.0)))));
+    x = exponent + 2.0 * s * series * std::numbers::log2e;
+}
+
+// 2^x of kWidth doubles in [-1022, 1023], relative error below 1e-12
+template <size_t kWidth>
+[[gnu::always_inline]] inline void FastExp2Lanes(SimdVector<double, kWidth>& x) {
+    using V = SimdVector<double, kWidth>;
+    using U = SimdVector<uint64_t, kWidth>;
+
+    // round to nearest integer: adding 1.5 * 2^52 leaves n in the low mantissa bits
+    static constexpr double kRound = 6755399441055744.0;
+    V shifted = x + kRound;
+    V n = shifted - kRound;
+    auto scale = reinterpret_cast<V>((reinterpret_cast<U>(shifted) + 1023) << 52);
+
+    // e^t for |t| <= ln(2) / 2
+    V t = (x - n) * std::numbers::ln2;
+    V poly =
+        1.0 + t * (1.0 + t * (1 / 2.0 +
+                              t * (1 / 6.0 +
+                                   t * (1 / 24.0 +
+                                        t * (1 / 120.0 +
+                                             t * (1 / 720.0 +
+                                                  t * (1 / 5040.0 +
+                                                       t * (1 / 40320.0 +
+                                                            t * (1 / 362880.0 +
+                                                                 t / 3628800.0)))))))));
+    x = poly * scale;
+}
+
+// channels[i]^exponent for |exponent| <= 1, zero for NaN, negative and subnormal channels
+template <size_t kWidth>
+[[gnu::always_inline]] inline void GammaLanes(double* channels, size_t count, double exponent) {
+    using V = SimdVector<double, kWidth>;
+    using U = SimdVector<uint64_t, kWidth>;
+
+    auto gamma = [exponent](V& x) {
+        auto normal = reinterpret_cast<U>((x >= std::numeric_limits<double>::min()) &
+                                          (x <= std::numeric_limits<double>::max()));
+        auto infinite = reinterpret_cast<U>(x > std::numeric_limits<double>::max());
+        auto bits = reinterpret_cast<U>(x);
+        V mapped = reinterpret_cast<V>((bits & normal) | (std::bit_cast<uint64_t>(1.0) & ~normal));
+        FastLog2Lanes<kWidth>(mapped);
+        mapped *= exponent;
+        FastExp2Lanes<kWidth>(mapped);
+        x = reinterpret_cast<V>((reinterpret_cast<U>(mapped) & normal) | (bits & infinite));
+    };
+
+    size_t i = 0;
+    for (; i + kWidth <= count; i += kWidth) {
+        V lanes;
+        LoadLanes(lanes, channels + i);
+        gamma(lanes);
+        StoreLanes(lanes, channels + i);
+    }
+    if (i < count) {
+        V lanes = V{} + 1.0;
+        std::memcpy(&lanes, channels + i, (count - i) * sizeof(double));
+        gamma(lanes);
+        std::memcpy(channels + i, &lanes, (count - i) * sizeof(double));
+    }
+}
+
+using GammaKernel = void (*)(double*, size_t, double);
+
+#if defined(__x86_64__) || defined(__i386__)
+
+inline void GammaSse(double* channels, size_t count, double exponent) {
+    GammaLanes<2>(channels, count, exponent);
+}
+
+[[gnu::target("avx2")]] inline void GammaAvx2(double* channels, size_t count, double exponent) {
+    GammaLanes<4>(channels, count, exponent);
+}
+
+#endif
+
+inline GammaKernel SelectGammaKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return GammaAvx2;
+    }
+    return GammaSse;
+#else
+    return GammaLanes<1>;
+#endif
+}
+
+// x^y like std::pow for normal positive x and |y| <= 1, zero for NaN, negative and subnormal x
+inline double FastPow(double x, double y) {
+    GammaLanes<1>(&x, 1, y);
+    return x;
+}
+
+// x (x / white^2 + 1) / (x + 1): Reinhard with white mapped to 1
+struct ReinhardTonemap {
+    double white;
+
+    void operator()(std::span<double> channels) const {
+        auto white2 = white * white;
+        for (auto& x : channels) {
+            x = x * (x / white2 + 1.0) / (x + 1.0);
+        }
+    }
+};
+
+// x^exponent through FastPow for |exponent| <= 1, zero for NaN, negative and subnormal x
+struct Gamma {
+    double exponent;
+
+    void operator()(std::span<double> channels) const {
+        static const GammaKernel kKernel = SelectGammaKernel();
+        kKernel(channels.data(), channels.size(), exponent);
+    }
+};
+
+// depth / max_distance, white where the distance is `miss`
+struct DepthNormalize {
+    double miss;
+    double max_distance;
+
+    void operator()(std::span<double> channels) const {
+        for (size_t i = 0; i < channels.size(); i += 3) {
+            auto hit = channels[i] != miss;
+            for (size_t k = i; k < i + 3; ++k) {
+                channels[k] = hit ? channels[k] / max_distance : 1.0;
+            }
+        }
+    }
+};
+
+// [-1, 1] normals to [0, 1] colors, pixels without a normal stay black
+struct NormalRemap {
+    void operator()(std::span<double> channels) const {
+        for (size_t i = 0; i < channels.size(); i += 3) {
+            auto given = channels[i] != 0 || channels[i + 1] != 0 || channels[i + 2] != 0;
+            for (size_t k = i; k < i + 3; ++k) {
+                channels[k] = given ? channels[k] * 0.5 + 0.5 : channels[k];
+            }
+        }
+    }
+};
+
+// channel in [0, 1] to a byte, the last stage of every pipeline
+inline png_byte Quantize(double channel) {
+    return static_cast<png_byte>(static_cast<int>((channel - kEpsilon) * 255.0));
+}
+
+template <class... Stages>
+class PostProcessPipeline {
+public:
+    explicit PostProcessPipeline(Stages... stages) : stages_(stages...) {
+    }
+
+    // channels is scratch of 3 * row.size(), rgba receives 4 * row.size() bytes
+    void ProcessRow(std::span<const Vector> row, std::span<double> channels,
+                    std::span<png_byte> rgba) const {
+        std::memcpy(channels.data(), row.data(), row.size_bytes());
+        std::apply([&](const auto&... stage) { (stage(channels), ...); }, stages_);
+        for (size_t x = 0; x < row.size(); ++x) {
+            rgba[4 * x] = Quantize(channels[3 * x]);
+            rgba[4 * x + 1] = Quantize(channels[3 * x + 1]);
+            rgba[4 * x + 2] = Quantize(channels[3 * x + 2]);
+            rgba[4 * x + 3] = 255;
+        }
+    }
+
+private:
+    std::tuple<Stages...> stages_;
+};
+
+// rows processed per band, bands go to the pool and then to the sink in order
+static constexpr int kPostProcessBandRows = 16;
+
+// max of row_reduce(std::span<const Vector> row) over all rows, in parallel bands
+template <class RowReduce>
+double ReduceMax(const Framebuffer& framebuffer, ThreadPool& pool, RowReduce&& row_reduce) {
+    auto band_count = (framebuffer.Height() + kPostProcessBandRows - 1) / kPostProcessBandRows;
+    std::vector<double> band_max(band_count, 0.0);
+    std::vector<ThreadPool::Task> tasks;
+    for (int band = 0; band < band_count; ++band) {
+        tasks.emplace_back([&, band] {
+            auto end = std::min(framebuffer.Height(), (band + 1) * kPostProcessBandRows);
+            for (int y = band * kPostProcessBandRows; y < end; ++y) {
+                band_max[band] = std::max(band_max[band], row_reduce(framebuffer.Row(y)));
+            }
+        });
+    }
+    pool.Run(std::move(tasks));
+    return std::ranges::max(band_max);
+}
+
+// brightest channel of a row
+inline double MaxChannel(std::span<const Vector> row) {
+    double result = 0;
+    for (const auto& pixel : row) {
+        for (int k = 0; k < 3; ++k) {
+            result = std::max(result, std::fabs(pixel[k]));
+        }
+    }
+    return result;
+}
+
+// farthest depth of a row that is not `miss`
+inline double MaxDepth(std::span<const Vector> row, double miss) {
+    double result = 0;
+    for (const auto& pixel : row) {
+        if (pixel[0] != miss) {
+            result = std::max(result, pixel[0]);
+        }
+    }
+    return result;
+}
+
+// Runs pipeline over the framebuffer and hands the 8bit RGBA rows to
+// row_sink(int y, std::span<const png_byte> row) top to bottom. Only a band of rows per thread
+// is buffered, so the output can stream into a PngWriter.
+template <class Pipeline, class RowSink>
+void RunPostProcess(const Framebuffer& framebuffer, const Pipeline& pipeline, ThreadPool& pool,
+                    RowSink&& row_sink) {
+    auto width = static_cast<size_t>(framebuffer.Width());
+    auto rows_per_round = static_cast<int>(pool.Size()) * kPostProcessBandRows;
+    std::vector<png_byte> rgba(4 * width * rows_per_round);
+
+    for (int first = 0; first < framebuffer.Height(); first += rows_per_round) {
+        auto end = std::min(framebuffer.Height(), first + rows_per_round);
+        std::vector<ThreadPool::Task> tasks;
+        for (int band = first; band < end; band += kPostProcessBandRows) {
+            tasks.emplace_back([&, band] {
+                std::vector<double> channels(3 * width);
+                for (int y = band; y < std::min(end, band + kPostProcessBandRows); ++y) {
+                    auto row = std::span{rgba}.subspan(4 * width * (y - first), 4 * width);
+                    pipeline.ProcessRow(framebuffer.Row(y), channels, row);
+                }
+            });
+        }
+        pool.Run(std::move(tasks));
+
+        for (int y = first; y < end; ++y) {
+            row_sink(y, std::span<const png_byte>(rgba).subspan(4 * width * (y - first),
+                                                                4 * width));
+        }
+    }
+}
@@ -1,8 +1,60 @@
 #pragma once
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
 enum class RenderMode { kDepth, kNormal, kFull };
 
+// kBruteForce tests every primitive per ray, kept to cross-check the BVH
+enum class AccelerationMode { kBruteForce, kBvh };
+
+// kFloat traces in single precision: half the memory traffic and twice the SIMD lanes
+enum class Precision { kDouble, kFloat };
+
+// How kFull renders follow reflected and refracted rays: kDepthFirst traces each camera ray's
+// tree on its own, kWavefront traces a tile's rays bounce by bounce as sorted, packet traced
+// queues. Both trace the same rays.
+enum class Integrator { kDepthFirst, kWavefront };
+
+// Progressive mode: passes of one jittered sample per pixel are averaged, each tile stops once
+// its estimate converges. The first pass (pixel centres) always completes, later passes stop at
+// max_passes or when time_budget runs out. kDepth renders ignore it and keep the centre sample.
+struct ProgressiveOptions {
+    int max_passes = 64;
+    int min_passes = 4;
+    double tolerance = 0.1;  // converged: standard error of the tile below tolerance * brightness
+    std::chrono::milliseconds time_budget{0};  // 0 = no limit
+    uint64_t seed = 0;
+};
+
+// Adaptive mode: after the pass of centre samples, pixels that differ from a 4-neighbour are
+// refined by sampling the centres of their quadrants, and recursively of the quadrants that still
+// differ, up to max_samples per pixel. Samples differ on hit/miss, a relative depth jump, a
+// crease between normals or Mitchell's per channel contrast (max - min) / (max + min).
+// kDepth renders ignore it, it can't be combined with progressive.
+struct AdaptiveOptions {
+    int max_samples = 17;  // per pixel with the centre sample, each subdivision takes 4 more
+    double contrast_threshold = 0.2;
+    double depth_threshold = 0.05;  // relative to the nearer of the two distances
+    double normal_threshold = 0.9;  // minimal cosine between the normals of a smooth surface
+};
+
 struct RenderOptions {
-    int depth;
+    int depth;  // bounces per camera ray, at most 64
     RenderMode mode = RenderMode::kFull;
+    AccelerationMode acceleration = AccelerationMode::kBvh;
+    size_t thread_count = 0;  // 0 = one per hardware thread
+    int tile_size = 32;
+    int packet_size = 4;  // camera rays go in packet_size^2 packets, 1 traces them one by one
+    Precision precision = Precision::kDouble;
+    bool scene_cache = false;  // load and refresh a compiled <scene>.rtscene next to the OBJ
+    std::optional<ProgressiveOptions> progressive = std::nullopt;  // nullopt = centre samples
+    std::optional<AdaptiveOptions> adaptive = std::nullopt;
+    Integrator integrator = Integrator::kDepthFirst;
+    double min_throughput = 1e-3;  // lighter reflected/refracted rays go through Russian roulette
+    bool stats_report = false;  // RenderToPng writes timings and ray counts to <output>.stats.json
+    double max_refit_cost = 1.5;  // sequences rebuild a refit BVH this many times as costly
+    bool compact_mesh = false;  // quantized vertexes, encoded normals, see indexed_triangles.h
 };
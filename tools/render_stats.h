@@ -0,0 +1,263 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Render statistics: ray and intersection test counters plus wall time per phase.
+//
+// Counters are per thread (no atomics or shared cache lines on the hot path) and merged when a
+// report is made. Building with RTRACER_NO_STATS compiles the counting out, phase timers stay as
+// they only run a few times per render. Counters are process wide, a report covers everything
+// counted since its RenderStats was created, so concurrent renders see each other's rays.
+
+#ifdef RTRACER_NO_STATS
+static constexpr bool kRenderStats = false;
+#else
+static constexpr bool kRenderStats = true;
+#endif
+
+enum class RayType { kCamera, kShadow, kSecondary };
+
+static constexpr size_t kRayTypeCount = 3;
+
+inline const char* GetRayTypeName(RayType type) {
+    static constexpr std::array<const char*, kRayTypeCount> kNames = {"camera", "shadow",
+                                                                      "secondary"};
+    return kNames[static_cast<size_t>(type)];
+}
+
+struct RenderCounters {
+    // hits are closest hits for camera/secondary rays, blockers found for shadow rays
+    std::array<uint64_t, kRayTypeCount> rays{};
+    std::array<uint64_t, kRayTypeCount> hits{};
+    uint64_t triangle_tests = 0;
+    uint64_t sphere_tests = 0;
+    uint64_t box_tests = 0;
+
+    RenderCounters& operator+=(const RenderCounters& other) {
+        for (size_t i = 0; i < kRayTypeCount; ++i) {
+            rays[i] += other.rays[i];
+            hits[i] += other.hits[i];
+        }
+        triangle_tests += other.triangle_tests;
+        sphere_tests += other.sphere_tests;
+        box_tests += other.box_tests;
+        return *this;
+    }
+
+    RenderCounters& operator-=(const RenderCounters& other) {
+        for (size_t i = 0; i < kRayTypeCount; ++i) {
+            rays[i] -= other.rays[i];
+            hits[i] -= other.hits[i];
+        }
+        triangle_tests -= other.triangle_tests;
+        sphere_tests -= other.sphere_tests;
+        box_tests -= other.box_tests;
+        return *this;
+    }
+};
+
+// Every thread's counters, registered on first use. A thread folds its counters into the
+// retired totals when it exits, so pool workers that are gone still count.
+class CounterRegistry {
+public:
+    static CounterRegistry& Get() {
+        static CounterRegistry registry;
+        return registry;
+    }
+
+    void Register(const RenderCounters* counters) {
+        std::lock_guard lock(mutex_);
+        live_.push_back(counters);
+    }
+
+    void Retire(const RenderCounters* counters) {
+        std::lock_guard lock(mutex_);
+        retired_ += *counters;
+        std::erase(live_, counters);
+    }
+
+    // Sum over all threads. Only exact while the counting threads are idle, e.g. between two
+    // ThreadPool::Run calls, which is when reports are made.
+    RenderCounters Collect() {
+        std::lock_guard lock(mutex_);
+        auto total = retired_;
+        for (const auto* counters : live_) {
+            total += *counters;
+        }
+        return total;
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<const RenderCounters*> live_;
+    RenderCounters retired_;
+};
+
+inline RenderCounters& GetThreadCounters() {
+    struct Slot {
+        Slot() {
+            CounterRegistry::Get().Register(&counters);
+        }
+        ~Slot() {
+            CounterRegistry::Get().Retire(&counters);
+        }
+        RenderCounters counters;
+    };
+    thread_local Slot slot;
+    return slot.counters;
+}
+
+inline void CountRays(RayType type, uint64_t rays, uint64_t hits) {
+    if constexpr (kRenderStats) {
+        auto& counters = GetThreadCounters();
+        counters.rays[static_cast<size_t>(type)] += rays;
+        counters.hits[static_cast<size_t>(type)] += hits;
+    }
+}
+
+inline void CountIntersectionTests(uint64_t triangles, uint64_t spheres) {
+    if constexpr (kRenderStats) {
+        auto& counters = GetThreadCounters();
+        counters.triangle_tests += triangles;
+        counters.sphere_tests += spheres;
+    }
+}
+
+inline void CountBoxTests(uint64_t boxes) {
+    if constexpr (kRenderStats) {
+        GetThreadCounters().box_tests += boxes;
+    }
+}
+
+// Statistics of one render: wall time per phase and the counters of the rays traced meanwhile.
+class RenderStats {
+public:
+    // Adds the time from construction to destruction to a phase
+    class PhaseTimer {
+    public:
+        PhaseTimer(RenderStats& stats, std::string name)
+            : stats_(stats), name_(std::move(name)), start_(std::chrono::steady_clock::now()) {
+        }
+
+        ~PhaseTimer() {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+            stats_.AddPhaseTime(name_, elapsed.count());
+        }
+
+        PhaseTimer(const PhaseTimer&) = delete;
+        PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+    private:
+        RenderStats& stats_;
+        std::string name_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    RenderStats()
+        : start_(std::chrono::steady_clock::now()), baseline_(CounterRegistry::Get().Collect()) {
+    }
+
+    PhaseTimer TimePhase(std::string name) {
+        return {*this, std::move(name)};
+    }
+
+    // phases keep the order they first ran in, repeated phases add up
+    void AddPhaseTime(const std::string& name, double seconds) {
+        for (auto& [phase, total] : phases_) {
+            if (phase == name) {
+                total += seconds;
+                return;
+            }
+        }
+        phases_.emplace_back(name, seconds);
+    }
+
+    double GetPhaseTime(const std::string& name) const {
+        for (const auto& [phase, total] : phases_) {
+            if (phase == name) {
+                return total;
+            }
+        }
+        return 0;
+    }
+
+    const std::vector<std::pair<std::string, double>>& GetPhases() const {
+        return phases_;
+    }
+
+    // counters since construction, call while no render threads are running
+    RenderCounters GetCounters() const {
+        auto counters = CounterRegistry::Get().Collect();
+        counters -= baseline_;
+        return counters;
+    }
+
+    void SetFrame(int width, int height, size_t thread_count) {
+        width_ = width;
+        height_ = height;
+        thread_count_ = thread_count;
+    }
+
+    // JSON report, rays per second are over the "trace" phase
+    void WriteJson(const std::filesystem::path& path) const {
+        std::ofstream output(path);
+        if (!output) {
+            throw std::runtime_error{"Can't write " + path.string()};
+        }
+        std::chrono::duration<double> total = std::chrono::steady_clock::now() - start_;
+        auto counters = GetCounters();
+        auto ratio = [](double part, double whole) { return whole > 0 ? part / whole : 0.0; };
+
+        output << "{\n";
+        output << "  \"width\": " << width_ << ",\n";
+        output << "  \"height\": " << height_ << ",\n";
+        output << "  \"threads\": " << thread_count_ << ",\n";
+        output << "  \"counters_compiled\": " << (kRenderStats ? "true" : "false") << ",\n";
+
+        output << "  \"phases_seconds\": {\n";
+        for (const auto& [phase, seconds] : phases_) {
+            output << "    \"" << phase << "\": " << seconds << ",\n";
+        }
+        output << "    \"total\": " << total.count() << "\n  },\n";
+
+        auto trace_seconds = GetPhaseTime("trace");
+        uint64_t all_rays = 0;
+        output << "  \"rays\": {\n";
+        for (size_t i = 0; i < kRayTypeCount; ++i) {
+            all_rays += counters.rays[i];
+            output << "    \"" << GetRayTypeName(static_cast<RayType>(i)) << "\": {\"count\": "
+                   << counters.rays[i] << ", \"hits\": " << counters.hits[i]
+                   << ", \"hit_ratio\": " << ratio(counters.hits[i], counters.rays[i])
+                   << ", \"per_second\": " << ratio(counters.rays[i], trace_seconds) << "}"
+                   << (i + 1 < kRayTypeCount ? ",\n" : "\n");
+        }
+        output << "  },\n";
+
+        output << "  \"intersection_tests\": {\n";
+        output << "    \"triangle\": " << counters.triangle_tests << ",\n";
+        output << "    \"sphere\": " << counters.sphere_tests << ",\n";
+        output << "    \"box\": " << counters.box_tests << ",\n";
+        output << "    \"primitives_per_ray\": "
+               << ratio(counters.triangle_tests + counters.sphere_tests, all_rays) << ",\n";
+        output << "    \"boxes_per_ray\": " << ratio(counters.box_tests, all_rays) << "\n";
+        output << "  }\n}\n";
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+    RenderCounters baseline_;
+    std::vector<std::pair<std::string, double>> phases_;
+    int width_ = 0;
+    int height_ = 0;
+    size_t thread_count_ = 0;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+
+// splitmix64 finalizer, decorrelates neighbouring inputs
+inline uint64_t MixBits(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// uniform double in [0, 1) from the top 53 bits
+inline double ToUnitInterval(uint64_t bits) {
+    return static_cast<double>(bits >> 11) * 0x1.0p-53;
+}
+
+inline double RadicalInverse(uint64_t index, uint64_t base) {
+    double inverse_base = 1.0 / base;
+    double digit_scale = inverse_base;
+    double result = 0;
+    for (; index > 0; index /= base) {
+        result += static_cast<double>(index % base) * digit_scale;
+        digit_scale *= inverse_base;
+    }
+    return result;
+}
+
+// Offset in [0, 1)^2 of sample `index` inside pixel (x, y). Sample 0 is the pixel centre, the
+// rest follow a Halton (2, 3) sequence shifted by a per pixel random rotation, so the samples of
+// a pixel are stratified while neighbouring pixels don't share one pattern.
+inline std::pair<double, double> GetSampleOffset(int x, int y, int index, uint64_t seed) {
+    if (index == 0) {
+        return {0.5, 0.5};
+    }
+    auto hash = MixBits(seed ^ MixBits((static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) |
+                                       static_cast<uint32_t>(y)));
+    auto rotate = [](double value, double shift) {
+        value += shift;
+        return value < 1.0 ? value : value - 1.0;
+    };
+    return {rotate(RadicalInverse(index, 2), ToUnitInterval(hash)),
+            rotate(RadicalInverse(index, 3), ToUnitInterval(MixBits(hash)))};
+}
@@ -4,245 +4,849 @@
 #include "vector.h"
 #include "object.h"
 #include "light.h"
+#include "bvh.h"
+#include "instance.h"
+#include "indexed_triangles.h"
+#include "packed_spheres.h"
+#include "simd_intersection.h"
+#include "mapped_file.h"
+#include "obj_tokenizer.h"
+#include "thread_pool.h"
 
 #include <vector>
+#include <algorithm>
 #include <unordered_map>
 #include <string>
 #include <filesystem>
+#include <optional>
+#include <ranges>
+#include <numbers>
+#include <numeric>
+#include <utility>
 
 #include <util.h>
-#include <fstream>
-#include <iostream>
-#include <sstream>
+#include <stdexcept>
 
-class Scene {
+template <class T>
+class BasicScene {
 public:
-    Scene(const std::vector<Object>& objects, const std::vector<SphereObject>& sphere_objects,
-          const std::vector<Light>& lights, std::unordered_map<std::string, Material>& materials)
-        : objects_(objects), sphere_objects_(sphere_objects), lights_(lights) {
+    BasicScene(BasicIndexedTriangles<T> triangles,
+               std::vector<const BasicMaterial<T>*> triangle_materials,
+               std::vector<BasicSphereObject<T>> sphere_objects, std::vector<BasicLight<T>> lights,
+               std::unordered_map<std::string, BasicMaterial<T>>& materials)
+        : triangles_(std::move(triangles)),
+          triangle_materials_(std::move(triangle_materials)),
+          sphere_objects_(std::move(sphere_objects)),
+          lights_(std::move(lights)) {
         materials_ = std::move(materials);
+        sphere_ids_ = Iota(sphere_objects_.size());
+        PackSpheres();
     }
 
-    const std::vector<Object>& GetObjects() const {
-        return objects_;
+    // precision conversion, e.g. a float copy of a parsed scene for the float render path
+    template <class U>
+    explicit BasicScene(const BasicScene<U>& other) {
+        std::unordered_map<const BasicMaterial<U>*, const BasicMaterial<T>*> material_of;
+        for (const auto& [name, material] : other.GetMaterials()) {
+            material_of[&material] = &materials_.emplace(name, material).first->second;
+        }
+        auto convert_material = [&](const BasicMaterial<U>* material) {
+            return material ? material_of.at(material) : nullptr;
+        };
+        auto convert = [](const BasicVector<U>& vector) { return BasicVector<T>(vector); };
+        auto convert_materials = [&](const std::vector<const BasicMaterial<U>*>& materials) {
+            std::vector<const BasicMaterial<T>*> result;
+            result.reserve(materials.size());
+            for (const auto* material : materials) {
+                result.push_back(convert_material(material));
+            }
+            return result;
+        };
+        auto convert_spheres = [&](const std::vector<BasicSphereObject<U>>& objects) {
+            std::vector<BasicSphereObject<T>> result;
+            for (const auto& object : objects) {
+                result.push_back({convert_material(object.material),
+                                  BasicSphere<T>(convert(object.sphere.GetCenter()),
+                                                 static_cast<T>(object.sphere.GetRadius()))});
+            }
+            return result;
+        };
+
+        triangles_ = BasicIndexedTriangles<T>(other.GetTriangles());
+        triangle_materials_ = convert_materials(other.GetTriangleMaterials());
+        sphere_objects_ = convert_spheres(other.GetSphereObjects());
+        for (const auto& light : other.GetLights()) {
+            lights_.push_back({convert(light.position), convert(light.intensity)});
+        }
+        for (const auto& mesh : other.GetMeshes()) {
+            meshes_.emplace_back(BasicIndexedTriangles<T>(mesh.GetTriangles()),
+                                 convert_materials(mesh.GetTriangleMaterials()),
+                                 convert_spheres(mesh.GetSphereObjects()));
+        }
+        for (const auto& instance : other.GetInstances()) {
+            instances_.push_back({instance.mesh, BasicTransform<T>(instance.to_world),
+                                  BasicTransform<T>(instance.to_object),
+                                  convert_material(instance.material),
+                                  BasicAabb<T>(instance.bounds)});
+        }
+        source_files_ = other.GetSourceFiles();
+        sphere_ids_ = other.GetSphereIds();
+        instance_ids_ = other.GetInstanceIds();
+        PackSpheres();
     }
-    const std::vector<SphereObject>& GetSphereObjects() const {
+
+    // triangles index vertex and normal pools, see indexed_triangles.h
+    const BasicIndexedTriangles<T>& GetTriangles() const {
+        return triangles_;
+    }
+    // material of every triangle, same indices
+    const std::vector<const BasicMaterial<T>*>& GetTriangleMaterials() const {
+        return triangle_materials_;
+    }
+    const std::vector<BasicSphereObject<T>>& GetSphereObjects() const {
         return sphere_objects_;
     }
-    const std::vector<Light>& GetLights() const {
+    // hot copy of the GetSphereObjects() spheres for the intersection kernels, same indices
+    const BasicPackedSpheres<T>& GetSpheres() const {
+        return spheres_;
+    }
+    const std::vector<BasicLight<T>>& GetLights() const {
         return lights_;
     }
-    const std::unordered_map<std::string, Material>& GetMaterials() const {
+    const std::unordered_map<std::string, BasicMaterial<T>>& GetMaterials() const {
         return materials_;
     }
 
+    // instanced meshes and their placements, see instance.h
+    const std::vector<BasicMesh<T>>& GetMeshes() const {
+        return meshes_;
+    }
+    const std::vector<BasicInstance<T>>& GetInstances() const {
+        return instances_;
+    }
+
+    void SetInstances(std::vector<BasicMesh<T>> meshes, std::vector<BasicInstance<T>> instances) {
+        meshes_ = std::move(meshes);
+        instances_ = std::move(instances);
+        instance_ids_ = Iota(instances_.size());
+        instance_bvh_.reset();
+    }
+
+    // Index in the scene file of every sphere and instance: BuildBvh reorders them, these stay
+    // with them and name them for the Update* methods. Vertexes keep their file order.
+    const std::vector<uint32_t>& GetSphereIds() const {
+        return sphere_ids_;
+    }
+    const std::vector<uint32_t>& GetInstanceIds() const {
+        return instance_ids_;
+    }
+
+    // spatial index over triangles and spheres, absent until BuildBvh is called
+    const std::optional<BasicBvh<T>>& GetBvh() const {
+        return bvh_;
+    }
+
+    // top level index over the instance bounds, its leaves index GetInstances()
+    const std::optional<BasicBvh<T>>& GetInstanceBvh() const {
+        return instance_bvh_;
+    }
+
+    // Spheres containing point, those of instances placed in world space. Only the BVH leaves
+    // around point are searched once the BVHs are built.
+    std::vector<BasicSphereObject<T>> GetSpheresContaining(const BasicVector<T>& point) const {
+        std::vector<BasicSphereObject<T>> spheres;
+        VisitSpheresContaining(*this, point, [&](const BasicSphereObject<T>& object) {
+            spheres.push_back(object);
+        });
+
+        auto visit_instance = [&](const BasicInstance<T>& instance) {
+            if (!instance.bounds.Contains(point)) {
+                return;
+            }
+            auto scale = Length(instance.to_world.ApplyToVector({1, 0, 0}));
+            VisitSpheresContaining(
+                meshes_[instance.mesh], instance.to_object.ApplyToPoint(point),
+                [&](const BasicSphereObject<T>& object) {
+                    spheres.push_back(
+                        {instance.material ? instance.material : object.material,
+                         BasicSphere<T>(instance.to_world.ApplyToPoint(object.sphere.GetCenter()),
+                                        object.sphere.GetRadius() * scale)});
+                });
+        };
+        if (instance_bvh_) {
+            instance_bvh_->VisitContaining(point, [&](const BasicBvhNode<T>& leaf) {
+                for (auto i = leaf.first; i < leaf.first + leaf.triangle_count; ++i) {
+                    visit_instance(instances_[i]);
+                }
+            });
+        } else {
+            for (const auto& instance : instances_) {
+                visit_instance(instance);
+            }
+        }
+        return spheres;
+    }
+
+    // also builds the BVH of every mesh and the one over the instances
+    void BuildBvh() {
+        BuildObjectBvh();
+        for (auto& mesh : meshes_) {
+            if (!mesh.GetBvh()) {
+                mesh.BuildBvh();
+            }
+        }
+        if (!instances_.empty()) {
+            BuildInstanceBvh();
+        }
+    }
+
+    // for a hierarchy built earlier over the current primitive order, see scene_cache.h
+    void SetBvh(BasicBvh<T> bvh) {
+        bvh_.emplace(std::move(bvh));
+        bvh_cost_ = bvh_->GetCost();
+    }
+
+    // ids of the spheres in their current order, e.g. from a scene cache
+    void SetSphereIds(std::vector<uint32_t> sphere_ids) {
+        sphere_ids_ = std::move(sphere_ids);
+    }
+
+    // Quantizes the vertexes and encodes the normals of the scene and its meshes, see
+    // BasicIndexedTriangles::Compress. Built BVHs are refit to the moved vertexes on pool.
+    void CompressTriangles(ThreadPool& pool) {
+        triangles_.Compress();
+        for (auto& mesh : meshes_) {
+            mesh.CompressTriangles(pool);
+        }
+        UpdateInstances([](uint32_t, BasicTransform<T>&) {});
+        if (bvh_) {
+            bvh_->Refit(triangles_, sphere_objects_, pool);
+        }
+        if (instance_bvh_) {
+            instance_bvh_->Refit(GetInstanceBounds(), pool);
+        }
+    }
+
+    void ResetBvh() {
+        bvh_.reset();
+        instance_bvh_.reset();
+        for (auto& mesh : meshes_) {
+            mesh.ResetBvh();
+        }
+    }
+
+    // Animation: primitives, instances and lights move in place between renders. The BVHs are
+    // stale after a move until UpdateBvh is called.
+
+    // update(uint32_t vertex, BasicVector<T>& position) for every vertex, in parallel on pool.
+    // Vertexes are numbered in file order, triangles keep their vertexes. Quantized positions are
+    // quantized anew over the moved bounds.
+    template <class Update>
+    void UpdateVertices(ThreadPool& pool, const Update& update) {
+        bool quantized = triangles_.ArePositionsQuantized();
+        triangles_.DequantizePositions();
+        auto& positions = triangles_.GetPositions();
+        ParallelFor(pool, positions.size(),
+                    [&](size_t i) { update(static_cast<uint32_t>(i), positions[i]); });
+        if (quantized) {
+            triangles_.QuantizePositions();
+        }
+    }
+
+    // update(uint32_t id, BasicSphereObject<T>& object) for every sphere, in parallel on pool
+    template <class Update>
+    void UpdateSpheres(ThreadPool& pool, const Update& update) {
+        ParallelFor(pool, sphere_objects_.size(), [&](size_t i) {
+            update(sphere_ids_[i], sphere_objects_[i]);
+            spheres_.Set(i, sphere_objects_[i].sphere);
+        });
+    }
+
+    // update(uint32_t id, BasicTransform<T>& to_world) for every instance
+    template <class Update>
+    void UpdateInstances(const Update& update) {
+        for (size_t i = 0; i < instances_.size(); ++i) {
+            auto& instance = instances_[i];
+            update(instance_ids_[i], instance.to_world);
+            instance.to_object = instance.to_world.Inverse();
+            instance.bounds = instance.to_world.ApplyToBox(meshes_[instance.mesh].GetBounds());
+        }
+    }
+
+    // update(uint32_t index, BasicLight<T>& light) for every light, lights are never reordered
+    template <class Update>
+    void UpdateLights(const Update& update) {
+        for (size_t i = 0; i < lights_.size(); ++i) {
+            update(static_cast<uint32_t>(i), lights_[i]);
+        }
+    }
+
+    // Brings the BVHs up to date after a move. They are refit, and rebuilt instead once refitting
+    // has made them max_cost_ratio times as costly as when they were built (BasicBvh::GetCost).
+    // Returns whether any was rebuilt.
+    bool UpdateBvh(ThreadPool& pool, double max_cost_ratio) {
+        bool rebuilt = false;
+        if (bvh_) {
+            bvh_->Refit(triangles_, sphere_objects_, pool);
+            if (bvh_->GetCost() > max_cost_ratio * bvh_cost_) {
+                BuildObjectBvh();
+                rebuilt = true;
+            }
+        }
+        if (instance_bvh_) {
+            instance_bvh_->Refit(GetInstanceBounds(), pool);
+            if (instance_bvh_->GetCost() > max_cost_ratio * instance_bvh_cost_) {
+                BuildInstanceBvh();
+                rebuilt = true;
+            }
+        }
+        return rebuilt;
+    }
+
+    // the .obj and .mtl files the scene was read from
+    const std::vector<std::filesystem::path>& GetSourceFiles() const {
+        return source_files_;
+    }
+
+    void SetSourceFiles(std::vector<std::filesystem::path> source_files) {
+        source_files_ = std::move(source_files);
+    }
+
 private:
-    std::vector<Object> objects_;
-    std::vector<SphereObject> sphere_objects_;
-    std::vector<Light> lights_;
-    std::unordered_map<std::string, Material> materials_;
-};
+    static constexpr size_t kMinUpdateChunkSize = 1 << 12;
 
-std::vector<std::string> ParseString(const std::string& line) {
-    std::vector<std::string> output;
-    std::istringstream ss(line);
-    std::string part;
-    while (ss) {
-        ss >> part;
-        output.push_back(std::move(part));
+    static std::vector<uint32_t> Iota(size_t size) {
+        std::vector<uint32_t> result(size);
+        std::iota(result.begin(), result.end(), 0);
+        return result;
     }
-    output.pop_back();
-    return output;
-}
 
-Vector ReadVector(const std::vector<std::string>& parsed) {
-    return Vector({std::stod(parsed[1]), std::stod(parsed[2]), std::stod(parsed[3])});
+    // items[order[i]] for every i
+    template <class Item>
+    static std::vector<Item> Permute(const std::vector<Item>& items,
+                                     const std::vector<uint32_t>& order) {
+        std::vector<Item> result;
+        result.reserve(order.size());
+        for (auto index : order) {
+            result.push_back(items[index]);
+        }
+        return result;
+    }
+
+    // function(i) for i in [0, size), in a few chunks per thread
+    template <class Function>
+    static void ParallelFor(ThreadPool& pool, size_t size, const Function& function) {
+        auto chunk_count = std::min(pool.Size() * 4, size / kMinUpdateChunkSize + 1);
+        std::vector<ThreadPool::Task> tasks;
+        for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+            tasks.emplace_back([&, chunk] {
+                for (auto i = size * chunk / chunk_count; i < size * (chunk + 1) / chunk_count;
+                     ++i) {
+                    function(i);
+                }
+            });
+        }
+        pool.Run(std::move(tasks));
+    }
+
+    void BuildObjectBvh() {
+        std::vector<uint32_t> triangle_order, sphere_order;
+        bvh_.emplace(triangles_, sphere_objects_, triangle_order, sphere_order);
+        bvh_cost_ = bvh_->GetCost();
+        triangles_.Permute(triangle_order);
+        triangle_materials_ = Permute(triangle_materials_, triangle_order);
+        sphere_objects_ = Permute(sphere_objects_, sphere_order);
+        sphere_ids_ = Permute(sphere_ids_, sphere_order);
+        PackSpheres();
+    }
+
+    void PackSpheres() {
+        spheres_ = BasicPackedSpheres<T>(sphere_objects_ |
+                                         std::views::transform(&BasicSphereObject<T>::sphere));
+    }
+
+    // visit(object) for the spheres of a scene or mesh containing point, through its BVH if built
+    template <class Geometry, class Visit>
+    static void VisitSpheresContaining(const Geometry& geometry, const BasicVector<T>& point,
+                                       const Visit& visit) {
+        const auto& objects = geometry.GetSphereObjects();
+        auto visit_range = [&](size_t first, size_t count) {
+            for (auto i = first; i < first + count; ++i) {
+                if (objects[i].sphere.Contains(point)) {
+                    visit(objects[i]);
+                }
+            }
+        };
+        if (const auto& bvh = geometry.GetBvh()) {
+            bvh->VisitContaining(point, [&](const BasicBvhNode<T>& leaf) {
+                visit_range(leaf.first_sphere, leaf.sphere_count);
+            });
+        } else {
+            visit_range(0, objects.size());
+        }
+    }
+
+    std::vector<BasicAabb<T>> GetInstanceBounds() const {
+        std::vector<BasicAabb<T>> bounds;
+        bounds.reserve(instances_.size());
+        for (const auto& instance : instances_) {
+            bounds.push_back(instance.bounds);
+        }
+        return bounds;
+    }
+
+    void BuildInstanceBvh() {
+        std::vector<uint32_t> order;
+        instance_bvh_.emplace(GetInstanceBounds(), order);
+        instance_bvh_cost_ = instance_bvh_->GetCost();
+        instances_ = Permute(instances_, order);
+        instance_ids_ = Permute(instance_ids_, order);
+    }
+
+    BasicIndexedTriangles<T> triangles_;
+    std::vector<const BasicMaterial<T>*> triangle_materials_;
+    std::vector<BasicSphereObject<T>> sphere_objects_;
+    BasicPackedSpheres<T> spheres_;
+    std::vector<BasicLight<T>> lights_;
+    std::unordered_map<std::string, BasicMaterial<T>> materials_;
+    std::optional<BasicBvh<T>> bvh_;
+    std::vector<BasicMesh<T>> meshes_;
+    std::vector<BasicInstance<T>> instances_;
+    std::optional<BasicBvh<T>> instance_bvh_;
+    std::vector<std::filesystem::path> source_files_;
+    std::vector<uint32_t> sphere_ids_;
+    std::vector<uint32_t> instance_ids_;
+    double bvh_cost_ = 0;  // BasicBvh::GetCost of the BVHs when they were built
+    double instance_bvh_cost_ = 0;
+};
+
+using Scene = BasicScene<double>;
+
+Vector ReadVector(std::string_view& line) {
+    auto x = NextDouble(line);
+    auto y = NextDouble(line);
+    auto z = NextDouble(line);
+    return Vector(x, y, z);
 }
 
-SphereObject ReadSphereObject(const std::vector<std::string>& parsed) {
-    Sphere sphere(Vector(std::stod(parsed[1]), std::stod(parsed[2]), std::stod(parsed[3])),
-                  std::stod(parsed[4]));
+SphereObject ReadSphereObject(std::string_view& line) {
+    auto center = ReadVector(line);
+    Sphere sphere(center, NextDouble(line));
     return SphereObject{nullptr, sphere};
 }
 
-Light ReadLightObject(const std::vector<std::string>& parsed) {
-    Light light(Vector(std::stod(parsed[1]), std::stod(parsed[2]), std::stod(parsed[3])),
-                Vector(std::stod(parsed[4]), std::stod(parsed[5]), std::stod(parsed[6])));
+Light ReadLightObject(std::string_view& line) {
+    auto position = ReadVector(line);
+    Light light(position, ReadVector(line));
     return light;
 }
 
-// parses x//y
-auto ParsePair(const std::string& line) {
-    ssize_t first_number, second_number;
-    std::sscanf(line.c_str(), "%zd//%zd", &first_number, &second_number);
-    return std::make_pair(first_number, second_number);
-}
+// OBJ index as seen from inside a chunk: positive indices are absolute, negative ones count back
+// from the elements read so far and become absolute once the chunk's offset is known
+struct ChunkIndex {
+    ssize_t value;
+    bool relative;
+};
 
-// parses x/y/z
-auto ParseTriple(const std::string& line) {
-    ssize_t first_number, second_number, third_number;
-    std::sscanf(line.c_str(), "%zd/%zd/%zd", &first_number, &second_number, &third_number);
-    return std::make_tuple(first_number, second_number, third_number);
+ChunkIndex ToChunkIndex(ssize_t obj_index, size_t read_in_chunk) {
+    if (obj_index < 0) {
+        return {static_cast<ssize_t>(read_in_chunk) + obj_index, true};
+    }
+    return {obj_index - 1, false};
 }
 
-decltype(auto) GetFromContainer(ssize_t idx, const auto& container) {
-    if (idx < 0) {
-        idx += std::ssize(container);
-    } else {
-        --idx;
+// absolute index into the size elements of the whole file
+uint32_t ResolveIndex(ChunkIndex index, size_t chunk_offset, size_t size) {
+    auto idx = index.value + (index.relative ? static_cast<ssize_t>(chunk_offset) : 0);
+    if (idx < 0 || idx >= static_cast<ssize_t>(size)) {
+        throw std::runtime_error{"Bad index in scene: " + std::to_string(idx + 1)};
     }
-    return container[idx];
+    return static_cast<uint32_t>(idx);
 }
 
 std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::path& path) {
-    std::ifstream input(path);
-    std::string line;
+    MappedFile file(path);
+    auto text = file.GetContents();
 
     std::unordered_map<std::string, Material> materials;
 
     Material material;
     bool currently_in_material{false};
 
-    while (getline(input, line)) {
-        auto parsed_line = ParseString(line);
-        if (parsed_line[0].starts_with("#")) {
+    while (!text.empty()) {
+        auto line = NextLine(text);
+        auto keyword = NextToken(line);
+        if (keyword.empty() || keyword.starts_with("#")) {
             continue;
         }
-        if (parsed_line[0] == "newmtl") {
+        if (keyword == "newmtl") {
             if (currently_in_material) {
                 materials[material.name] = material;
             }
             material = {};
-            material.name = std::move(parsed_line[1]);
+            material.name = NextToken(line);
             currently_in_material = true;
-        } else {
-            if (parsed_line[0] == "Ks") {
-                material.specular_color = ReadVector(parsed_line);
-            }
-
-            if (parsed_line[0] == "Ka") {
-                material.ambient_color = ReadVector(parsed_line);
-            }
+        } else if (keyword == "Ks") {
+            material.specular_color = ReadVector(line);
+        } else if (keyword == "Ka") {
+            material.ambient_color = ReadVector(line);
+        } else if (keyword == "Kd") {
+            material.diffuse_color = ReadVector(line);
+        } else if (keyword == "Ke") {
+            material.intensity = ReadVector(line);
+        } else if (keyword == "Ns") {
+            material.specular_exponent = NextDouble(line);
+        } else if (keyword == "Ni") {
+            material.refraction_index = NextDouble(line);
+        } else if (keyword == "al") {
+            material.albedo = ReadVector(line);
+        }
+    }
 
-            if (parsed_line[0] == "Kd") {
-                material.diffuse_color = ReadVector(parsed_line);
-            }
+    materials[material.name] = material;
 
-            if (parsed_line[0] == "Ke") {
-                material.intensity = ReadVector(parsed_line);
-            }
+    return materials;
+};
 
-            if (parsed_line[0] == "Ns") {
-                material.specular_exponent = std::stod(parsed_line[1]);
-            }
+// `M <name> <file.obj>`: a mesh file that instances place, path relative to the scene
+struct MeshDeclaration {
+    std::string name;
+    std::string file;
+};
 
-            if (parsed_line[0] == "Ni") {
-                material.refraction_index = std::stod(parsed_line[1]);
-            }
+// `I <mesh> <x> <y> <z> [<scale> [<yaw degrees> [<material>]]]`: the mesh scaled, rotated
+// around +y, moved to (x, y, z), with the material instead of the mesh's own when given
+struct InstanceDeclaration {
+    std::string mesh;
+    Transform to_world;
+    std::string material;
+};
 
-            if (parsed_line[0] == "al") {
-                material.albedo = ReadVector(parsed_line);
-            }
+InstanceDeclaration ReadInstanceDeclaration(std::string_view& line) {
+    InstanceDeclaration instance;
+    instance.mesh = NextToken(line);
+    auto position = ReadVector(line);
+    double scale = 1, yaw = 0;
+    if (auto token = NextToken(line); !token.empty()) {
+        scale = ParseNumber<double>(token);
+        if (!(scale > 0)) {
+            throw std::runtime_error{"Instance scale must be positive"};
+        }
+        if (token = NextToken(line); !token.empty()) {
+            yaw = ParseNumber<double>(token) * std::numbers::pi / 180;
+            instance.material = NextToken(line);
         }
     }
+    instance.to_world =
+        Transform::Translation(position) * Transform::RotationY(yaw) * Transform::Scale(scale);
+    return instance;
+}
 
-    materials[material.name] = material;
-
-    return materials;
-};
+// Everything one newline-aligned piece of an OBJ file defines. Faces keep unresolved indices
+// and a material slot, since both may refer to what earlier chunks read.
+struct ObjChunk {
+    struct FaceVertex {
+        ChunkIndex vertex;
+        std::optional<ChunkIndex> normal;
+    };
 
-Scene ReadScene(const std::filesystem::path& path) {
-    std::ifstream input(path);
-    std::string line;
+    struct Face {
+        size_t first_vertex;
+        size_t vertex_count;
+        ssize_t material;  // index into material_names, -1 = active when the chunk began
+    };
 
-    std::vector<Object> objects;
     std::vector<Vector> vertexes;
     std::vector<Vector> normals;
-    std::unordered_map<std::string, Material> materials;
+    std::vector<FaceVertex> face_vertexes;
+    std::vector<Face> faces;
     std::vector<SphereObject> sphere_objects;
+    std::vector<ssize_t> sphere_materials;
     std::vector<Light> light_objects;
+    std::vector<std::string> material_names;  // usemtl arguments in order
+    std::vector<std::string> material_libraries;
+    std::vector<MeshDeclaration> mesh_declarations;
+    std::vector<InstanceDeclaration> instances;
+    size_t triangle_count = 0;
+};
 
-    Material* current_material = nullptr;
+ObjChunk ParseObjChunk(std::string_view text) {
+    ObjChunk chunk;
 
-    while (getline(input, line)) {
-        auto parsed = ParseString(line);
+    while (!text.empty()) {
+        auto line = NextLine(text);
+        auto keyword = NextToken(line);
 
-        if (parsed.empty() || parsed[0].starts_with("#")) {
+        if (keyword.empty() || keyword.starts_with("#")) {
             continue;
         }
 
-        if (parsed[0] == "v") {
-            vertexes.push_back(ReadVector(parsed));
-            continue;
+        auto material = std::ssize(chunk.material_names) - 1;
+
+        if (keyword == "v") {
+            chunk.vertexes.push_back(ReadVector(line));
+        } else if (keyword == "vn") {
+            chunk.normals.push_back(ReadVector(line));
+        } else if (keyword == "S") {
+            chunk.sphere_objects.push_back(ReadSphereObject(line));
+            chunk.sphere_materials.push_back(material);
+        } else if (keyword == "P") {
+            chunk.light_objects.push_back(ReadLightObject(line));
+        } else if (keyword == "f") {
+            auto first_vertex = chunk.face_vertexes.size();
+            for (auto token = NextToken(line); !token.empty(); token = NextToken(line)) {
+                auto [vertex, normal] = ParseFaceVertex(token);
+                auto& face_vertex = chunk.face_vertexes.emplace_back(
+                    ToChunkIndex(vertex, chunk.vertexes.size()), std::nullopt);
+                if (normal) {
+                    face_vertex.normal = ToChunkIndex(*normal, chunk.normals.size());
+                }
+            }
+            auto vertex_count = chunk.face_vertexes.size() - first_vertex;
+            chunk.faces.push_back({first_vertex, vertex_count, material});
+            chunk.triangle_count += vertex_count > 2 ? vertex_count - 2 : 0;
+        } else if (keyword == "M") {
+            auto name = NextToken(line);
+            chunk.mesh_declarations.push_back({std::string(name), std::string(NextToken(line))});
+        } else if (keyword == "I") {
+            chunk.instances.push_back(ReadInstanceDeclaration(line));
+        } else if (keyword == "mtllib") {
+            chunk.material_libraries.emplace_back(NextToken(line));
+        } else if (keyword == "usemtl") {
+            chunk.material_names.emplace_back(NextToken(line));
         }
+    }
 
-        if (parsed[0] == "vn") {
-            normals.push_back(ReadVector(parsed));
-            continue;
-        }
+    return chunk;
+}
 
-        if (parsed[0] == "S") {
-            auto sphere = ReadSphereObject(parsed);
-            sphere.material = current_material;
-            sphere_objects.push_back(sphere);
-            continue;
-        }
+// splits text into about `count` pieces that end right after a newline
+std::vector<std::string_view> SplitIntoLineChunks(std::string_view text, size_t count) {
+    std::vector<std::string_view> chunks;
+    auto chunk_size = text.size() / count + 1;
+    while (!text.empty()) {
+        auto end = text.find('\n', std::min(chunk_size, text.size()) - 1);
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        chunks.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+    }
+    return chunks;
+}
 
-        if (parsed[0] == "P") {
-            light_objects.push_back(ReadLightObject(parsed));
-            continue;
+Scene ReadScene(const std::filesystem::path& path, size_t thread_count = 0);
+
+// Reads every mesh the chunks declare once, in object space, and places their instances. Mesh
+// materials join the scene's as "<mesh>/<material>", lights of mesh files are ignored and mesh
+// files can't declare meshes themselves.
+std::pair<std::vector<Mesh>, std::vector<Instance>> ReadInstances(
+    const std::filesystem::path& path, const std::vector<ObjChunk>& chunks,
+    std::unordered_map<std::string, Material>& materials,
+    std::vector<std::filesystem::path>& source_files, size_t thread_count) {
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
+    std::unordered_map<std::string, uint32_t> mesh_indexes;
+    for (const auto& chunk : chunks) {
+        for (const auto& [name, file] : chunk.mesh_declarations) {
+            if (mesh_indexes.contains(name)) {
+                throw std::runtime_error{"Mesh " + name + " declared twice"};
+            }
+            auto mesh_scene = ReadScene(path.parent_path() / file, thread_count);
+            if (!mesh_scene.GetInstances().empty()) {
+                throw std::runtime_error{"Mesh " + name + " has instances itself"};
+            }
+
+            std::unordered_map<const Material*, const Material*> material_of;
+            for (const auto& [key, material] : mesh_scene.GetMaterials()) {
+                material_of[&material] = &(materials[name + "/" + key] = material);
+            }
+            auto remap = [&](const Material* material) {
+                return material ? material_of.at(material) : nullptr;
+            };
+            auto triangle_materials = mesh_scene.GetTriangleMaterials();
+            std::ranges::transform(triangle_materials, triangle_materials.begin(), remap);
+            auto sphere_objects = mesh_scene.GetSphereObjects();
+            for (auto& object : sphere_objects) {
+                object.material = remap(object.material);
+            }
+            mesh_indexes.emplace(name, meshes.size());
+            meshes.emplace_back(mesh_scene.GetTriangles(), std::move(triangle_materials),
+                                std::move(sphere_objects));
+            for (const auto& source : mesh_scene.GetSourceFiles()) {
+                source_files.push_back(source);
+            }
         }
+    }
 
-        if (parsed[0] == "f") {
-            std::vector<Vector> polygon_points;
-            std::vector<Vector> optional_normals;
+    for (const auto& chunk : chunks) {
+        for (const auto& declaration : chunk.instances) {
+            auto mesh = mesh_indexes.find(declaration.mesh);
+            if (mesh == mesh_indexes.end()) {
+                throw std::runtime_error{"Unknown mesh " + declaration.mesh};
+            }
+            const Material* material = nullptr;
+            if (!declaration.material.empty()) {
+                auto it = materials.find(declaration.material);
+                if (it == materials.end()) {
+                    throw std::runtime_error{"Unknown material " + declaration.material};
+                }
+                material = &it->second;
+            }
+            instances.push_back(
+                {mesh->second, declaration.to_world, declaration.to_world.Inverse(), material,
+                 declaration.to_world.ApplyToBox(meshes[mesh->second].GetBounds())});
+        }
+    }
+    return {std::move(meshes), std::move(instances)};
+}
 
-            for (size_t i = 1; i < parsed.size(); ++i) {
-                const auto& string_point = parsed[i];
+// Files are parsed in newline-aligned chunks on a thread pool (thread_count == 0 means one
+// thread per hardware thread), then merged in file order: vertex offsets and the usemtl state
+// at each chunk start come from a prefix pass over the chunks, triangles are built in parallel.
+Scene ReadScene(const std::filesystem::path& path, size_t thread_count) {
+    static constexpr size_t kMinChunkSize = 1 << 20;
+    static constexpr size_t kChunksPerThread = 4;
 
-                if (string_point.find("//") != std::string::npos) {
-                    // case: x//y
-                    auto [x, y] = ParsePair(string_point);
+    MappedFile file(path);
+    auto text = file.GetContents();
 
-                    polygon_points.push_back(GetFromContainer(x, vertexes));
-                    optional_normals.push_back(GetFromContainer(y, normals));
-                } else if (string_point.find("/") != std::string::npos) {
-                    // case: x/y/z
-                    auto [x, y, z] = ParseTriple(string_point);
+    ThreadPool pool(thread_count);
+    auto chunk_count = std::min(pool.Size() * kChunksPerThread, text.size() / kMinChunkSize + 1);
+    auto texts = SplitIntoLineChunks(text, chunk_count);
 
-                    polygon_points.push_back(GetFromContainer(x, vertexes));
-                    optional_normals.push_back(GetFromContainer(z, normals));
-                } else {
-                    auto idx = static_cast<ssize_t>(std::stoi(parsed[i]));
+    std::vector<ObjChunk> chunks(texts.size());
+    std::vector<ThreadPool::Task> tasks;
+    for (size_t i = 0; i < texts.size(); ++i) {
+        tasks.emplace_back([&, i] { chunks[i] = ParseObjChunk(texts[i]); });
+    }
+    pool.Run(std::move(tasks));
 
-                    polygon_points.push_back(GetFromContainer(idx, vertexes));
-                    optional_normals.push_back({0, 0, 0});
-                }
+    std::vector<std::filesystem::path> source_files{path};
+    std::unordered_map<std::string, Material> materials;
+    for (const auto& chunk : chunks) {
+        for (const auto& library : chunk.material_libraries) {
+            source_files.push_back(path.parent_path() / library);
+            for (auto& [name, material] : ReadMaterials(source_files.back())) {
+                materials.insert_or_assign(name, std::move(material));
             }
+        }
+    }
+
+    auto [meshes, instances] = ReadInstances(path, chunks, materials, source_files, thread_count);
 
-            // creates triangle of form (0, i, i+1) from polygon
-            for (size_t idx = 1; idx < polygon_points.size() - 1; ++idx) {
-                Triangle triangle(polygon_points[0], polygon_points[idx], polygon_points[idx + 1]);
+    std::vector<Vector> vertexes;
+    std::vector<Vector> normals;
+    std::vector<SphereObject> sphere_objects;
+    std::vector<Light> light_objects;
 
-                std::array<Vector, 3> opt_normals = {optional_normals[0], optional_normals[idx],
-                                                     optional_normals[idx + 1]};
+    // per chunk: where its vertexes and normals start, material of each slot
+    std::vector<size_t> vertex_offsets, normal_offsets;
+    std::vector<std::vector<Material*>> chunk_materials;
+    Material* current_material = nullptr;
+    size_t triangle_count = 0;
 
-                Object object(current_material, triangle, opt_normals);
-                objects.push_back(object);
-            }
+    for (auto& chunk : chunks) {
+        vertex_offsets.push_back(vertexes.size());
+        normal_offsets.push_back(normals.size());
+        triangle_count += chunk.triangle_count;
 
-            continue;
+        auto& slots = chunk_materials.emplace_back();
+        slots.push_back(current_material);  // slot -1
+        for (const auto& name : chunk.material_names) {
+            slots.push_back(&materials[name]);
         }
+        current_material = slots.back();
 
-        if (parsed[0] == "mtllib") {
-            auto mtl_path = path.parent_path() / std::filesystem::path(parsed[1]);
-            materials = ReadMaterials(mtl_path);
+        vertexes.insert(vertexes.end(), chunk.vertexes.begin(), chunk.vertexes.end());
+        normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+        for (size_t i = 0; i < chunk.sphere_objects.size(); ++i) {
+            chunk.sphere_objects[i].material = slots[chunk.sphere_materials[i] + 1];
+            sphere_objects.push_back(chunk.sphere_objects[i]);
         }
+        light_objects.insert(light_objects.end(), chunk.light_objects.begin(),
+                             chunk.light_objects.end());
+    }
 
-        if (parsed[0] == "usemtl") {
-            current_material = &materials[parsed[1]];
+    // per chunk: vertex and normal indices of its triangles, their materials
+    struct ChunkTriangles {
+        std::vector<IndexedTriangles::Indices> vertex_indices;
+        std::vector<IndexedTriangles::Indices> normal_indices;
+        std::vector<const Material*> materials;
+        bool has_normals = false;
+    };
+    std::vector<ChunkTriangles> chunk_triangles(chunks.size());
+    tasks.clear();
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        tasks.emplace_back([&, i] {
+            const auto& chunk = chunks[i];
+            auto& triangles = chunk_triangles[i];
+            triangles.vertex_indices.reserve(chunk.triangle_count);
+            triangles.normal_indices.reserve(chunk.triangle_count);
+            triangles.materials.reserve(chunk.triangle_count);
+
+            auto vertex = [&](size_t index) {
+                return ResolveIndex(chunk.face_vertexes[index].vertex, vertex_offsets[i],
+                                    vertexes.size());
+            };
+            // a missing or zero normal leaves the triangle without normals (flat shaded)
+            auto normal = [&](size_t index) {
+                const auto& face_normal = chunk.face_vertexes[index].normal;
+                if (!face_normal) {
+                    return IndexedTriangles::kNoNormal;
+                }
+                auto normal = ResolveIndex(*face_normal, normal_offsets[i], normals.size());
+                return normals[normal] == Vector() ? IndexedTriangles::kNoNormal : normal;
+            };
+
+            for (const auto& face : chunk.faces) {
+                auto material = chunk_materials[i][face.material + 1];
+                auto first = face.first_vertex;
+                // creates triangle of form (0, i, i+1) from polygon
+                for (size_t idx = first + 1; idx + 1 < first + face.vertex_count; ++idx) {
+                    IndexedTriangles::Indices vertex_indices = {vertex(first), vertex(idx),
+                                                                vertex(idx + 1)};
+                    IndexedTriangles::Indices normal_indices = {normal(first), normal(idx),
+                                                                normal(idx + 1)};
+                    if (std::ranges::find(normal_indices, IndexedTriangles::kNoNormal) !=
+                        normal_indices.end()) {
+                        normal_indices.fill(IndexedTriangles::kNoNormal);
+                    } else {
+                        triangles.has_normals = true;
+                    }
+                    triangles.vertex_indices.push_back(vertex_indices);
+                    triangles.normal_indices.push_back(normal_indices);
+                    triangles.materials.push_back(material);
+                }
+            }
+        });
+    }
+    pool.Run(std::move(tasks));
+
+    bool has_normals = std::ranges::any_of(chunk_triangles, &ChunkTriangles::has_normals);
+    std::vector<IndexedTriangles::Indices> vertex_indices, normal_indices;
+    std::vector<const Material*> triangle_materials;
+    vertex_indices.reserve(triangle_count);
+    normal_indices.reserve(has_normals ? triangle_count : 0);
+    triangle_materials.reserve(triangle_count);
+    for (auto& chunk : chunk_triangles) {
+        vertex_indices.insert(vertex_indices.end(), chunk.vertex_indices.begin(),
+                              chunk.vertex_indices.end());
+        if (has_normals) {
+            normal_indices.insert(normal_indices.end(), chunk.normal_indices.begin(),
+                                  chunk.normal_indices.end());
         }
+        triangle_materials.insert(triangle_materials.end(), chunk.materials.begin(),
+                                  chunk.materials.end());
+        chunk = {};
+    }
+    if (!has_normals) {
+        std::vector<Vector>().swap(normals);
     }
 
-    return Scene(objects, sphere_objects, light_objects, materials);
+    Scene scene(IndexedTriangles(std::move(vertexes), std::move(vertex_indices),
+                                 std::move(normals), std::move(normal_indices)),
+                std::move(triangle_materials), std::move(sphere_objects),
+                std::move(light_objects), materials);
+    scene.SetInstances(std::move(meshes), std::move(instances));
+    scene.SetSourceFiles(std::move(source_files));
+    return scene;
 };
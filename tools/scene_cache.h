@@ -0,0 +1,440 @@
+#pragma once
+
+#include "scene.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Compiled scene cache: a parsed Scene with its BVH in a flat binary file, loaded with a memory
+// map and bulk copies instead of parsing and triangulating the OBJ again. The file remembers the
+// size, mtime and hash of every source .obj/.mtl, it goes stale when any of them changes.
+//
+// Layout, native endianness, every array is preceded by its uint64_t length:
+//   header, sources (path, CachedSource), materials (key, name, CachedMaterial),
+//   triangles (positions_quantized, normals_encoded, Vector[] positions, uint64_t[] quantized
+//   positions, origin, step, Vector[] normals, uint32_t[] encoded normals, vertex indices,
+//   normal indices, int64_t[] materials), CachedSphere[], Light[], has_bvh, BvhNode[], sphere
+//   ids (uint32_t[])
+// Bump kSceneCacheVersion whenever any of these changes.
+
+static constexpr char kSceneCacheMagic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+static constexpr uint32_t kSceneCacheVersion = 3;
+
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t scalar_size;
+};
+
+struct CachedSource {
+    uint64_t size;
+    int64_t mtime;  // nanoseconds since the file clock epoch
+    uint64_t hash;
+};
+
+struct CachedMaterial {
+    Vector ambient_color;
+    Vector diffuse_color;
+    Vector specular_color;
+    Vector intensity;
+    double specular_exponent;
+    double refraction_index;
+    Vector albedo;
+};
+
+struct CachedSphere {
+    int64_t material;  // index into the materials section, -1 for none
+    Vector center;
+    double radius;
+};
+
+static_assert(std::is_trivially_copyable_v<CachedMaterial>);
+static_assert(std::is_trivially_copyable_v<IndexedTriangles::Indices>);
+static_assert(std::is_trivially_copyable_v<Light>);
+static_assert(std::is_trivially_copyable_v<BvhNode>);
+
+// FNV-1a, only computed when a source's mtime changed but its size did not
+inline uint64_t HashBytes(std::string_view bytes) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char byte : bytes) {
+        hash = (hash ^ byte) * 1099511628211ull;
+    }
+    return hash;
+}
+
+inline CachedSource StatSource(const std::filesystem::path& path, bool with_hash) {
+    CachedSource source{std::filesystem::file_size(path),
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::filesystem::last_write_time(path).time_since_epoch())
+                            .count(),
+                        0};
+    if (with_hash) {
+        source.hash = HashBytes(MappedFile(path).GetContents());
+    }
+    return source;
+}
+
+inline bool IsSourceUnchanged(const std::filesystem::path& path, const CachedSource& cached) {
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(path, error) ||
+        std::filesystem::file_size(path, error) != cached.size) {
+        return false;
+    }
+    auto current = StatSource(path, false);
+    return current.mtime == cached.mtime || StatSource(path, true).hash == cached.hash;
+}
+
+inline std::filesystem::path GetSceneCachePath(const std::filesystem::path& scene_path) {
+    auto path = scene_path;
+    path += ".rtscene";
+    return path;
+}
+
+class SceneCacheWriter {
+public:
+    explicit SceneCacheWriter(const std::filesystem::path& path)
+        : output_(path, std::ios::binary | std::ios::trunc) {
+        if (!output_) {
+            throw std::runtime_error{"Can't write " + path.string()};
+        }
+    }
+
+    template <class Pod>
+    void Write(const Pod& value) {
+        static_assert(std::is_trivially_copyable_v<Pod>);
+        output_.write(reinterpret_cast<const char*>(&value), sizeof(Pod));
+    }
+
+    template <class Pod>
+    void WriteArray(const std::vector<Pod>& values) {
+        static_assert(std::is_trivially_copyable_v<Pod>);
+        Write(static_cast<uint64_t>(values.size()));
+        output_.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(Pod));
+    }
+
+    void WriteString(std::string_view string) {
+        Write(static_cast<uint64_t>(string.size()));
+        output_.write(string.data(), string.size());
+    }
+
+    void Close() {
+        output_.close();
+        if (!output_) {
+            throw std::runtime_error{"Can't write scene cache"};
+        }
+    }
+
+private:
+    std::ofstream output_;
+};
+
+// Bounds checked cursor over the mapped file, throws on a truncated or corrupted cache.
+class SceneCacheReader {
+public:
+    explicit SceneCacheReader(std::string_view contents) : contents_(contents) {
+    }
+
+    template <class Pod>
+    Pod Read() {
+        Pod value;
+        std::memcpy(&value, Take(sizeof(Pod)), sizeof(Pod));
+        return value;
+    }
+
+    template <class Pod>
+    std::vector<Pod> ReadArray() {
+        auto size = Read<uint64_t>();
+        if (size > contents_.size() / sizeof(Pod)) {
+            throw std::runtime_error{"Corrupted scene cache"};
+        }
+        std::vector<Pod> values(size);
+        std::memcpy(values.data(), Take(size * sizeof(Pod)), size * sizeof(Pod));
+        return values;
+    }
+
+    // count of a list of variable size entries, each takes at least a uint64_t length field
+    uint64_t ReadCount() {
+        auto count = Read<uint64_t>();
+        if (count > contents_.size() / sizeof(uint64_t)) {
+            throw std::runtime_error{"Corrupted scene cache"};
+        }
+        return count;
+    }
+
+    std::string ReadString() {
+        auto size = Read<uint64_t>();
+        return std::string(Take(size), size);
+    }
+
+private:
+    const char* Take(size_t size) {
+        if (size > contents_.size()) {
+            throw std::runtime_error{"Corrupted scene cache"};
+        }
+        auto data = contents_.data();
+        contents_.remove_prefix(size);
+        return data;
+    }
+
+    std::string_view contents_;
+};
+
+// Writes scene (and its BVH if built) to cache_path, through a temporary file renamed into place
+// so concurrent readers never see a partial cache. Scenes with instances aren't cached, their
+// meshes load once anyway.
+inline void WriteSceneCache(const Scene& scene, const std::filesystem::path& cache_path) {
+    if (!scene.GetInstances().empty()) {
+        throw std::runtime_error{"Scenes with instances can't be cached"};
+    }
+    auto temporary_path = cache_path;
+    temporary_path += ".tmp";
+
+    SceneCacheWriter writer(temporary_path);
+    SceneCacheHeader header{{}, kSceneCacheVersion, sizeof(double)};
+    std::memcpy(header.magic, kSceneCacheMagic, sizeof(header.magic));
+    writer.Write(header);
+
+    writer.Write(static_cast<uint64_t>(scene.GetSourceFiles().size()));
+    for (const auto& source : scene.GetSourceFiles()) {
+        writer.WriteString(std::filesystem::absolute(source).string());
+        writer.Write(StatSource(source, true));
+    }
+
+    std::unordered_map<const Material*, int64_t> material_indexes;
+    writer.Write(static_cast<uint64_t>(scene.GetMaterials().size()));
+    for (const auto& [name, material] : scene.GetMaterials()) {
+        material_indexes.emplace(&material, std::ssize(material_indexes));
+        writer.WriteString(name);
+        writer.WriteString(material.name);
+        writer.Write(CachedMaterial{material.ambient_color, material.diffuse_color,
+                                    material.specular_color, material.intensity,
+                                    material.specular_exponent, material.refraction_index,
+                                    material.albedo});
+    }
+    auto material_index = [&](const Material* material) {
+        return material ? material_indexes.at(material) : int64_t{-1};
+    };
+
+    const auto& triangles = scene.GetTriangles();
+    writer.Write(static_cast<uint8_t>(triangles.ArePositionsQuantized()));
+    writer.Write(static_cast<uint8_t>(triangles.AreNormalsEncoded()));
+    writer.WriteArray(triangles.GetPositions());
+    writer.WriteArray(triangles.GetQuantizedPositions());
+    writer.Write(triangles.GetQuantizationOrigin());
+    writer.Write(triangles.GetQuantizationStep());
+    writer.WriteArray(triangles.GetNormals());
+    writer.WriteArray(triangles.GetEncodedNormals());
+    writer.WriteArray(triangles.GetVertexIndices());
+    writer.WriteArray(triangles.GetNormalIndices());
+    std::vector<int64_t> triangle_materials;
+    triangle_materials.reserve(triangles.Size());
+    for (const auto* material : scene.GetTriangleMaterials()) {
+        triangle_materials.push_back(material_index(material));
+    }
+    writer.WriteArray(triangle_materials);
+
+    std::vector<CachedSphere> spheres;
+    for (const auto& object : scene.GetSphereObjects()) {
+        spheres.push_back({material_index(object.material), object.sphere.GetCenter(),
+                           object.sphere.GetRadius()});
+    }
+    writer.WriteArray(spheres);
+    writer.WriteArray(scene.GetLights());
+
+    writer.Write(static_cast<uint8_t>(scene.GetBvh().has_value()));
+    writer.WriteArray(scene.GetBvh() ? scene.GetBvh()->GetNodes() : std::vector<BvhNode>{});
+    writer.WriteArray(scene.GetSphereIds());
+
+    try {
+        writer.Close();
+        std::filesystem::rename(temporary_path, cache_path);
+    } catch (...) {
+        std::error_code error;
+        std::filesystem::remove(temporary_path, error);
+        throw;
+    }
+}
+
+// Whether cached nodes form a tree traversal can walk unchecked: leaf ranges within the
+// triangles and spheres, children after their parent (no cycles) and no deeper than the
+// traversal stacks.
+inline bool IsValidBvh(const std::vector<BvhNode>& nodes, size_t triangle_count,
+                       size_t sphere_count) {
+    std::vector<size_t> depths(nodes.size());
+    for (size_t index = 0; index < nodes.size(); ++index) {
+        const auto& node = nodes[index];
+        if (node.IsLeaf()) {
+            if (uint64_t{node.first} + node.triangle_count > triangle_count ||
+                uint64_t{node.first_sphere} + node.sphere_count > sphere_count) {
+                return false;
+            }
+            continue;
+        }
+        if (node.first <= index || uint64_t{node.first} + 1 >= nodes.size() ||
+            depths[index] + 1 >= Bvh::kMaxDepth) {
+            return false;
+        }
+        for (auto child : {node.first, node.first + 1}) {
+            depths[child] = std::max(depths[child], depths[index] + 1);
+        }
+    }
+    return true;
+}
+
+// The cached scene, or nullopt when the cache is missing, from another version or stale.
+inline std::optional<Scene> ReadSceneCache(const std::filesystem::path& cache_path) {
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(cache_path, error)) {
+        return std::nullopt;
+    }
+
+    MappedFile file(cache_path);
+    SceneCacheReader reader(file.GetContents());
+
+    auto header = reader.Read<SceneCacheHeader>();
+    if (std::memcmp(header.magic, kSceneCacheMagic, sizeof(header.magic)) != 0 ||
+        header.version != kSceneCacheVersion || header.scalar_size != sizeof(double)) {
+        return std::nullopt;
+    }
+
+    std::vector<std::filesystem::path> source_files(reader.ReadCount());
+    for (auto& source : source_files) {
+        source = reader.ReadString();
+        if (!IsSourceUnchanged(source, reader.Read<CachedSource>())) {
+            return std::nullopt;
+        }
+    }
+
+    std::unordered_map<std::string, Material> materials;
+    std::vector<const Material*> material_pointers(reader.ReadCount());
+    for (auto& pointer : material_pointers) {
+        auto& material = materials[reader.ReadString()];
+        material.name = reader.ReadString();
+        auto cached = reader.Read<CachedMaterial>();
+        material.ambient_color = cached.ambient_color;
+        material.diffuse_color = cached.diffuse_color;
+        material.specular_color = cached.specular_color;
+        material.intensity = cached.intensity;
+        material.specular_exponent = cached.specular_exponent;
+        material.refraction_index = cached.refraction_index;
+        material.albedo = cached.albedo;
+        pointer = &material;
+    }
+    auto material_pointer = [&](int64_t index) -> const Material* {
+        if (index < -1 || index >= std::ssize(material_pointers)) {
+            throw std::runtime_error{"Corrupted scene cache"};
+        }
+        return index < 0 ? nullptr : material_pointers[index];
+    };
+
+    auto positions_quantized = reader.Read<uint8_t>();
+    auto normals_encoded = reader.Read<uint8_t>();
+    auto positions = reader.ReadArray<Vector>();
+    auto quantized_positions = reader.ReadArray<uint64_t>();
+    auto origin = reader.Read<Vector>();
+    auto step = reader.Read<Vector>();
+    auto normals = reader.ReadArray<Vector>();
+    auto encoded_normals = reader.ReadArray<uint32_t>();
+    auto vertex_indices = reader.ReadArray<IndexedTriangles::Indices>();
+    auto normal_indices = reader.ReadArray<IndexedTriangles::Indices>();
+    auto cached_materials = reader.ReadArray<int64_t>();
+
+    // the kernels index the pools unchecked
+    auto vertex_count = positions_quantized ? quantized_positions.size() : positions.size();
+    auto normal_count = normals_encoded ? encoded_normals.size() : normals.size();
+    auto is_out_of = [](const IndexedTriangles::Indices& indices, size_t count, bool optional) {
+        return std::ranges::any_of(indices, [&](uint32_t index) {
+            return index >= count && !(optional && index == IndexedTriangles::kNoNormal);
+        });
+    };
+    if (std::ranges::any_of(vertex_indices, [&](const auto& indices) {
+            return is_out_of(indices, vertex_count, false);
+        }) ||
+        std::ranges::any_of(normal_indices, [&](const auto& indices) {
+            return is_out_of(indices, normal_count, true);
+        }) ||
+        (!normal_indices.empty() && normal_indices.size() != vertex_indices.size()) ||
+        cached_materials.size() != vertex_indices.size()) {
+        throw std::runtime_error{"Corrupted scene cache"};
+    }
+
+    IndexedTriangles triangles(std::move(positions), std::move(vertex_indices),
+                               std::move(normals), std::move(normal_indices));
+    if (positions_quantized) {
+        triangles.SetQuantizedPositions(std::move(quantized_positions), origin, step);
+    }
+    if (normals_encoded) {
+        triangles.SetEncodedNormals(std::move(encoded_normals));
+    }
+    std::vector<const Material*> triangle_materials;
+    triangle_materials.reserve(cached_materials.size());
+    for (auto material : cached_materials) {
+        triangle_materials.push_back(material_pointer(material));
+    }
+
+    std::vector<SphereObject> sphere_objects;
+    for (const auto& sphere : reader.ReadArray<CachedSphere>()) {
+        sphere_objects.push_back(
+            {material_pointer(sphere.material), Sphere(sphere.center, sphere.radius)});
+    }
+
+    auto lights = reader.ReadArray<Light>();
+    auto has_bvh = reader.Read<uint8_t>();
+    auto nodes = reader.ReadArray<BvhNode>();
+    auto sphere_ids = reader.ReadArray<uint32_t>();
+    if (sphere_ids.size() != sphere_objects.size() ||
+        (has_bvh && !IsValidBvh(nodes, triangles.Size(), sphere_objects.size()))) {
+        throw std::runtime_error{"Corrupted scene cache"};
+    }
+
+    Scene scene(std::move(triangles), std::move(triangle_materials), std::move(sphere_objects),
+                std::move(lights), materials);
+    scene.SetSourceFiles(std::move(source_files));
+    scene.SetSphereIds(std::move(sphere_ids));
+    if (has_bvh) {
+        scene.SetBvh(Bvh(std::move(nodes)));
+    }
+    return scene;
+}
+
+// Parses the OBJ at path and writes it, BVH included, to its cache, returns the scene.
+inline Scene CompileScene(const std::filesystem::path& path, size_t thread_count = 0) {
+    auto scene = ReadScene(path, thread_count);
+    scene.BuildBvh();
+    WriteSceneCache(scene, GetSceneCachePath(path));
+    return scene;
+}
+
+// ReadScene through the cache next to the OBJ (<scene>.rtscene): loads it when fresh, otherwise
+// parses the OBJ and refreshes the cache. A corrupted cache is rebuilt, a cache that can't be
+// written (read-only asset directory) only costs the speedup.
+inline Scene ReadSceneCached(const std::filesystem::path& path, size_t thread_count = 0) {
+    auto cache_path = GetSceneCachePath(path);
+    try {
+        if (auto scene = ReadSceneCache(cache_path)) {
+            return std::move(*scene);
+        }
+    } catch (const std::runtime_error&) {
+    }
+
+    auto scene = ReadScene(path, thread_count);
+    scene.BuildBvh();
+    try {
+        WriteSceneCache(scene, cache_path);
+    } catch (const std::runtime_error&) {
+    }
+    return scene;
+}
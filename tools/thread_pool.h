@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Fixed set of workers, each with its own task deque. A worker pops from the back of its own
+// deque and, once it runs dry, steals from the front of the others, so uneven tasks balance out.
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    // thread_count == 0 means one worker per hardware thread
+    explicit ThreadPool(size_t thread_count = 0) {
+        if (thread_count == 0) {
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+        }
+        queues_.reserve(thread_count);
+        for (size_t i = 0; i < thread_count; ++i) {
+            queues_.push_back(std::make_unique<Queue>());
+        }
+        workers_.reserve(thread_count);
+        for (size_t i = 0; i < thread_count; ++i) {
+            workers_.emplace_back([this, i] { WorkerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t Size() const {
+        return workers_.size();
+    }
+
+    // Runs all tasks and blocks until they are finished, rethrows the first exception thrown by
+    // a task. Not reentrant: tasks must not call Run on the same pool.
+    void Run(std::vector<Task> tasks) {
+        if (tasks.empty()) {
+            return;
+        }
+
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            auto& queue = *queues_[i % queues_.size()];
+            std::lock_guard lock(queue.mutex);
+            queue.tasks.push_back(std::move(tasks[i]));
+        }
+
+        {
+            std::lock_guard lock(mutex_);
+            unfinished_ = tasks.size();
+            queued_ += tasks.size();
+            error_ = nullptr;
+        }
+        wake_.notify_all();
+
+        std::unique_lock lock(mutex_);
+        done_.wait(lock, [this] { return unfinished_ == 0; });
+        if (error_) {
+            std::rethrow_exception(std::exchange(error_, nullptr));
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool TryPop(size_t index, Task& task) {
+        {
+            auto& own = *queues_[index];
+            std::lock_guard lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t shift = 1; shift < queues_.size(); ++shift) {
+            auto& victim = *queues_[(index + shift) % queues_.size()];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void WorkerLoop(size_t index) {
+        while (true) {
+            {
+                std::unique_lock lock(mutex_);
+                wake_.wait(lock, [this] { return stop_ || queued_ > 0; });
+                if (queued_ == 0) {
+                    return;
+                }
+            }
+
+            Task task;
+            if (!TryPop(index, task)) {
+                // another worker took the last task between the wake up and the pop
+                std::this_thread::yield();
+                continue;
+            }
+
+            {
+                std::lock_guard lock(mutex_);
+                --queued_;
+            }
+
+            std::exception_ptr error;
+            try {
+                task();
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard lock(mutex_);
+            if (error && !error_) {
+                error_ = error;
+            }
+            if (--unfinished_ == 0) {
+                done_.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    size_t queued_ = 0;
+    size_t unfinished_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+};